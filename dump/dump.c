@@ -14,6 +14,7 @@
 
 #include "exfat_ondisk.h"
 #include "libexfat.h"
+#include "mem_wrapper.h"
 
 #define EXFAT_MIN_SECT_SIZE_BITS		9
 #define EXFAT_MAX_SECT_SIZE_BITS		12
@@ -206,7 +207,7 @@ static int exfat_show_ondisk_all_info(struct exfat_blk_dev *bd)
 	free(bitmap);
 
 free_volume_label:
-	free(volume_label);
+	w_free(volume_label);
 free_entry:
 	free(ed);
 free_ppbr:
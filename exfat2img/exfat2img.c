@@ -67,7 +67,6 @@ struct exfat_stat {
 static struct exfat2img_hdr ei_hdr;
 static struct exfat2img ei;
 static struct exfat_stat exfat_stat;
-static struct path_resolve_ctx path_resolve_ctx;
 
 static struct option opts[] = {
 	{"output",	required_argument,	NULL,	'o' },
@@ -92,6 +91,7 @@ static void usage(const char *name)
 		exfat_err("ERROR: %s: " fmt,		\
 			path_resolve_ctx.local_path,	\
 			##__VA_ARGS__);			\
+		exfat_release_path(&path_resolve_ctx);	\
 })
 
 static void free_exfat2img(struct exfat2img *ei)
@@ -114,7 +114,7 @@ static int create_exfat2img(struct exfat2img *ei,
 {
 	int err;
 
-	ei->exfat = exfat_alloc_exfat(&ei->bdev, bs);
+	ei->exfat = exfat_alloc_exfat(&ei->bdev, bs, NULL);
 	if (!ei->exfat)
 		return -ENOMEM;
 
@@ -124,6 +124,9 @@ static int create_exfat2img(struct exfat2img *ei,
 		goto err;
 	}
 
+	if (exfat_prefetch_init(ei->exfat, EXFAT_READAHEAD_BLOCKS))
+		exfat_debug("no memory for directory read-ahead\n");
+
 	ei->scan_bdesc = exfat_alloc_buffer(ei->exfat);
 	if (!ei->scan_bdesc) {
 		err = -ENOMEM;
@@ -293,7 +296,7 @@ static int read_file_dentry_set(struct exfat_de_iter *iter,
 {
 	struct exfat_dentry *file_de, *stream_de, *dentry;
 	struct exfat_inode *node = NULL;
-	int i, ret;
+	int i, ret, name_de_count;
 
 	ret = exfat_de_iter_get(iter, 0, &file_de);
 	if (ret || file_de->type != EXFAT_FILE) {
@@ -309,11 +312,13 @@ static int read_file_dentry_set(struct exfat_de_iter *iter,
 	}
 
 	*new_node = NULL;
-	node = exfat_alloc_inode(le16_to_cpu(file_de->file_attr));
+	name_de_count = MIN(file_de->file_num_ext, 1 + MAX_NAME_DENTRIES) - 1;
+	node = exfat_alloc_inode_name(le16_to_cpu(file_de->file_attr),
+				      MAX(name_de_count, 0) * ENTRY_NAME_MAX);
 	if (!node)
 		return -ENOMEM;
 
-	for (i = 2; i <= MIN(file_de->file_num_ext, 1 + MAX_NAME_DENTRIES); i++) {
+	for (i = 2; i <= name_de_count + 1; i++) {
 		ret = exfat_de_iter_get(iter, i, &dentry);
 		if (ret || dentry->type != EXFAT_NAME)
 			break;
@@ -500,7 +505,7 @@ err:
 static int dump_filesystem(struct exfat2img *ei)
 {
 	struct exfat *exfat = ei->exfat;
-	struct exfat_inode *dir;
+	struct exfat_inode *dir, *next;
 	int ret = 0, dir_errors;
 	clus_t clus_count;
 	off_t end_file_offset;
@@ -524,6 +529,15 @@ static int dump_filesystem(struct exfat2img *ei)
 			goto out;
 		}
 
+		if (dir->list.next != &exfat->dir_list) {
+			next = list_entry(dir->list.next,
+					  struct exfat_inode, list);
+			exfat_prefetch_hint(exfat, next->first_clus,
+					    next->size);
+		} else {
+			exfat_prefetch_hint(exfat, 0, 0);
+		}
+
 		dir_errors = read_children(ei, dir, &end_file_offset);
 		if (!dir_errors) {
 			dump_directory(ei, dir, (size_t)end_file_offset,
@@ -534,6 +548,7 @@ static int dump_filesystem(struct exfat2img *ei)
 			exfat_resolve_path(&path_resolve_ctx, dir);
 			exfat_debug("failed to check dentries: %s\n",
 				    path_resolve_ctx.local_path);
+			exfat_release_path(&path_resolve_ctx);
 			ret = dir_errors;
 		}
 
@@ -641,8 +656,9 @@ static int dump_clusters_to_stdout(struct exfat2img *ei,
 static int dump_to_stdout(struct exfat2img *ei)
 {
 	struct exfat *exfat = ei->exfat;
+	struct exfat_bitmap_iter iter;
 	off_t start_off, end_off;
-	unsigned int clu, last_clu, next_clu;
+	unsigned int clu, last_clu, count;
 	unsigned int start_clu, end_clu;
 
 	start_off = 0;
@@ -652,20 +668,31 @@ static int dump_to_stdout(struct exfat2img *ei)
 		return -EIO;
 	}
 
+	/* read and write clusters for allocated ones, zeroes for free ones */
+	exfat_bitmap_iter_init(exfat, &iter, exfat->alloc_bitmap,
+			       EXFAT_FIRST_CLUSTER);
 	clu = EXFAT_FIRST_CLUSTER;
 	last_clu = clu + exfat->clus_count;
 	while (clu < last_clu) {
-		/* read and write clusters for allocated ones */
-		start_clu = 0;
-		while (clu < last_clu &&
-		       exfat_bitmap_get(exfat->alloc_bitmap, clu)) {
-			if (!start_clu)
-				start_clu = clu;
-			end_clu = clu;
-			clu++;
+		if (!exfat_bitmap_iter_next(&iter, 1, &start_clu, &count)) {
+			start_clu = last_clu;
+			count = 0;
+		}
+
+		if (clu < start_clu) {
+			if (dump_clusters_to_stdout(ei, clu, start_clu - 1,
+						    true) < 0) {
+				start_off = exfat_c2o(exfat, clu);
+				end_off = exfat_c2o(exfat, start_clu - 1);
+				exfat_err("failed to dump zero range from %llx to %llx\n",
+					  (unsigned long long)start_off,
+					  (unsigned long long)end_off);
+				return -EIO;
+			}
 		}
 
-		if (start_clu) {
+		if (count) {
+			end_clu = start_clu + count - 1;
 			if (dump_clusters_to_stdout(ei, start_clu, end_clu, false) < 0) {
 				start_off = exfat_c2o(exfat, start_clu);
 				end_off = exfat_c2o(exfat, end_clu);
@@ -676,26 +703,7 @@ static int dump_to_stdout(struct exfat2img *ei)
 			}
 		}
 
-		/* exit if all of the remaining clusters are free */
-		if (clu >= last_clu)
-			break;
-		if (exfat_bitmap_find_one(exfat, exfat->alloc_bitmap,
-					  clu, &next_clu))
-			next_clu = EXFAT_FIRST_CLUSTER + exfat->clus_count;
-
-		/* write zeroes for free clusters */
-		start_clu = clu;
-		end_clu = next_clu - 1;
-		if (dump_clusters_to_stdout(ei, start_clu, end_clu, true) < 0) {
-			start_off = exfat_c2o(exfat, start_clu);
-			end_off = exfat_c2o(exfat, end_clu);
-			exfat_err("failed to dump zero range from %llx to %llx\n",
-				  (unsigned long long)start_off,
-				  (unsigned long long)end_off);
-			return -EIO;
-		}
-
-		clu = next_clu;
+		clu = start_clu + count;
 	}
 
 	return 0;
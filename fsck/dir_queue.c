@@ -0,0 +1,440 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Queue of directories to read. Queued directories are small records
+ *   in a ring, read from its head for breadth-first order or from its
+ *   tail for depth-first. the ones with queued subdirectories are kept
+ *   in a table until the last of them has been read. with a memory
+ *   budget, a full ring moves batches of directories to a scratch area,
+ *   or the directory being read is paused until its subdirectories are.
+ *   once the table is full, a directory is read without a record, and
+ *   the paths of its subdirectories end at it.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "exfat_ondisk.h"
+#include "libexfat.h"
+#include "exfat_fs.h"
+#include "dir_queue.h"
+#include "mem_wrapper.h"
+
+static unsigned int dir_queue_pending(struct dir_queue *q)
+{
+	return q->count + q->spill_count * q->batch;
+}
+
+static void dir_queue_update_peak(struct dir_queue *q)
+{
+	size_t bytes;
+
+	bytes = (q->ring_size + q->rec_alloc) * sizeof(struct dir_rec) +
+		q->rec_alloc * sizeof(struct dir_pause);
+	if (bytes > q->peak_bytes)
+		q->peak_bytes = bytes;
+	if (dir_queue_pending(q) > q->peak)
+		q->peak = dir_queue_pending(q);
+}
+
+/* take the newest directory next, for depth-first order */
+static bool dir_queue_lifo(struct dir_queue *q)
+{
+	return q->order == DIR_QUEUE_DFS ||
+		(q->order == DIR_QUEUE_HYBRID &&
+		 dir_queue_pending(q) > DIR_QUEUE_HYBRID_CAP);
+}
+
+static int dir_queue_grow_ring(struct dir_queue *q)
+{
+	struct dir_rec *ring;
+	unsigned int size, i;
+
+	size = q->ring_size ? q->ring_size * 2 : DIR_QUEUE_MIN_SIZE;
+	ring = w_malloc(size * sizeof(*ring));
+	if (!ring)
+		return -ENOMEM;
+
+	for (i = 0; i < q->count; i++)
+		ring[i] = q->ring[(q->head + i) & (q->ring_size - 1)];
+	if (q->ring)
+		w_free(q->ring);
+	q->ring = ring;
+	q->ring_size = size;
+	q->head = 0;
+	return 0;
+}
+
+/*
+ * write a batch of the directories which are read last to the scratch
+ * area, the oldest ones for depth-first order and the newest ones
+ * otherwise. the batches are written one after another.
+ */
+static int dir_queue_spill(struct dir_queue *q)
+{
+	unsigned int start, n;
+	off64_t offset;
+	size_t bytes;
+
+	if (!q->batch)
+		q->batch = MIN(DIR_QUEUE_SPILL_BATCH, q->ring_size / 2);
+	bytes = q->batch * sizeof(struct dir_rec);
+
+	if (q->spill_count == q->spill_alloc) {
+		if (exfat_scratch_reserve(q->scratch, bytes, &offset))
+			return -ENOSPC;
+		if (!q->spill_alloc)
+			q->spill_base = offset;
+		else if (offset != q->spill_base +
+			 (off64_t)q->spill_alloc * (off64_t)bytes)
+			return -ENOSPC;
+		q->spill_alloc++;
+	}
+	offset = q->spill_base + (off64_t)q->spill_count * (off64_t)bytes;
+
+	if (dir_queue_lifo(q))
+		start = q->head;
+	else
+		start = (q->head + q->count - q->batch) & (q->ring_size - 1);
+
+	/* the batch may wrap around the end of the ring */
+	n = MIN(q->batch, q->ring_size - start);
+	if (exfat_write(q->scratch->fd, &q->ring[start],
+			n * sizeof(struct dir_rec), offset) !=
+	    (ssize64_t)(n * sizeof(struct dir_rec)))
+		return -EIO;
+	if (n < q->batch &&
+	    exfat_write(q->scratch->fd, q->ring,
+			(q->batch - n) * sizeof(struct dir_rec),
+			offset + n * sizeof(struct dir_rec)) !=
+	    (ssize64_t)((q->batch - n) * sizeof(struct dir_rec)))
+		return -EIO;
+
+	if (dir_queue_lifo(q))
+		q->head = (q->head + q->batch) & (q->ring_size - 1);
+	q->count -= q->batch;
+	q->spill_count++;
+	q->spill_writes++;
+	return 0;
+}
+
+/* read the last written batch into the empty ring */
+static int dir_queue_reload(struct dir_queue *q)
+{
+	size_t bytes = q->batch * sizeof(struct dir_rec);
+	off64_t offset;
+
+	offset = q->spill_base +
+		 (off64_t)(q->spill_count - 1) * (off64_t)bytes;
+	if (exfat_read(q->scratch->fd, q->ring, bytes, offset) !=
+	    (ssize64_t)bytes)
+		return -EIO;
+
+	q->head = 0;
+	q->count = q->batch;
+	q->spill_count--;
+	q->spill_reads++;
+	return 0;
+}
+
+/*
+ * make room for a directory in the full ring. past the budget or out of
+ * memory, spill to the scratch area. without one, or once it is full,
+ * go depth-first to keep the queue short and return -ENOSPC.
+ */
+static int dir_queue_make_room(struct dir_queue *q)
+{
+	if (!q->max_size || q->ring_size < q->max_size) {
+		if (!dir_queue_grow_ring(q))
+			return 0;
+	}
+
+	if (q->scratch && q->ring_size && !dir_queue_spill(q))
+		return 0;
+
+	if (q->order != DIR_QUEUE_DFS) {
+		exfat_debug("directory queue is over budget, going depth-first\n");
+		q->order = DIR_QUEUE_DFS;
+	}
+	return -ENOSPC;
+}
+
+static int dir_queue_grow_recs(struct dir_queue *q)
+{
+	struct dir_rec *recs;
+	struct dir_pause *pauses;
+	unsigned int alloc, i;
+
+	alloc = q->rec_alloc ? q->rec_alloc * 2 : DIR_QUEUE_MIN_SIZE;
+	if (q->rec_max && alloc > q->rec_max)
+		return -ENOSPC;
+	recs = w_malloc(alloc * sizeof(*recs));
+	if (!recs)
+		return -ENOMEM;
+
+	/* every paused directory holds a record, so pausing never fails */
+	pauses = w_malloc(alloc * sizeof(*pauses));
+	if (!pauses) {
+		w_free(recs);
+		return -ENOMEM;
+	}
+
+	if (q->recs) {
+		memcpy(recs, q->recs, q->rec_alloc * sizeof(*recs));
+		memcpy(pauses, q->pauses, q->pause_count * sizeof(*pauses));
+		w_free(q->recs);
+		w_free(q->pauses);
+	}
+	q->pauses = pauses;
+	for (i = alloc; i > q->rec_alloc; i--) {
+		recs[i - 1].parent = q->free_rec;
+		q->free_rec = i - 1;
+	}
+	q->recs = recs;
+	q->rec_alloc = alloc;
+	return 0;
+}
+
+/*
+ * make sure that the next directory can be queued. return -ENOSPC if the
+ * ring is full and cannot grow or spill, the directory being read should
+ * then be paused.
+ */
+int dir_queue_reserve(struct dir_queue *q)
+{
+	if (q->count < q->ring_size)
+		return 0;
+	return dir_queue_make_room(q);
+}
+
+/* queue @dir whose parent is the record @parent, or DIR_REC_NONE */
+int dir_queue_push(struct dir_queue *q, struct exfat_inode *dir,
+		   __u32 parent)
+{
+	struct dir_rec *rec;
+	int err;
+
+	if (q->count == q->ring_size) {
+		err = dir_queue_make_room(q);
+		if (err)
+			return err;
+	}
+
+	rec = &q->ring[(q->head + q->count) & (q->ring_size - 1)];
+	rec->size = dir->size;
+	rec->first_clus = dir->first_clus;
+	rec->parent = parent;
+	rec->refs = 0;
+	rec->is_contiguous = dir->is_contiguous;
+	rec->dropped = false;
+	rec->paused = false;
+	q->count++;
+
+	if (parent != DIR_REC_NONE && parent != DIR_REC_LOST)
+		q->recs[parent].refs++;
+	dir_queue_update_peak(q);
+	return 0;
+}
+
+/*
+ * move the next directory to the table and return its index in @idx,
+ * it is held until dir_queue_put(). return EOF if the queue is empty.
+ * depth-first takes the newest directory, so the queue only holds the
+ * unread siblings of the directories on the current path.
+ * a paused directory is taken again once the directories queued after
+ * it are read, with the offset to go on from in @resume. it is 0 for a
+ * directory read from its start.
+ * without a free record, the directory is held as DIR_REC_LOST. it
+ * cannot be paused, and its subdirectories are queued without a parent.
+ */
+int dir_queue_pop(struct dir_queue *q, __u32 *idx, off64_t *resume)
+{
+	struct dir_pause *pause;
+	struct dir_rec *rec;
+	unsigned int pos;
+	int err;
+
+	if (q->free_rec == DIR_REC_NONE)
+		dir_queue_grow_recs(q);
+
+	while (1) {
+		pause = q->pause_count ? &q->pauses[q->pause_count - 1] : NULL;
+		if (pause && dir_queue_pending(q) <= pause->mark) {
+			q->pause_count--;
+			q->recs[pause->idx].paused = false;
+			*idx = pause->idx;
+			*resume = pause->resume;
+			return 0;
+		}
+
+		if (!q->count) {
+			if (!q->spill_count)
+				return EOF;
+			err = dir_queue_reload(q);
+			if (err)
+				return err;
+		}
+
+		if (dir_queue_lifo(q)) {
+			pos = (q->head + q->count - 1) & (q->ring_size - 1);
+		} else {
+			pos = q->head;
+			q->head = (q->head + 1) & (q->ring_size - 1);
+		}
+		q->count--;
+
+		rec = &q->ring[pos];
+		if (rec->parent == DIR_REC_NONE ||
+		    rec->parent == DIR_REC_LOST ||
+		    !q->recs[rec->parent].dropped)
+			break;
+		dir_queue_put(q, rec->parent);
+	}
+
+	*resume = 0;
+	if (q->free_rec == DIR_REC_NONE) {
+		q->lost = *rec;
+		q->lost.refs = 1;
+		q->lost_count++;
+		*idx = DIR_REC_LOST;
+		return 0;
+	}
+
+	*idx = q->free_rec;
+	q->free_rec = q->recs[*idx].parent;
+	q->recs[*idx] = *rec;
+	q->recs[*idx].refs = 1;
+	dir_queue_update_peak(q);
+	return 0;
+}
+
+/*
+ * stop reading the held directory @idx at @resume, because its next
+ * subdirectory has no room in the queue. it keeps its reference and is
+ * read on from @resume once its queued subdirectories are read, which
+ * depth-first order takes first.
+ */
+void dir_queue_pause(struct dir_queue *q, __u32 idx, off64_t resume)
+{
+	struct dir_pause *pause = &q->pauses[q->pause_count++];
+	unsigned int pending = dir_queue_pending(q);
+	unsigned int children = MAX(q->recs[idx].refs - 1, 1);
+
+	pause->idx = idx;
+	pause->resume = resume;
+	pause->mark = pending > children ? pending - children : 0;
+	q->recs[idx].paused = true;
+	q->order = DIR_QUEUE_DFS;
+}
+
+/*
+ * return the directory which dir_queue_pop() would take now, or NULL if
+ * the ring is empty. it may still be skipped, or not be the next one
+ * once more directories are queued.
+ */
+struct dir_rec *dir_queue_peek(struct dir_queue *q)
+{
+	if (!q->count)
+		return NULL;
+	if (dir_queue_lifo(q))
+		return &q->ring[(q->head + q->count - 1) & (q->ring_size - 1)];
+	return &q->ring[q->head];
+}
+
+/* drop a reference to @idx, and to its parents which are done */
+void dir_queue_put(struct dir_queue *q, __u32 idx)
+{
+	__u32 parent;
+
+	/* the directory held without a record holds its parent */
+	if (idx == DIR_REC_LOST)
+		idx = q->lost.parent;
+
+	while (idx != DIR_REC_NONE && idx != DIR_REC_LOST &&
+	       --q->recs[idx].refs == 0) {
+		parent = q->recs[idx].parent;
+		q->recs[idx].parent = q->free_rec;
+		q->free_rec = idx;
+		idx = parent;
+	}
+}
+
+/*
+ * skip the subdirectories of @idx which are still queued. those of the
+ * directory held without a record have no parent to tell them by.
+ */
+void dir_queue_drop_children(struct dir_queue *q, __u32 idx)
+{
+	dir_queue_rec(q, idx)->dropped = true;
+}
+
+/* entries of a ring of at most @budget bytes */
+static unsigned int dir_queue_ring_max(size_t budget)
+{
+	unsigned int size = DIR_QUEUE_MIN_SIZE;
+
+	while ((size_t)size * 2 * sizeof(struct dir_rec) <= budget)
+		size *= 2;
+	return size;
+}
+
+/* heap of @alloc records and pauses, and of the half they grew from */
+static size_t dir_queue_recs_heap_size(unsigned int alloc)
+{
+	return W_MEM_SIZE(alloc * sizeof(struct dir_rec)) +
+		W_MEM_SIZE(alloc * sizeof(struct dir_pause)) +
+		W_MEM_SIZE(alloc / 2 * sizeof(struct dir_rec)) +
+		W_MEM_SIZE(alloc / 2 * sizeof(struct dir_pause));
+}
+
+/* records which fit in @rec_budget bytes while they grow */
+static unsigned int dir_queue_rec_max(size_t rec_budget)
+{
+	unsigned int alloc = DIR_QUEUE_MIN_SIZE;
+
+	while (dir_queue_recs_heap_size(alloc * 2) <= rec_budget)
+		alloc *= 2;
+	return alloc;
+}
+
+/* the most heap the queue takes with dir_queue_init() budgets */
+size_t dir_queue_heap_size(size_t budget, size_t rec_budget)
+{
+	unsigned int size = dir_queue_ring_max(budget);
+
+	return W_MEM_SIZE(size * sizeof(struct dir_rec)) +
+		W_MEM_SIZE(size / 2 * sizeof(struct dir_rec)) +
+		dir_queue_recs_heap_size(dir_queue_rec_max(rec_budget));
+}
+
+/*
+ * @budget is the most bytes for the ring, 0 for no limit. batches are
+ * spilled to @scratch, if any, once the ring is that large. @rec_budget
+ * is the most heap for the records of parents, 0 for no limit.
+ */
+void dir_queue_init(struct dir_queue *q, enum dir_queue_order order,
+		    size_t budget, size_t rec_budget,
+		    struct exfat_scratch *scratch)
+{
+	memset(q, 0, sizeof(*q));
+	q->order = order;
+	q->free_rec = DIR_REC_NONE;
+	q->scratch = scratch;
+	if (budget)
+		q->max_size = dir_queue_ring_max(budget);
+	if (rec_budget)
+		q->rec_max = dir_queue_rec_max(rec_budget);
+}
+
+void dir_queue_free(struct dir_queue *q)
+{
+	if (q->ring)
+		w_free(q->ring);
+	if (q->recs)
+		w_free(q->recs);
+	if (q->pauses)
+		w_free(q->pauses);
+	q->ring = NULL;
+	q->recs = NULL;
+	q->pauses = NULL;
+}
@@ -11,7 +11,9 @@
 #include <inttypes.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <locale.h>
+#include <fcntl.h>
 
 #include "exfat_ondisk.h"
 #include "libexfat.h"
@@ -27,10 +29,28 @@
 struct fsck_user_input {
 	struct exfat_user_input		ei;
 	enum fsck_ui_options		options;
+	const char			*scratch;
+	enum dir_queue_order		dir_order;
+	bool				dir_order_set;
+	unsigned long			dir_budget;
+	unsigned long			mem_budget;
+	unsigned long			ra_blocks;
+	unsigned long			dir_read_size;
 };
 
 #define EXFAT_MAX_UPCASE_CHARS	0x10000
 
+/*
+ * under a memory budget, paths in messages keep to this many directories
+ * and characters, and chains of directories longer than this many
+ * extents are walked.
+ */
+#define FSCK_BUDGET_PATH_DEPTH	16
+#define FSCK_BUDGET_PATH_LEN	512
+#define FSCK_BUDGET_EXTENTS	64
+/* root directory clusters searched for the upcase table by the plan */
+#define FSCK_UPCASE_SCAN_CLUS	16
+
 #define FSCK_EXIT_NO_ERRORS		0x00
 #define FSCK_EXIT_CORRECTED		0x01
 #define FSCK_EXIT_NEED_REBOOT		0x02
@@ -49,7 +69,6 @@ struct exfat_stat {
 
 struct exfat_fsck exfat_fsck;
 struct exfat_stat exfat_stat;
-struct path_resolve_ctx path_resolve_ctx;
 
 static struct option opts[] = {
 	{"repair",	no_argument,	NULL,	'r' },
@@ -62,6 +81,15 @@ static struct option opts[] = {
 	{"help",	no_argument,	NULL,	'h' },
 	{"?",		no_argument,	NULL,	'?' },
 	{"ignore-bad-fs",	no_argument,	NULL,	'b' },
+	{"fat-sweep",	no_argument,	NULL,	'F' },
+	{"compress-bitmaps",	no_argument,	NULL,	'c' },
+	{"scratch",	required_argument,	NULL,	'S' },
+	{"stream-bitmap",	no_argument,	NULL,	'B' },
+	{"traversal",	required_argument,	NULL,	't' },
+	{"queue-budget",	required_argument,	NULL,	'Q' },
+	{"mem-budget",	required_argument,	NULL,	'M' },
+	{"readahead",	required_argument,	NULL,	'R' },
+	{"dir-read",	required_argument,	NULL,	'D' },
 	{NULL,		0,		NULL,	 0  }
 };
 
@@ -75,6 +103,15 @@ static void usage(char *name)
 	fprintf(stderr, "\t-a                   Repair automatically\n");
 	fprintf(stderr, "\t-b | --ignore-bad-fs Try to recover even if exfat is not found\n");
 	fprintf(stderr, "\t-s | --rescue        Assign orphaned clusters to files\n");
+	fprintf(stderr, "\t-F | --fat-sweep     Read the whole FAT sequentially before checking\n");
+	fprintf(stderr, "\t-c | --compress-bitmaps Keep cluster bitmaps compressed in memory\n");
+	fprintf(stderr, "\t-S | --scratch=FILE|+OFFSET Page cluster bitmaps out to FILE or the device from OFFSET\n");
+	fprintf(stderr, "\t-B | --stream-bitmap Read the on-disk bitmap in windows instead of loading it\n");
+	fprintf(stderr, "\t-t | --traversal=bfs|dfs|hybrid Order to check directories in\n");
+	fprintf(stderr, "\t-Q | --queue-budget=BYTES Spill queued directories past BYTES to the scratch area\n");
+	fprintf(stderr, "\t-M | --mem-budget=BYTES Fit caches, bitmaps and queues in BYTES of heap, needs -S\n");
+	fprintf(stderr, "\t-R | --readahead=BLOCKS Read up to BLOCKS directory blocks at once, 0 to disable\n");
+	fprintf(stderr, "\t-D | --dir-read=BYTES Read directories in blocks of BYTES, several clusters if contiguous\n");
 	fprintf(stderr, "\t-V | --version       Show version\n");
 	fprintf(stderr, "\t-v | --verbose       Print debug\n");
 	fprintf(stderr, "\t-h | --help          Show help\n");
@@ -84,28 +121,190 @@ static void usage(char *name)
 
 #define fsck_err(parent, inode, fmt, ...)		\
 ({							\
-		exfat_resolve_path_parent(&path_resolve_ctx,	\
-			parent, inode);			\
+		fsck_resolve_path(parent, inode);		\
 		exfat_err("ERROR: %s: " fmt,		\
 			path_resolve_ctx.local_path,	\
 			##__VA_ARGS__);			\
+		exfat_release_path(&path_resolve_ctx);	\
 })
 
 #define repair_file_ask(iter, inode, code, fmt, ...)	\
 ({							\
+		int __repair;						\
 		if (inode)						\
-			exfat_resolve_path_parent(&path_resolve_ctx,	\
-					    (iter)->parent, inode);	\
+			fsck_resolve_path((iter)->parent, inode);	\
 		else							\
-			exfat_resolve_path(&path_resolve_ctx,		\
-				     (iter)->parent);			\
-		exfat_repair_ask(&exfat_fsck, code,			\
+			fsck_resolve_path(NULL, (iter)->parent);	\
+		__repair = exfat_repair_ask(&exfat_fsck, code,		\
 				 "ERROR: %s: " fmt " at %#" PRIx64,	\
 				 path_resolve_ctx.local_path,		\
 				 ##__VA_ARGS__,				\
 				 exfat_de_iter_device_offset(iter));	\
+		exfat_release_path(&path_resolve_ctx);		\
+		__repair;						\
 })
 
+/* match the dentry set of the directory whose first cluster is *@param */
+static int filter_dir_clus(struct exfat_de_iter *iter, void *param,
+			   int *dentry_count)
+{
+	clus_t clus = *(clus_t *)param;
+	struct exfat_dentry *file_de, *stream_de, *name_de;
+	int i;
+
+	if (exfat_de_iter_get(iter, 0, &file_de) ||
+	    !(le16_to_cpu(file_de->file_attr) & ATTR_SUBDIR) ||
+	    file_de->file_num_ext < 2 ||
+	    exfat_de_iter_get(iter, 1, &stream_de) ||
+	    stream_de->type != EXFAT_STREAM ||
+	    le32_to_cpu(stream_de->stream_start_clu) != clus)
+		return 1;
+
+	for (i = 2; i <= MIN(file_de->file_num_ext, 1 + MAX_NAME_DENTRIES); i++) {
+		if (exfat_de_iter_get(iter, i, &name_de) ||
+		    name_de->type != EXFAT_NAME)
+			break;
+	}
+	*dentry_count = i;
+	return 0;
+}
+
+/*
+ * read the name of the directory whose first cluster is @clus back from
+ * its parent, the directory of the record @parent, into @name. return
+ * its length, or -1 if it cannot be read.
+ */
+static int read_dir_name(struct exfat_fsck *fsck, clus_t clus, __u32 parent,
+			 __le16 *name)
+{
+	struct exfat *exfat = fsck->exfat;
+	struct exfat_lookup_filter filter = {
+		.in.type	= EXFAT_FILE,
+		.in.dentry_count = 0,
+		.in.filter	= filter_dir_clus,
+		.in.param	= &clus,
+	};
+	union exfat_inode_buf buf;
+	struct exfat_inode *dir;
+	struct dir_rec *rec;
+	int i, len, err;
+
+	if (parent == DIR_REC_LOST)
+		return -1;
+
+	rec = dir_queue_rec(&fsck->dir_queue, parent);
+	if (rec->parent == DIR_REC_NONE) {
+		dir = exfat->root;
+	} else {
+		dir = exfat_inode_init(&buf, ATTR_SUBDIR);
+		dir->first_clus = rec->first_clus;
+		dir->size = rec->size;
+		dir->is_contiguous = rec->is_contiguous;
+	}
+
+	err = exfat_lookup_dentry_set(exfat, dir, &filter);
+	if (dir != exfat->root)
+		exfat_inode_drop_extents(dir);
+	if (err)
+		return -1;
+
+	len = MIN(filter.out.dentry_set[1].stream_name_len,
+		  (filter.out.dentry_count - 2) * ENTRY_NAME_MAX);
+	for (i = 2; i < filter.out.dentry_count; i++)
+		memcpy(name + (i - 2) * ENTRY_NAME_MAX,
+		       filter.out.dentry_set[i].name_unicode,
+		       sizeof(filter.out.dentry_set[i].name_unicode));
+	name[len] = 0;
+	exfat_free_dentry_set(filter.out.dentry_set);
+	return len;
+}
+
+/*
+ * queued directories have no names or parents. read the name of the
+ * directory being read back from disk, and link inodes named after its
+ * ancestors, so that a path can be printed. the ancestors stop where
+ * the path is cut or where a directory has no record, the path then
+ * does not start at root.
+ */
+static void link_dir_ancestors(struct exfat_fsck *fsck)
+{
+	struct exfat *exfat = fsck->exfat;
+	struct dir_queue *q = &fsck->dir_queue;
+	struct exfat_inode *child = fsck->dir, *node;
+	int max_depth = path_resolve_ctx.max_depth ?
+		path_resolve_ctx.max_depth : PATH_RESOLVE_MAX_DEPTH;
+	int max_len = path_resolve_ctx.max_len ?
+		path_resolve_ctx.max_len : PATH_MAX;
+	__le16 name[EXFAT_NAME_MAX + 1];
+	struct dir_rec *rec;
+	int depth, chars, len;
+	__u32 idx;
+
+	idx = dir_queue_rec(q, fsck->dir_rec)->parent;
+	len = read_dir_name(fsck, child->first_clus, idx, child->name);
+	if (len < 0)
+		return;
+
+	for (depth = 1, chars = len + 1; ; depth++, chars += len + 1) {
+		rec = dir_queue_rec(q, idx);
+		if (rec->parent == DIR_REC_NONE) {
+			child->parent = exfat->root;
+			break;
+		}
+		if (depth >= max_depth || chars > max_len)
+			break;
+
+		len = read_dir_name(fsck, rec->first_clus, rec->parent, name);
+		if (len < 0)
+			break;
+		node = exfat_alloc_inode_name(ATTR_SUBDIR, len);
+		if (!node)
+			break;
+		memcpy(node->name, name, (len + 1) * sizeof(__le16));
+		child->parent = node;
+		child = node;
+		idx = rec->parent;
+	}
+}
+
+static void unlink_dir_ancestors(struct exfat_fsck *fsck)
+{
+	struct exfat_inode *node, *parent;
+
+	for (node = fsck->dir->parent; node && node != fsck->exfat->root;
+	     node = parent) {
+		parent = node->parent;
+		exfat_free_inode(node);
+	}
+	fsck->dir->parent = NULL;
+	fsck->dir->name[0] = 0;
+	exfat_shrink_caches();
+}
+
+/* resolve the path of @child in @parent, or in its own parent if NULL */
+static int fsck_resolve_path(struct exfat_inode *parent,
+			     struct exfat_inode *child)
+{
+	struct exfat_fsck *fsck = &exfat_fsck;
+	bool link;
+	int ret;
+
+	link = fsck->dir && fsck->dir != fsck->exfat->root &&
+		!fsck->dir->parent;
+	if (link)
+		link_dir_ancestors(fsck);
+
+	if (parent && parent != child->parent)
+		ret = exfat_resolve_path_parent(&path_resolve_ctx, parent,
+						child);
+	else
+		ret = exfat_resolve_path(&path_resolve_ctx, child);
+
+	if (link)
+		unlink_dir_ancestors(fsck);
+	return ret;
+}
+
 static int check_clus_chain(struct exfat_de_iter *de_iter, int stream_idx,
 			    struct exfat_inode *node)
 {
@@ -196,8 +395,7 @@ static int check_clus_chain(struct exfat_de_iter *de_iter, int stream_idx,
 						    (count + 1) * exfat->clus_size)) {
 					count++;
 					prev = clus;
-					exfat_bitmap_set(exfat->alloc_bitmap,
-							 clus);
+					exfat_alloc_bitmap_set(exfat, clus);
 					goto truncate_file;
 				} else {
 					return -EINVAL;
@@ -206,7 +404,7 @@ static int check_clus_chain(struct exfat_de_iter *de_iter, int stream_idx,
 		}
 
 		count++;
-		exfat_bitmap_set(exfat->alloc_bitmap, clus);
+		exfat_alloc_bitmap_set(exfat, clus);
 		prev = clus;
 		clus = next;
 	}
@@ -223,6 +421,7 @@ static int check_clus_chain(struct exfat_de_iter *de_iter, int stream_idx,
 
 	return 0;
 truncate_file:
+	exfat_inode_drop_extents(node);
 	node->size = count * exfat->clus_size;
 	if (!exfat_heap_clus(exfat, prev))
 		node->first_clus = EXFAT_FREE_CLUSTER;
@@ -268,7 +467,7 @@ static int root_check_clus_chain(struct exfat *exfat,
 			return -EINVAL;
 		}
 
-		exfat_bitmap_set(exfat->alloc_bitmap, clus);
+		exfat_alloc_bitmap_set(exfat, clus);
 
 		if (exfat_get_inode_next_clus(exfat, node, clus, &next)) {
 			exfat_err("ERROR: failed to read the fat entry of root");
@@ -576,22 +775,22 @@ restore:
 
 static int file_calc_checksum(struct exfat_de_iter *iter, uint16_t *checksum)
 {
-	struct exfat_dentry *file_de, *de;
-	int i, ret;
+	struct exfat_dentry *dset;
+	int i, count;
 
 	*checksum = 0;
-	ret = exfat_de_iter_get(iter, 0, &file_de);
-	if (ret)
-		return ret;
-
-	exfat_calc_dentry_checksum(file_de, checksum, true);
-	for (i = 1; i <= file_de->file_num_ext; i++) {
-		ret = exfat_de_iter_get(iter, i, &de);
-		if (ret)
-			return ret;
-		exfat_calc_dentry_checksum(de, checksum, false);
-	}
-	return 0;
+	count = exfat_de_iter_pin(iter, 1, &dset);
+	if (count < 0)
+		return count;
+
+	count = exfat_de_iter_pin(iter, dset[0].file_num_ext + 1, &dset);
+	if (count < 0)
+		return count;
+
+	exfat_calc_dentry_checksum(&dset[0], checksum, true);
+	for (i = 1; i < count; i++)
+		exfat_calc_dentry_checksum(&dset[i], checksum, false);
+	return count == dset[0].file_num_ext + 1 ? 0 : EOF;
 }
 
 /*
@@ -636,6 +835,10 @@ static int check_inode(struct exfat_de_iter *iter, struct exfat_inode *node)
 		valid = false;
 	}
 
+	/* the checksum was checked with the set, unless it changed since */
+	if (iter->pin_count && !iter->pin_changed)
+		return valid ? ret : -EINVAL;
+
 	ret = file_calc_checksum(iter, &checksum);
 	if (ret)
 		return ret;
@@ -649,29 +852,114 @@ static int check_inode(struct exfat_de_iter *iter, struct exfat_inode *node)
 	return valid ? ret : -EINVAL;
 }
 
+/*
+ * return 1 if a file before the one at @dev_offset in @dir is named
+ * @name, found among the indexed files with the same name hash, length
+ * and fingerprint. only those are read again.
+ */
+static int find_indexed_name(struct exfat_fsck *fsck, struct exfat_inode *dir,
+			     __le16 *name, int name_len, __u16 hash,
+			     off64_t dev_offset)
+{
+	struct exfat_dentry dset[MAX_NAME_DENTRIES + 2];
+	struct name_rec *rec = NULL;
+	int i, n, dcount, err;
+
+	dcount = 2 + DIV_ROUND_UP(name_len, ENTRY_NAME_MAX);
+	while ((rec = name_index_find(&fsck->name_index, rec, hash, name,
+				      name_len))) {
+		if (rec->dev_offset == dev_offset)
+			continue;
+
+		err = exfat_read_dentry_set(fsck->exfat, dir, dset, dcount,
+					    rec->dev_offset);
+		if (err)
+			return err;
+		if (dset[0].type != EXFAT_FILE)
+			continue;
+
+		for (i = 0; i < name_len; i += n) {
+			n = MIN(name_len - i, ENTRY_NAME_MAX);
+			if (dset[2 + i / ENTRY_NAME_MAX].type != EXFAT_NAME ||
+			    memcmp(dset[2 + i / ENTRY_NAME_MAX].name_unicode,
+				   name + i, n * sizeof(__le16)))
+				break;
+		}
+		if (i >= name_len)
+			return 1;
+	}
+	return 0;
+}
+
 static int handle_duplicated_filename(struct exfat_de_iter *iter,
-		struct exfat_inode *inode)
+		struct exfat_inode *inode, int name_len, __u16 hash)
 {
-	int ret;
+	struct exfat_fsck *fsck = &exfat_fsck;
 	struct exfat_lookup_filter filter;
+	off64_t dev_offset = exfat_de_iter_device_offset(iter);
+	int ret;
 
+	if (!fsck->name_index.failed) {
+		ret = find_indexed_name(fsck, iter->parent, inode->name,
+					name_len, hash, dev_offset);
+		if (ret <= 0)
+			return ret;
+		goto rename;
+	}
+
+	/* the index lacks some names, look through the directory */
 	ret = exfat_lookup_file_by_utf16name(iter->exfat, iter->parent,
 			inode->name, &filter);
 	if (ret)
 		return ret;
 
-	w_free(filter.out.dentry_set);
+	exfat_free_dentry_set(filter.out.dentry_set);
 
 	/* Hash is same, but filename is not same */
-	if (exfat_de_iter_device_offset(iter) == filter.out.dev_offset)
+	if (dev_offset == filter.out.dev_offset)
 		return 0;
 
-	return exfat_repair_rename_ask(&exfat_fsck, iter, inode->name,
+rename:
+	return exfat_repair_rename_ask(fsck, iter, inode->name,
 			ER_DE_DUPLICATED_NAME, "filename is duplicated");
 }
 
+/* return true if @hash is already among the names of the directory */
+static bool name_hash_test_and_set(struct exfat_fsck *fsck, __u16 hash)
+{
+	bitmap_t *word = &fsck->name_hash_bitmap[BIT_ENTRY(hash)];
+
+	if (*word & BIT_MASK(hash))
+		return true;
+
+	if (!*word) {
+		if (fsck->name_hash_touched_count < FSCK_NAME_HASH_TOUCHED)
+			fsck->name_hash_touched[fsck->name_hash_touched_count] =
+				BIT_ENTRY(hash);
+		fsck->name_hash_touched_count++;
+	}
+	*word |= BIT_MASK(hash);
+	return false;
+}
+
+/* forget the name hashes, clearing the whole bitmap only if too many */
+static void name_hash_reset(struct exfat_fsck *fsck)
+{
+	unsigned int i;
+
+	if (fsck->name_hash_touched_count > FSCK_NAME_HASH_TOUCHED) {
+		memset(fsck->name_hash_bitmap, 0,
+		       EXFAT_BITMAP_SIZE(EXFAT_MAX_HASH_COUNT));
+	} else {
+		for (i = 0; i < fsck->name_hash_touched_count; i++)
+			fsck->name_hash_bitmap[fsck->name_hash_touched[i]] = 0;
+	}
+	fsck->name_hash_touched_count = 0;
+}
+
 static int check_name_dentry_set(struct exfat_de_iter *iter,
-				 struct exfat_inode *inode)
+				 struct exfat_inode *inode,
+				 const struct exfat_dset_check *chk)
 {
 	struct exfat_dentry *stream_de;
 	size64_t name_len;
@@ -679,7 +967,7 @@ static int check_name_dentry_set(struct exfat_de_iter *iter,
 	int ret = 0;
 
 	exfat_de_iter_get(iter, 1, &stream_de);
-	name_len = exfat_utf16_len(inode->name, NAME_BUFFER_SIZE);
+	name_len = chk->name_len;
 	// {
 	// 	char nm[NAME_BUFFER_SIZE];
 	// 	exfat_utf16_dec(inode->name, NAME_BUFFER_SIZE, nm, NAME_BUFFER_SIZE);
@@ -696,7 +984,7 @@ static int check_name_dentry_set(struct exfat_de_iter *iter,
 	__u16 hash2 = exfat_calc_name_hash(iter->exfat, inode->name, (int)name_len+1);
 	logI("name '%s' length of a file: expected: %d, dentry name size: %d, dentry name hash: %04X, h1: %04X, h2: %04X", 
 	inode->name, (int)name_len, (int)stream_de->stream_name_len, stream_de->stream_name_hash, hash1, hash2);
-	arrprint16(inode->name, 32);
+	arrprint16(inode->name, (int)name_len + 1);
 
 		if (repair_file_ask(iter, NULL, ER_DE_NAME_LEN,
 				    "the name length of a file is wrong")) {
@@ -708,19 +996,19 @@ static int check_name_dentry_set(struct exfat_de_iter *iter,
 		}
 	}
 
-	ret = exfat_check_name(inode->name, stream_de->stream_name_len);
-	if (ret != stream_de->stream_name_len) {
+	/* the name length is fixed, unless the name is empty */
+	if (chk->bad_char != stream_de->stream_name_len) {
 		char err_msg[36];
 
 		snprintf(err_msg, sizeof(err_msg),
 			"filename has invalid character '%c'",
-			le16_to_cpu(inode->name[ret]));
+			le16_to_cpu(inode->name[chk->bad_char]));
 
 		return exfat_repair_rename_ask(&exfat_fsck, iter, inode->name,
 			ER_DE_INVALID_NAME, err_msg);
 	}
 
-	hash = exfat_calc_name_hash(iter->exfat, inode->name, (int)name_len);
+	hash = chk->name_hash;
 	if (cpu_to_le16(hash) != stream_de->stream_name_hash) {
 		if (repair_file_ask(iter, NULL, ER_DE_NAME_HASH,
 				    "the name hash of a file is wrong")) {
@@ -732,28 +1020,24 @@ static int check_name_dentry_set(struct exfat_de_iter *iter,
 		}
 	}
 
-	if (BITMAP_GET(iter->name_hash_bitmap, hash)) {
-		ret = handle_duplicated_filename(iter, inode);
-	} else
-		BITMAP_SET(iter->name_hash_bitmap, hash);
+	if (name_hash_test_and_set(&exfat_fsck, hash)) {
+		ret = handle_duplicated_filename(iter, inode, name_len, hash);
+		if (ret)
+			return ret;
+	}
+
+	/* a name which is kept can be a duplicate of later ones */
+	name_index_add(&exfat_fsck.name_index, hash, inode->name, name_len,
+		       exfat_de_iter_device_offset(iter));
 
 	return ret;
 }
 
-#define MSDOS_DOT	cpu_to_le16('.')
-
 static int handle_dot_dotdot_filename(struct exfat_de_iter *iter,
-				      __le16 *filename,
+				      __le16 *filename, int dots,
 				      int strm_name_len)
 {
-	int i;
-
-	for (i = 0; i < strm_name_len; i++) {
-		if (filename[i] != MSDOS_DOT)
-			return 0;
-	}
-
-	if (filename[i])
+	if (dots < strm_name_len || filename[strm_name_len])
 		return 0;
 
 	return exfat_repair_rename_ask(&exfat_fsck, iter, filename,
@@ -761,13 +1045,14 @@ static int handle_dot_dotdot_filename(struct exfat_de_iter *iter,
 }
 
 static int read_file_dentry_set(struct exfat_de_iter *iter,
+								union exfat_inode_buf *buf,
 								struct exfat_inode **new_node, int *skip_dentries)
 {
-	struct exfat_dentry *file_de, *stream_de, *dentry;
+	struct exfat_dentry *dset, *file_de, *stream_de, *dentry;
 	struct exfat_inode *node = NULL;
-	int i, j, ret, name_de_count;
+	struct exfat_dset_check chk;
+	int i, j, ret, count, name_de_count, name_max;
 	bool need_delete = false, need_copy_up = false;
-	uint16_t checksum;
 
 	ret = exfat_de_iter_get(iter, 0, &file_de);
 	if (ret || file_de->type != EXFAT_FILE)
@@ -776,12 +1061,34 @@ static int read_file_dentry_set(struct exfat_de_iter *iter,
 		return -EINVAL;
 	}
 
-	ret = file_calc_checksum(iter, &checksum);
-	if (ret || checksum != le16_to_cpu(file_de->file_checksum))
+	/*
+	 * the whole set is pinned and checked in one pass, then parsed
+	 * from one array
+	 */
+	count = exfat_de_iter_pin(iter, file_de->file_num_ext + 1, &dset);
+	if (count < 0)
+		return count;
+	file_de = &dset[0];
+	stream_de = &dset[1];
+
+	*new_node = NULL;
+	node	  = exfat_inode_init(buf, le16_to_cpu(file_de->file_attr));
+
+	name_max = 0;
+	if (count > 1) {
+		name_de_count = DIV_ROUND_UP(stream_de->stream_name_len,
+					     ENTRY_NAME_MAX);
+		name_max = MIN(name_de_count + 1, file_de->file_num_ext) - 1;
+	}
+	exfat_check_dentry_set(iter->exfat, dset, count, MAX(name_max, 0),
+			       node->name, &chk);
+
+	if (count != file_de->file_num_ext + 1 ||
+	    chk.checksum != le16_to_cpu(file_de->file_checksum))
 	{
 		if (repair_file_ask(iter, NULL, ER_DE_CHECKSUM,
 							"the checksum %#x of a file is wrong, expected: %#x",
-							le16_to_cpu(file_de->file_checksum), checksum))
+							le16_to_cpu(file_de->file_checksum), chk.checksum))
 			need_delete = true;
 		*skip_dentries = 1;
 		goto skip_dset;
@@ -797,8 +1104,7 @@ static int read_file_dentry_set(struct exfat_de_iter *iter,
 		goto skip_dset;
 	}
 
-	ret = exfat_de_iter_get(iter, 1, &stream_de);
-	if (ret || stream_de->type != EXFAT_STREAM)
+	if (stream_de->type != EXFAT_STREAM)
 	{
 		if (repair_file_ask(iter, NULL, ER_DE_STREAM,
 							"failed to get stream dentry"))
@@ -807,75 +1113,42 @@ static int read_file_dentry_set(struct exfat_de_iter *iter,
 		goto skip_dset;
 	}
 
-	*new_node = NULL;
-	node	  = exfat_alloc_inode(le16_to_cpu(file_de->file_attr));
-	if (!node)
-		return -ENOMEM;
-
+	/* the name dentries were copied up to the first one of another type */
 	name_de_count = DIV_ROUND_UP(stream_de->stream_name_len, ENTRY_NAME_MAX);
-	for (i = 2; i <= MIN(name_de_count + 1, file_de->file_num_ext); i++)
+	i = 2 + chk.name_dentries;
+	if (i <= MIN(name_de_count + 1, file_de->file_num_ext))
 	{
-		ret = exfat_de_iter_get(iter, i, &dentry);
-		if (ret || dentry->type != EXFAT_NAME)
+		if (repair_file_ask(iter, NULL, ER_DE_NAME,
+							"failed to get name dentry"))
 		{
-			if (repair_file_ask(iter, NULL, ER_DE_NAME,
-								"failed to get name dentry"))
-			{
-				if (i == 2)
-				{
-					need_delete	   = 1;
-					*skip_dentries = i + 1;
-					goto skip_dset;
-				}
-				break;
-			}
-			else
+			if (i == 2)
 			{
+				need_delete	   = 1;
 				*skip_dentries = i + 1;
 				goto skip_dset;
 			}
 		}
-		// {
-		// 	char nm[ENTRY_NAME_MAX];
-		// 	exfat_utf16_dec(dentry->name_unicode, 15 * 2, nm, ENTRY_NAME_MAX);
-		// 	printf("DNAME0: '%s', i %d, sz %d\n",
-		// 		   nm, i, (int)sizeof(dentry->name_unicode));
-		// }
-		// volatile char nm[ENTRY_NAME_MAX*2];
-		// my_memcpy(nm, dentry->name_unicode, ENTRY_NAME_MAX*2);
-		// my_memcpy(node->name + (i - 2) * ENTRY_NAME_MAX, nm, ENTRY_NAME_MAX*2);
-
-		// volatile int u=0; u++;
-
-		memcpy(node->name + (i - 2) * ENTRY_NAME_MAX, dentry->name_unicode, sizeof(dentry->name_unicode));
-
-		// {
-		// 	char nm[256];
-		// 	exfat_utf16_dec(node->name, 256, nm, 256);
-		// 	printf("DNAME1: '%s', i %d, sz %d\n",
-		// 		   nm, i, (int)sizeof(dentry->name_unicode));
-		// }
+		else
+		{
+			*skip_dentries = i + 1;
+			goto skip_dset;
+		}
 	}
+	else
+		i = MIN(name_de_count + 1, file_de->file_num_ext) + 1;
 
-	// {
-	// 		char nm[256];
-	// 		exfat_utf16_dec(node->name, 256, nm, 256);
-	// 		printf("DNAME2: '%s'\n", nm);
-	// }
-
-	ret = check_name_dentry_set(iter, node);
+	ret = check_name_dentry_set(iter, node, &chk);
 	if (ret < 0) {
 		*skip_dentries = file_de->file_num_ext + 1;
 		goto skip_dset;
 	} else if (ret) {
-		exfat_de_iter_get(iter, 1, &stream_de);
 		if (DIV_ROUND_UP(stream_de->stream_name_len, ENTRY_NAME_MAX) !=
 		    name_de_count)
 			i = DIV_ROUND_UP(stream_de->stream_name_len, ENTRY_NAME_MAX) + 2;
 	}
 
 	if (file_de->file_num_ext == 2 && stream_de->stream_name_len <= 2) {
-		ret = handle_dot_dotdot_filename(iter, node->name,
+		ret = handle_dot_dotdot_filename(iter, node->name, chk.dots,
 				stream_de->stream_name_len);
 		if (ret < 0) {
 			*skip_dentries = file_de->file_num_ext + 1;
@@ -884,7 +1157,7 @@ static int read_file_dentry_set(struct exfat_de_iter *iter,
 	}
 
 	for (j = i; i <= file_de->file_num_ext; i++) {
-		exfat_de_iter_get(iter, i, &dentry);
+		dentry = &dset[i];
 		if (dentry->type == EXFAT_VENDOR_EXT ||
 		    dentry->type == EXFAT_VENDOR_ALLOC) {
 			char zeroes[EXFAT_GUID_LEN] = {0};
@@ -918,18 +1191,16 @@ static int read_file_dentry_set(struct exfat_de_iter *iter,
 				}
 				if (vendor_node->size == 0 &&
 				    vendor_node->is_contiguous) {
-					exfat_de_iter_get_dirty(iter, i, &dentry);
 					dentry->stream_flags &= ~EXFAT_SF_CONTIGUOUS;
+					exfat_de_iter_set_dirty(iter, i);
 
 				}
 				exfat_free_inode(vendor_node);
 			}
 
 			if (need_copy_up) {
-				struct exfat_dentry *src_de;
-
-				exfat_de_iter_get_dirty(iter, j, &src_de);
-				memcpy(src_de, dentry, sizeof(struct exfat_dentry));
+				memcpy(&dset[j], dentry, sizeof(struct exfat_dentry));
+				exfat_de_iter_set_dirty(iter, j);
 			}
 			j++;
 		} else {
@@ -957,9 +1228,9 @@ static int read_file_dentry_set(struct exfat_de_iter *iter,
 				    "valid size %" PRIu64 " greater than size %" PRIu64,
 				    le64_to_cpu(stream_de->stream_valid_size),
 				    node->size)) {
-			exfat_de_iter_get_dirty(iter, 1, &stream_de);
 			stream_de->stream_valid_size =
 					stream_de->stream_size;
+			exfat_de_iter_set_dirty(iter, 1);
 		} else {
 			*skip_dentries = file_de->file_num_ext + 1;
 			goto skip_dset;
@@ -970,8 +1241,8 @@ static int read_file_dentry_set(struct exfat_de_iter *iter,
 		if (repair_file_ask(iter, node, ER_DE_SECONDARY_COUNT,
 				    "SecondaryCount %d is different with %d",
 				    file_de->file_num_ext, j - 1)) {
-			exfat_de_iter_get_dirty(iter, 0, &file_de);
 			file_de->file_num_ext = j - 1;
+			exfat_de_iter_set_dirty(iter, 0);
 		} else {
 			*skip_dentries = file_de->file_num_ext + 1;
 			goto skip_dset;
@@ -997,11 +1268,14 @@ skip_dset:
 	}
 	*skip_dentries = i;
 	*new_node = NULL;
-	exfat_free_inode(node);
 	return need_delete ? 1 : -EINVAL;
 }
 
-static int read_file(struct exfat_de_iter *de_iter,
+/*
+ * check a file dentry set with an inode in @buf. only a directory which
+ * has clusters to read is returned in @new_node, to be queued.
+ */
+static int read_file(struct exfat_de_iter *de_iter, union exfat_inode_buf *buf,
 		struct exfat_inode **new_node, int *dentry_count)
 {
 	struct exfat_inode *node;
@@ -1009,21 +1283,22 @@ static int read_file(struct exfat_de_iter *de_iter,
 
 	*new_node = NULL;
 
-	ret = read_file_dentry_set(de_iter, &node, dentry_count);
+	ret = read_file_dentry_set(de_iter, buf, &node, dentry_count);
 	if (ret)
 		return ret;
 
 	ret = check_inode(de_iter, node);
-	if (ret < 0) {
-		exfat_free_inode(node);
+	exfat_inode_drop_extents(node);
+	if (ret < 0)
 		return -EINVAL;
-	}
 
 	if (node->attr & ATTR_SUBDIR)
 		exfat_stat.dir_count++;
 	else
 		exfat_stat.file_count++;
-	*new_node = node;
+
+	if ((node->attr & ATTR_SUBDIR) && node->size)
+		*new_node = node;
 	return ret;
 }
 
@@ -1062,48 +1337,106 @@ static int read_bitmap(struct exfat *exfat)
 	exfat->disk_bitmap_clus = le32_to_cpu(dentry->bitmap_start_clu);
 	exfat->disk_bitmap_size = DIV_ROUND_UP(exfat->clus_count, 8);
 
-	exfat_bitmap_set_range(exfat, exfat->alloc_bitmap,
-			       le64_to_cpu(dentry->bitmap_start_clu),
-			       DIV_ROUND_UP(exfat->disk_bitmap_size,
-					    exfat->clus_size));
-	w_free(filter.out.dentry_set);
+	exfat_alloc_bitmap_set_range(exfat,
+				     le64_to_cpu(dentry->bitmap_start_clu),
+				     DIV_ROUND_UP(exfat->disk_bitmap_size,
+						  exfat->clus_size));
+	exfat_free_dentry_set(filter.out.dentry_set);
 
 printf("reading bitmap\n");
-	if (exfat_read(exfat->blk_dev->dev_fd, exfat->disk_bitmap,
-			exfat->disk_bitmap_size,
-			exfat_c2o(exfat, exfat->disk_bitmap_clus)) !=
-			(ssize64_t)exfat->disk_bitmap_size)
-		return -EIO;
-	
+	if (exfat->bitmap_opts.stream_disk)
+		retval = exfat_disk_bitmap_stream(exfat,
+				exfat_c2o(exfat, exfat->disk_bitmap_clus),
+				exfat->disk_bitmap_size, EXFAT_BITMAP_PAGE_SIZE,
+				exfat->bitmap_opts.resident_pages ?
+				exfat->bitmap_opts.resident_pages :
+				EXFAT_BITMAP_RESIDENT_PAGES);
+	else
+		retval = exfat_bitmap_read(exfat->disk_bitmap,
+				exfat->blk_dev->dev_fd,
+				exfat_c2o(exfat, exfat->disk_bitmap_clus),
+				exfat->disk_bitmap_size);
+	if (retval)
+		return retval;
+
+	/*
+	 * the search falls back to scanning the bitmaps without it. paged
+	 * bitmaps are used to bound memory, so they go without it.
+	 */
+	if (EXFAT_FREE_SUMMARY && !exfat->alloc_bitmap->pages &&
+	    exfat_free_summary_init(exfat))
+		exfat_debug("no memory for the free cluster summary\n");
 	return 0;
 }
 
-static int decompress_upcase_table(const __le16 *in_table, size64_t in_len,
-				   __u16 *out_table, size64_t out_len)
+/*
+ * go through the upcase table of @size bytes at @offset, @buf_size bytes
+ * at a time, decompressing it on the fly. return its checksum in
+ * @checksum and set the pages which change a character in @pages. with
+ * @exfat, what is added to each of those characters is stored in its
+ * upcase pages as well.
+ */
+static int scan_upcase_table(int fd, off64_t offset, size64_t size,
+			     __le16 *buf, unsigned int buf_size,
+			     __le32 *checksum, bitmap_t *pages,
+			     struct exfat *exfat)
 {
-	size64_t i, k;
-	uint16_t ch;
-
-	if (in_len > out_len)
-		return -E2BIG;
-
-	for (k = 0; k < out_len; k++)
-		out_table[k] = k;
-
-	for (i = 0, k = 0; i < in_len && k < out_len; i++) {
-		ch = le16_to_cpu(in_table[i]);
-
-		if (ch == 0xFFFF && i + 1 < in_len) {
-			uint16_t len = le16_to_cpu(in_table[++i]);
+	size64_t done, i, in_len = size / sizeof(__le16);
+	unsigned int len, j;
+	uint32_t k = 0;
+	bool run = false;
+	__u16 ch;
 
-			k += len;
-		} else {
-			out_table[k++] = ch;
+	*checksum = 0;
+	for (done = 0; done < size; done += len) {
+		len = MIN(size - done, buf_size);
+		if (exfat_read(fd, buf, len, offset + done) != (ssize64_t)len)
+			return -EIO;
+		boot_calc_checksum((unsigned char *)buf, len, false, checksum);
+
+		for (j = 0; j < len / sizeof(__le16); j++) {
+			i = done / sizeof(__le16) + j;
+			ch = le16_to_cpu(buf[j]);
+			if (run) {
+				/* skip a run of characters which stay */
+				k += ch;
+				run = false;
+			} else if (ch == 0xFFFF && i + 1 < in_len) {
+				run = true;
+			} else if (k < EXFAT_UPCASE_TABLE_CHARS) {
+				if (ch != k) {
+					BITMAP_SET(pages,
+						   k / EXFAT_UPCASE_PAGE_CHARS);
+					if (exfat)
+						exfat->upcase_pages
+						[k / EXFAT_UPCASE_PAGE_CHARS]
+						[k % EXFAT_UPCASE_PAGE_CHARS] =
+							ch - k;
+				}
+				k++;
+			}
 		}
 	}
 	return 0;
 }
 
+static unsigned int upcase_page_count(const bitmap_t *pages)
+{
+	unsigned int p, count = 0;
+
+	for (p = 0; p < EXFAT_UPCASE_PAGES; p++) {
+		if (BITMAP_GET(pages, p))
+			count++;
+	}
+	return count;
+}
+
+static bool upcase_size_valid(size64_t size)
+{
+	return size && size <= EXFAT_MAX_UPCASE_CHARS * sizeof(__le16) &&
+		!(size % sizeof(__le16));
+}
+
 static int read_upcase_table(struct exfat *exfat)
 {
 	struct exfat_lookup_filter filter = {
@@ -1112,11 +1445,15 @@ static int read_upcase_table(struct exfat *exfat)
 		.in.filter	= NULL,
 		.in.param	= NULL,
 	};
+	bitmap_t pages[EXFAT_BITMAP_SIZE(EXFAT_UPCASE_PAGES) /
+		       sizeof(bitmap_t)] = {0};
 	struct exfat_dentry *dentry = NULL;
-	__le16 *upcase = NULL;
+	__le16 *buf = NULL;
 	int retval;
-	ssize64_t size;
+	size64_t size;
+	off64_t offset;
 	__le32 checksum;
+	unsigned int p, n;
 
 	retval = exfat_lookup_dentry_set(exfat, exfat->root, &filter);
 	if (retval)
@@ -1131,32 +1468,30 @@ static int read_upcase_table(struct exfat *exfat)
 		goto out;
 	}
 
-	size = (ssize64_t)le64_to_cpu(dentry->upcase_size);
-	if (size > (ssize64_t)(EXFAT_MAX_UPCASE_CHARS * sizeof(__le16)) ||
-			size == 0 || size % sizeof(__le16)) {
+	size = le64_to_cpu(dentry->upcase_size);
+	if (!upcase_size_valid(size)) {
 		exfat_err("invalid size of upcase table. 0x%" PRIx64 "\n",
 			le64_to_cpu(dentry->upcase_size));
 		retval = -EINVAL;
 		goto out;
 	}
 
-	upcase = w_malloc(size);
-	if (!upcase) {
+	/* a sector at a time, the table is not kept as it is on disk */
+	buf = w_malloc(exfat->sect_size);
+	if (!buf) {
 		exfat_err("failed to allocate upcase table\n");
 		retval = -ENOMEM;
 		goto out;
 	}
 
-	if (exfat_read(exfat->blk_dev->dev_fd, upcase, size,
-			exfat_c2o(exfat,
-			le32_to_cpu(dentry->upcase_start_clu))) != size) {
+	offset = exfat_c2o(exfat, le32_to_cpu(dentry->upcase_start_clu));
+	if (scan_upcase_table(exfat->blk_dev->dev_fd, offset, size, buf,
+			      exfat->sect_size, &checksum, pages, NULL)) {
 		exfat_err("failed to read upcase table\n");
 		retval = -EIO;
 		goto out;
 	}
 
-	checksum = 0;
-	boot_calc_checksum((unsigned char *)upcase, size, false, &checksum);
 	if (le32_to_cpu(dentry->upcase_checksum) != checksum) {
 		exfat_err("corrupted upcase table %#x (expected: %#x)\n",
 			checksum, le32_to_cpu(dentry->upcase_checksum));
@@ -1164,30 +1499,71 @@ static int read_upcase_table(struct exfat *exfat)
 		goto out;
 	}
 
-	exfat_bitmap_set_range(exfat, exfat->alloc_bitmap,
-			       le32_to_cpu(dentry->upcase_start_clu),
-			       DIV_ROUND_UP(le64_to_cpu(dentry->upcase_size),
-					    exfat->clus_size));
+	exfat_alloc_bitmap_set_range(exfat,
+				     le32_to_cpu(dentry->upcase_start_clu),
+				     DIV_ROUND_UP(le64_to_cpu(dentry->upcase_size),
+						  exfat->clus_size));
 
-	exfat->upcase_table = w_calloc(EXFAT_UPCASE_TABLE_CHARS, sizeof(uint16_t));
-	if (!exfat->upcase_table) {
-		retval = -EIO;
+	exfat->upcase_data = w_calloc(upcase_page_count(pages) + 1,
+				      EXFAT_UPCASE_PAGE_CHARS * sizeof(__u16));
+	if (!exfat->upcase_data) {
+		exfat_err("failed to allocate upcase table\n");
+		retval = -ENOMEM;
 		goto out;
 	}
+	for (p = 0, n = 1; p < EXFAT_UPCASE_PAGES; p++)
+		exfat->upcase_pages[p] = exfat->upcase_data +
+			(BITMAP_GET(pages, p) ? n++ : 0) *
+			EXFAT_UPCASE_PAGE_CHARS;
 
-	decompress_upcase_table(upcase, size / 2,
-				exfat->upcase_table, EXFAT_UPCASE_TABLE_CHARS);
+	if (scan_upcase_table(exfat->blk_dev->dev_fd, offset, size, buf,
+			      exfat->sect_size, &checksum, pages, exfat)) {
+		exfat_err("failed to read upcase table\n");
+		retval = -EIO;
+	}
 out:
-	if (dentry)
-		w_free(dentry);
-	if (upcase)
-		w_free(upcase);
+	exfat_free_dentry_set(dentry);
+	if (buf)
+		w_free(buf);
 	return retval;
 }
 
-static int read_children(struct exfat_fsck *fsck, struct exfat_inode *dir)
+/*
+ * note the name hashes of the files before @resume again, for a paused
+ * directory. they were checked before it was paused. the index is left
+ * out, so that duplicated names are looked up through the directory.
+ */
+static int resume_children(struct exfat_fsck *fsck, off64_t resume)
+{
+	struct exfat_de_iter *de_iter = &fsck->de_iter;
+	struct exfat_dentry *dentry;
+	bool after_file = false;
+	int ret;
+
+	fsck->name_index.failed = true;
+	while (exfat_de_iter_file_offset(de_iter) < resume) {
+		ret = exfat_de_iter_get(de_iter, 0, &dentry);
+		if (ret)
+			return ret == EOF ? -EINVAL : ret;
+
+		if (dentry->type == EXFAT_STREAM && after_file)
+			name_hash_test_and_set(fsck,
+				le16_to_cpu(dentry->stream_name_hash));
+		after_file = dentry->type == EXFAT_FILE;
+		exfat_de_iter_advance(de_iter, 1);
+	}
+	return 0;
+}
+
+/*
+ * check the children of @dir from @resume, 0 or where it was paused.
+ * a subdirectory which cannot be queued pauses @dir, and 0 is returned.
+ */
+static int read_children(struct exfat_fsck *fsck, struct exfat_inode *dir,
+			 off64_t resume)
 {
 	struct exfat *exfat = fsck->exfat;
+	union exfat_inode_buf buf;
 	struct exfat_inode *node = NULL;
 	struct exfat_dentry *dentry;
 	struct exfat_de_iter *de_iter;
@@ -1201,9 +1577,18 @@ static int read_children(struct exfat_fsck *fsck, struct exfat_inode *dir)
 	else if (ret)
 		return ret;
 
-	de_iter->name_hash_bitmap = fsck->name_hash_bitmap;
-	memset(fsck->name_hash_bitmap, 0,
-			EXFAT_BITMAP_SIZE(EXFAT_MAX_HASH_COUNT));
+	name_hash_reset(fsck);
+	name_index_reset(&fsck->name_index);
+	fsck->chk_known = false;
+
+	if (resume) {
+		ret = resume_children(fsck, resume);
+		if (ret) {
+			fsck_err(dir->parent, dir,
+				"failed to get a dentry. %d\n", ret);
+			goto err;
+		}
+	}
 
 	while (1) {
 		ret = exfat_de_iter_get(de_iter, 0, &dentry);
@@ -1219,7 +1604,16 @@ static int read_children(struct exfat_fsck *fsck, struct exfat_inode *dir)
 
 		switch (dentry->type) {
 		case EXFAT_FILE:
-			ret = read_file(de_iter, &node, &dentry_count);
+			/* read on once its queued subdirectories are read */
+			if ((le16_to_cpu(dentry->file_attr) & ATTR_SUBDIR) &&
+			    fsck->dir_rec != DIR_REC_LOST &&
+			    dir_queue_reserve(&fsck->dir_queue)) {
+				dir_queue_pause(&fsck->dir_queue, fsck->dir_rec,
+					exfat_de_iter_file_offset(de_iter));
+				goto out;
+			}
+
+			ret = read_file(de_iter, &buf, &node, &dentry_count);
 			if (ret < 0) {
 				exfat_stat.error_count++;
 				break;
@@ -1229,14 +1623,11 @@ static int read_children(struct exfat_fsck *fsck, struct exfat_inode *dir)
 			}
 
 			if (node) {
-				if ((node->attr & ATTR_SUBDIR) && node->size) {
-					node->parent = dir;
-					list_add_tail(&node->sibling,
-						      &dir->children);
-					list_add_tail(&node->list,
-						      &exfat->dir_list);
-				} else {
-					exfat_free_inode(node);
+				ret = dir_queue_push(&fsck->dir_queue, node,
+						     fsck->dir_rec);
+				if (ret) {
+					exfat_err("failed to queue a directory\n");
+					goto err;
 				}
 			}
 			break;
@@ -1268,113 +1659,288 @@ out:
 	exfat_de_iter_flush(de_iter);
 	return 0;
 err:
-	exfat_free_children(dir, false);
-	INIT_LIST_HEAD(&dir->children);
+	dir_queue_drop_children(&fsck->dir_queue, fsck->dir_rec);
 	exfat_de_iter_flush(de_iter);
 	return ret;
 }
 
+#define BITMAP_SECT_SIZE	512
+
+/* the largest write of a bitmap which is not flat, it goes via a copy */
+#define BITMAP_STAGING_SECTS	16
+
+/* the @i-th word of the bitmap which write_bitmap() puts on disk */
+static bitmap_t bitmap_new_word(struct exfat *exfat, unsigned int i)
+{
+	/* a streamed disk bitmap is merged on the fly */
+	if (exfat->disk_mismatch)
+		return exfat_bitmap_word(exfat->alloc_bitmap, i) |
+			exfat_bitmap_word(exfat->disk_bitmap, i);
+	return exfat_bitmap_word(exfat->ohead_bitmap, i);
+}
+
+/* true if the @sect-th bitmap sector differs from the disk bitmap */
+static bool bitmap_sect_dirty(struct exfat *exfat, unsigned int sect,
+			      unsigned int bitmap_bytes)
+{
+	unsigned int i, end;
+
+	i = sect * BITMAP_SECT_SIZE / sizeof(bitmap_t);
+	end = MIN((sect + 1) * BITMAP_SECT_SIZE, bitmap_bytes) /
+		sizeof(bitmap_t);
+	for (; i < end; i++) {
+		if (bitmap_new_word(exfat, i) !=
+		    exfat_bitmap_word(exfat->disk_bitmap, i))
+			return true;
+	}
+	return false;
+}
+
 /* write bitmap segments for clusters which are marked
  * as free, but allocated to files.
+ * only the sectors which differ from the disk bitmap are written.
+ * dirty sectors in the same allocation unit that are close to each
+ * other go out in one write, so the media rewrites each AU once. with
+ * a streamed disk bitmap only the sectors of the recorded mismatches
+ * are visited.
  */
 static int write_bitmap(struct exfat_fsck *fsck)
 {
 	struct exfat *exfat = fsck->exfat;
-	bitmap_t *disk_b, *alloc_b, *ohead_b;
-	off64_t dev_offset;
+	struct exfat_bitmap *disk_b, *alloc_b, *ohead_b;
+	struct exfat_clus_list *mismatch = exfat->disk_mismatch;
+	bitmap_t *staging = NULL;
+	clus_t clus;
+	char *buf;
+	off64_t dev_offset, au_end;
 	unsigned int i, bitmap_bytes, byte_offset, write_bytes;
+	unsigned int sect, sect_count, end, last, writes = 0;
+	int ret = 0;
 
 	dev_offset = exfat_c2o(exfat, exfat->disk_bitmap_clus);
 	bitmap_bytes = EXFAT_BITMAP_SIZE(le32_to_cpu(exfat->bs->bsx.clu_count));
 
-	disk_b = (bitmap_t *)exfat->disk_bitmap;
-	alloc_b = (bitmap_t *)exfat->alloc_bitmap;
-	ohead_b = (bitmap_t *)exfat->ohead_bitmap;
+	disk_b = exfat->disk_bitmap;
+	alloc_b = exfat->alloc_bitmap;
+	ohead_b = exfat->ohead_bitmap;
+
+	for (i = 0; !mismatch && i < bitmap_bytes / sizeof(bitmap_t); i++)
+		exfat_bitmap_put_word(ohead_b, i,
+				      exfat_bitmap_word(alloc_b, i) |
+				      exfat_bitmap_word(disk_b, i));
+	ret = alloc_b->err ?: disk_b->err ?: ohead_b->err;
+	if (ret) {
+		exfat_err("failed to merge bitmaps. %d\n", ret);
+		return ret;
+	}
 
-	for (i = 0; i < bitmap_bytes / sizeof(bitmap_t); i++)
-		ohead_b[i] = alloc_b[i] | disk_b[i];
+	/* without the whole list every sector has to be compared */
+	if (mismatch && mismatch->err)
+		mismatch = NULL;
 
-	i = 0;
-	while (i < bitmap_bytes / sizeof(bitmap_t)) {
-		if (ohead_b[i] == disk_b[i]) {
-			i++;
+	if (!ohead_b->words || exfat->disk_mismatch) {
+		staging = w_malloc(BITMAP_STAGING_SECTS * BITMAP_SECT_SIZE);
+		if (!staging)
+			return -ENOMEM;
+	}
+
+	sect_count = DIV_ROUND_UP(bitmap_bytes, BITMAP_SECT_SIZE);
+	sect = 0;
+	while (sect < sect_count) {
+		if (mismatch) {
+			if (!exfat_clus_list_next(mismatch, sect *
+						  BITMAP_SECT_SIZE * 8 +
+						  EXFAT_FIRST_CLUSTER, &clus))
+				break;
+			sect = (clus - EXFAT_FIRST_CLUSTER) /
+				(BITMAP_SECT_SIZE * 8);
+			if (sect >= sect_count)
+				break;
+		}
+
+		if (!bitmap_sect_dirty(exfat, sect, bitmap_bytes)) {
+			sect++;
 			continue;
 		}
 
-		byte_offset = ((i * sizeof(bitmap_t)) / 512) * 512;
-		write_bytes = MIN(512, bitmap_bytes - byte_offset);
+		/* the last sector which is in the same AU as @sect */
+		last = sect_count;
+		if (EXFAT_BITMAP_AU_SIZE) {
+			au_end = round_down(dev_offset +
+					    (off64_t)sect * BITMAP_SECT_SIZE,
+					    (off64_t)EXFAT_BITMAP_AU_SIZE) +
+				EXFAT_BITMAP_AU_SIZE;
+			last = MIN(last, (unsigned int)DIV_ROUND_UP(
+					au_end - dev_offset, BITMAP_SECT_SIZE));
+		}
+		if (staging)
+			last = MIN(last, sect + BITMAP_STAGING_SECTS);
 
-		if (exfat_write(exfat->blk_dev->dev_fd,
-				(char *)ohead_b + byte_offset, write_bytes,
-				dev_offset + byte_offset) != (ssize64_t)write_bytes)
-			return -EIO;
+		end = sect + 1;
+		for (i = end; i < last && i - end <= EXFAT_BITMAP_WRITE_GAP; i++) {
+			if (bitmap_sect_dirty(exfat, i, bitmap_bytes))
+				end = i + 1;
+		}
+
+		byte_offset = sect * BITMAP_SECT_SIZE;
+		write_bytes = MIN(end * BITMAP_SECT_SIZE, bitmap_bytes) -
+			byte_offset;
+
+		if (exfat->disk_mismatch) {
+			for (i = 0; i < write_bytes / sizeof(bitmap_t); i++)
+				staging[i] = bitmap_new_word(exfat, i +
+						byte_offset / sizeof(bitmap_t));
+			buf = (char *)staging;
+		} else if (staging) {
+			exfat_bitmap_store(ohead_b, byte_offset / sizeof(bitmap_t),
+					   staging, write_bytes / sizeof(bitmap_t));
+			buf = (char *)staging;
+		} else {
+			buf = (char *)ohead_b->words + byte_offset;
+		}
 
-		i = (byte_offset + write_bytes) / sizeof(bitmap_t);
+		/* a paged bitmap may have failed to read a page back */
+		ret = alloc_b->err ?: disk_b->err ?: ohead_b->err;
+		if (ret)
+			break;
+
+		if (exfat_write(exfat->blk_dev->dev_fd, buf, write_bytes,
+				dev_offset + byte_offset) != (ssize64_t)write_bytes) {
+			ret = -EIO;
+			break;
+		}
+
+		writes++;
+		sect = end;
 	}
-	return 0;
 
+	if (staging)
+		w_free(staging);
+	exfat_debug("bitmap written in %u writes\n", writes);
+	return ret;
 }
 
 /*
- * for each directory in @dir_list.
- * 1. read all dentries and allocate exfat_nodes for files and directories.
- *    and append directory exfat_nodes to the head of @dir_list
- * 2. free all of file exfat_nodes.
- * 3. if the directory does not have children, free its exfat_node.
+ * for each directory in the directory queue.
+ * 1. read all dentries and check files and directories.
+ * 2. queue directories which have clusters, as records which refer to
+ *    the record of their parent.
+ * 3. drop the record of the directory, and of its parents once all of
+ *    their subdirectories are read.
  */
 static int exfat_filesystem_check(struct exfat_fsck *fsck)
 {
 	struct exfat *exfat = fsck->exfat;
+	struct dir_queue *q = &fsck->dir_queue;
+	union exfat_inode_buf dir_buf;
 	struct exfat_inode *dir;
-	int ret = 0, dir_errors;
+	struct dir_rec *rec, *next;
+	off64_t resume;
+	int ret = 0, dir_errors, err;
 
 	if (!exfat->root) {
 		exfat_err("root is NULL\n");
 		return -ENOENT;
 	}
 
-	fsck->name_hash_bitmap = w_malloc(EXFAT_BITMAP_SIZE(EXFAT_MAX_HASH_COUNT));
+	/* the list of words set follows the bitmap */
+	fsck->name_hash_bitmap = w_calloc(1,
+			EXFAT_BITMAP_SIZE(EXFAT_MAX_HASH_COUNT) +
+			FSCK_NAME_HASH_TOUCHED * sizeof(__u16));
 	if (!fsck->name_hash_bitmap) {
 		exfat_err("failed to allocate name hash bitmap\n");
 		return -ENOMEM;
 	}
-
-	list_add(&exfat->root->list, &exfat->dir_list);
+	fsck->name_hash_touched = (__u16 *)((char *)fsck->name_hash_bitmap +
+			EXFAT_BITMAP_SIZE(EXFAT_MAX_HASH_COUNT));
+	fsck->name_hash_touched_count = 0;
+	name_index_init(&fsck->name_index, fsck->name_budget);
+	fsck->chk_nums = NULL;
+	fsck->chk_alloc = 0;
+	fsck->chk_known = false;
+
+	dir_queue_init(q, fsck->dir_order, fsck->dir_budget,
+		       fsck->dir_rec_budget, exfat->bitmap_opts.scratch);
+	ret = dir_queue_push(q, exfat->root, DIR_REC_NONE);
+	if (ret)
+		goto out;
 
 	static int counter;
 	counter=0;
 
-	while (!list_empty(&exfat->dir_list)) {
+	while (!(err = dir_queue_pop(q, &fsck->dir_rec, &resume))) {
 		counter++; if(counter%1==0) logI("Items checked: %d", counter);
-		dir = list_entry(exfat->dir_list.next,
-				 struct exfat_inode, list);
-
-		if (!(dir->attr & ATTR_SUBDIR)) {
-			fsck_err(dir->parent, dir,
-				"failed to travel directories. "
-				"the node is not directory\n");
-			ret = -EINVAL;
-			goto out;
+		rec = dir_queue_rec(q, fsck->dir_rec);
+		if (rec->parent == DIR_REC_NONE) {
+			dir = exfat->root;
+		} else {
+			dir = exfat_inode_init(&dir_buf, ATTR_SUBDIR);
+			dir->first_clus = rec->first_clus;
+			dir->size = rec->size;
+			dir->is_contiguous = rec->is_contiguous;
 		}
+		fsck->dir = dir;
 
-		dir_errors = read_children(fsck, dir);
+		next = dir_queue_peek(q);
+		exfat_prefetch_hint(exfat, next ? next->first_clus : 0,
+				    next ? next->size : 0);
+
+		dir_errors = read_children(fsck, dir, resume);
 		if (dir_errors) {
-			exfat_resolve_path(&path_resolve_ctx, dir);
+			fsck_resolve_path(NULL, dir);
 			exfat_debug("failed to check dentries: %s\n",
 					path_resolve_ctx.local_path);
+			exfat_release_path(&path_resolve_ctx);
 			ret = dir_errors;
 		}
 
-		list_del(&dir->list);
-		exfat_free_file_children(dir);
-		exfat_free_ancestors(dir);
+		if (dir != exfat->root)
+			exfat_inode_drop_extents(dir);
+		fsck->dir = NULL;
+		if (!dir_queue_rec(q, fsck->dir_rec)->paused)
+			dir_queue_put(q, fsck->dir_rec);
+	}
+	if (err != EOF) {
+		exfat_err("failed to get a directory to check\n");
+		ret = err;
 	}
 out:
-	exfat_free_dir_list(exfat);
+	dir_queue_free(q);
+	name_index_free(&fsck->name_index);
+	if (fsck->chk_nums)
+		w_free(fsck->chk_nums);
 	w_free(fsck->name_hash_bitmap);
 	return ret;
 }
 
+/*
+ * read the FAT sequentially once, so that cluster chains are followed
+ * without FAT I/O during the directory walk.
+ */
+static int fat_sweep(struct exfat_fsck *fsck)
+{
+	struct exfat *exfat = fsck->exfat;
+	struct exfat_fat_sweep_stat stat;
+	int ret;
+
+	ret = exfat_fat_sweep(exfat, fsck->sweep_chunk, fsck->sweep_jumps,
+			      &stat);
+	if (ret) {
+		exfat_err("failed to sweep FAT. %d\n", ret);
+		return ret;
+	}
+
+	exfat_info("FAT sweep:    used %u, fragments %u, bad %u\n",
+		   stat.used, stat.jumps, stat.bad);
+	if (exfat->fat_map->complete)
+		exfat_info("FAT sweep:    chain heads %u, cross-links %u, dangling links %u\n",
+			   stat.heads, stat.cross_links, stat.dangling);
+	else
+		exfat_info("FAT sweep:    cross-links %u, dangling links %u, too many fragments to map\n",
+			   stat.cross_links, stat.dangling);
+	return 0;
+}
+
 static int exfat_root_dir_check(struct exfat *exfat)
 {
 	struct exfat_inode *root;
@@ -1439,7 +2005,7 @@ static int read_lostfound(struct exfat *exfat, struct exfat_inode **lostfound)
 
 	inode = exfat_alloc_inode(ATTR_SUBDIR);
 	if (!inode) {
-		w_free(filter.out.dentry_set);
+		exfat_free_dentry_set(filter.out.dentry_set);
 		return -ENOMEM;
 	}
 
@@ -1463,9 +2029,10 @@ static int rescue_orphan_clusters(struct exfat_fsck *fsck)
 {
 	struct exfat *exfat = fsck->exfat;
 	struct exfat_inode *lostfound;
-	bitmap_t *disk_b, *alloc_b, *ohead_b;
+	struct exfat_bitmap *disk_b, *alloc_b, *ohead_b;
 	struct exfat_dentry *dset;
-	clus_t clu_count, clu, s_clu, e_clu;
+	struct exfat_bitmap_iter iter;
+	clus_t clu_count, s_clu, count;
 	int err, dcount;
 	unsigned int i;
 	char name[] = "FILE0000000.CHK";
@@ -1481,11 +2048,18 @@ static int rescue_orphan_clusters(struct exfat_fsck *fsck)
 	/* find clusters which are not marked as free, but not allocated to
 	 * any files.
 	 */
-	disk_b = (bitmap_t *)exfat->disk_bitmap;
-	alloc_b = (bitmap_t *)exfat->alloc_bitmap;
-	ohead_b = (bitmap_t *)exfat->ohead_bitmap;
+	disk_b = exfat->disk_bitmap;
+	alloc_b = exfat->alloc_bitmap;
+	ohead_b = exfat->ohead_bitmap;
 	for (i = 0; i < EXFAT_BITMAP_SIZE(clu_count) / sizeof(bitmap_t); i++)
-		ohead_b[i] = disk_b[i] & ~alloc_b[i];
+		exfat_bitmap_put_word(ohead_b, i,
+				      exfat_bitmap_word(disk_b, i) &
+				      ~exfat_bitmap_word(alloc_b, i));
+	err = alloc_b->err ?: disk_b->err ?: ohead_b->err;
+	if (err) {
+		exfat_err("failed to merge bitmaps. %d\n", err);
+		return err;
+	}
 
 	/* no orphan clusters */
 	if (exfat_bitmap_find_one(exfat, exfat->ohead_bitmap,
@@ -1501,7 +2075,8 @@ static int rescue_orphan_clusters(struct exfat_fsck *fsck)
 		return err;
 	}
 
-	if (w_fsync(exfat_fsck.exfat->blk_dev->dev_fd) != 0) {
+	if (exfat_fat_cache_flush(exfat) ||
+	    w_fsync(exfat_fsck.exfat->blk_dev->dev_fd) != 0) {
 		exfat_err("failed to sync()\n");
 		return -EIO;
 	}
@@ -1534,16 +2109,13 @@ static int rescue_orphan_clusters(struct exfat_fsck *fsck)
 	/* create temporary files and allocate contiguous orphan clusters
 	 * to each file.
 	 */
-	for (clu = EXFAT_FIRST_CLUSTER; clu < clu_count + EXFAT_FIRST_CLUSTER &&
-	     exfat_bitmap_find_one(exfat, exfat->ohead_bitmap, clu, &s_clu) == 0;) {
-		if (exfat_bitmap_find_zero(exfat, exfat->ohead_bitmap, s_clu, &e_clu))
-			e_clu = clu_count + EXFAT_FIRST_CLUSTER;
-		clu = e_clu;
-
+	exfat_bitmap_iter_init(exfat, &iter, exfat->ohead_bitmap,
+			       EXFAT_FIRST_CLUSTER);
+	while (exfat_bitmap_iter_next(&iter, 1, &s_clu, &count)) {
 		snprintf(name, sizeof(name), "FILE%07d.CHK",
 			 (unsigned int)(loc.file_offset >> 5));
 		err = exfat_update_file_dentry_set(exfat, dset, dcount,
-						   name, s_clu, e_clu - s_clu);
+						   name, s_clu, count);
 		if (err)
 			continue;
 		err = exfat_add_dentry_set(exfat, &loc, dset, dcount, true);
@@ -1551,7 +2123,7 @@ static int rescue_orphan_clusters(struct exfat_fsck *fsck)
 			continue;
 	}
 
-	w_free(dset);
+	exfat_free_dentry_set(dset);
 	err = 0;
 out:
 	exfat_free_inode(lostfound);
@@ -1581,9 +2153,388 @@ static char *bytes_to_human_readable(size64_t bytes)
 	return buf;
 }
 
+/*
+ * set up @scratch from @spec. "+OFFSET" is the part of the checked device
+ * from OFFSET on, which must lie past the end of the volume and needs
+ * the device opened for writing. anything else is the path of an
+ * existing file.
+ */
+static int open_scratch(const char *spec, struct exfat_blk_dev *bd,
+			bool writeable, struct pbr *bs,
+			struct exfat_scratch *scratch)
+{
+	unsigned long long val;
+	off64_t offset, vol_end;
+	char *end;
+
+	if (spec[0] != '+') {
+		scratch->fd = w_open(spec, O_RDWR);
+		if (scratch->fd < 0)
+			return -errno;
+		return 0;
+	}
+
+	if (!writeable)
+		return -EROFS;
+
+	/* 64-bit, unsigned long cannot reach past 4GB on 32-bit targets */
+	if (spec[1] < '0' || spec[1] > '9')
+		return -EINVAL;
+	errno = 0;
+	val = strtoull(spec + 1, &end, 0);
+	if (errno || *end != '\0' || val > INT64_MAX)
+		return -EINVAL;
+	offset = (off64_t)val;
+
+	vol_end = (off64_t)le64_to_cpu(bs->bsx.vol_length) <<
+		bs->bsx.sect_size_bits;
+	if (offset < vol_end || (unsigned long long)offset >= bd->size)
+		return -EINVAL;
+
+	scratch->fd = bd->dev_fd;
+	scratch->offset = offset;
+	scratch->size = bd->size - offset;
+	return 0;
+}
+
+/*
+ * count the upcase pages which read_upcase_table() is going to keep,
+ * reading the root directory straight from @bd as nothing is set up yet.
+ * if the table is not found, all of them are counted.
+ */
+static unsigned int fsck_upcase_pages(struct exfat_blk_dev *bd,
+				      struct pbr *bs)
+{
+	unsigned int sect_size = EXFAT_SECTOR_SIZE(bs);
+	unsigned int clus_size = EXFAT_CLUSTER_SIZE(bs);
+	clus_t clus_count = le32_to_cpu(bs->bsx.clu_count);
+	clus_t clus = le32_to_cpu(bs->bsx.root_cluster), start;
+	bitmap_t pages[EXFAT_BITMAP_SIZE(EXFAT_UPCASE_PAGES) /
+		       sizeof(bitmap_t)] = {0};
+	unsigned int i, off, count = EXFAT_UPCASE_PAGES;
+	struct exfat_dentry *dentry;
+	off64_t heap_off = (off64_t)le32_to_cpu(bs->bsx.clu_offset) <<
+		bs->bsx.sect_size_bits;
+	off64_t fat_off = (off64_t)le32_to_cpu(bs->bsx.fat_offset) <<
+		bs->bsx.sect_size_bits;
+	__le32 checksum, next;
+	off64_t clus_off;
+	size64_t size;
+	__le16 *buf;
+
+	buf = w_malloc(sect_size);
+	if (!buf)
+		return count;
+
+	for (i = 0; i < FSCK_UPCASE_SCAN_CLUS; i++) {
+		if (clus < EXFAT_FIRST_CLUSTER ||
+		    clus >= clus_count + EXFAT_FIRST_CLUSTER)
+			goto out;
+		clus_off = heap_off +
+			(off64_t)(clus - EXFAT_FIRST_CLUSTER) * clus_size;
+
+		for (off = 0; off < clus_size; off += sect_size) {
+			if (exfat_read(bd->dev_fd, buf, sect_size,
+				       clus_off + off) != (ssize64_t)sect_size)
+				goto out;
+
+			for (dentry = (struct exfat_dentry *)buf;
+			     (char *)dentry < (char *)buf + sect_size;
+			     dentry++) {
+				if (dentry->type == EXFAT_LAST)
+					goto out;
+				if (dentry->type != EXFAT_UPCASE)
+					continue;
+
+				start = le32_to_cpu(dentry->upcase_start_clu);
+				size = le64_to_cpu(dentry->upcase_size);
+				if (start < EXFAT_FIRST_CLUSTER ||
+				    start >= clus_count + EXFAT_FIRST_CLUSTER ||
+				    !upcase_size_valid(size))
+					goto out;
+
+				/* the scan reuses @buf, @dentry goes with it */
+				clus_off = heap_off +
+					(off64_t)(start - EXFAT_FIRST_CLUSTER) *
+					clus_size;
+				if (!scan_upcase_table(bd->dev_fd, clus_off,
+						       size, buf, sect_size,
+						       &checksum, pages, NULL))
+					count = upcase_page_count(pages);
+				goto out;
+			}
+		}
+
+		if (exfat_read(bd->dev_fd, &next, sizeof(next),
+			       fat_off + (off64_t)clus * sizeof(next)) !=
+		    (ssize64_t)sizeof(next))
+			goto out;
+		clus = le32_to_cpu(next);
+	}
+out:
+	w_free(buf);
+	return count;
+}
+
+/* what fsck_plan_memory() fits in the budget */
+struct fsck_mem_plan {
+	struct exfat_fsck		*fsck;
+	struct pbr			*bs;
+	const struct exfat_bitmap_opts	*opts;
+	unsigned int			upcase_pages;
+
+	size_t				pages;		/* resident, per bitmap */
+	size_t				runs;		/* disk bitmap mismatches */
+	size_t				fat_lines;
+	size_t				sweep_jumps;
+	size_t				sweep_chunk;
+	size_t				ra_blocks;
+	size_t				dir_budget;	/* bytes of the ring */
+	size_t				rec_budget;	/* bytes of parents */
+	size_t				name_budget;
+	size_t				chk_max;
+};
+
+/*
+ * the most heap fsck takes with @plan, item by item. what the FAT sweep
+ * frees, the directory walk and what comes after it do not overlap, so
+ * only the largest of them counts.
+ */
+static size_t fsck_plan_size(const struct fsck_mem_plan *plan, bool show)
+{
+	struct exfat_fsck *fsck = plan->fsck;
+	struct pbr *bs = plan->bs;
+	struct exfat_bitmap_opts opts = *plan->opts;
+	clus_t clus_count = le32_to_cpu(bs->bsx.clu_count);
+	unsigned int sect_size = EXFAT_SECTOR_SIZE(bs);
+	unsigned int clus_size = EXFAT_CLUSTER_SIZE(bs);
+	unsigned int read_size = exfat_dir_read_size(opts.dir_read_size,
+						     sect_size);
+	size_t in_use, bitmap, bitmaps, fat, dirs, upcase, inodes, paths;
+	size_t extents, wcs, sweep = 0, walk, end;
+	struct w_mem_stats mem;
+
+	w_mem_get_stats(&mem);
+	in_use = mem.used - fsck->mem_base +
+		W_MEM_SIZE(sizeof(struct exfat));
+
+	/* the alloc and overhead bitmaps, and the window on the disk one */
+	opts.resident_pages = plan->pages;
+	bitmap = exfat_bitmap_heap_size(&opts, clus_count);
+	bitmaps = 2 * bitmap +
+		exfat_bitmap_map_heap_size(clus_count, EXFAT_BITMAP_PAGE_SIZE,
+					   plan->pages) +
+		W_MEM_SIZE(sizeof(struct exfat_clus_list)) +
+		exfat_clus_list_heap_size(plan->runs);
+
+	fat = exfat_fat_cache_heap_size(plan->fat_lines,
+					EXFAT_FAT_CACHE_LINE_SIZE, sect_size);
+	if (fsck->options & FSCK_OPTS_FAT_SWEEP) {
+		fat += W_MEM_SIZE(sizeof(struct exfat_fat_map)) + 2 * bitmap +
+			W_MEM_SIZE(plan->sweep_jumps *
+				   sizeof(struct fat_map_jump));
+		sweep = bitmap +
+			W_MEM_SIZE(round_down(MAX(plan->sweep_chunk, sect_size),
+					      sect_size));
+	}
+
+	/* root, the directory being read and one looked up */
+	extents = W_MEM_SIZE(opts.max_extents * sizeof(struct exfat_extent)) +
+		W_MEM_SIZE(opts.max_extents / 2 * sizeof(struct exfat_extent));
+	dirs = exfat_prefetch_heap_size(plan->ra_blocks,
+					MIN(clus_size, read_size)) +
+		2 * exfat_buffer_heap_size(read_size, clus_size, sect_size) +
+		3 * extents;
+
+	upcase = W_MEM_SIZE((plan->upcase_pages + 1) *
+			    EXFAT_UPCASE_PAGE_CHARS * sizeof(__u16)) +
+		W_MEM_SIZE(sect_size);
+
+	/* root and vendor inodes, two lookups, names and a rename */
+	wcs = W_MEM_SIZE((EXFAT_NAME_MAX + 1) * sizeof(wchar_t));
+	inodes = 2 * exfat_inode_heap_size(0) +
+		exfat_dentry_set_heap_size(3) +
+		2 * exfat_dentry_set_heap_size(2 + MAX_NAME_DENTRIES) +
+		2 * wcs + exfat_arena_heap_size(&fsck->dir_arena);
+
+	/* names of the ancestors fit in the path, but for the last one */
+	paths = exfat_resolve_path_heap_size(&path_resolve_ctx) +
+		path_resolve_ctx.max_depth *
+		(exfat_inode_heap_size(0) + 2 * (ENTRY_NAME_MAX - 1)) +
+		2 * (path_resolve_ctx.max_len + EXFAT_NAME_MAX);
+
+	walk = W_MEM_SIZE(EXFAT_BITMAP_SIZE(EXFAT_MAX_HASH_COUNT) +
+			  FSCK_NAME_HASH_TOUCHED * sizeof(__u16)) +
+		plan->name_budget +
+		W_MEM_SIZE(plan->chk_max * sizeof(unsigned int)) +
+		W_MEM_SIZE(plan->chk_max / 2 * sizeof(unsigned int)) +
+		dir_queue_heap_size(plan->dir_budget, plan->rec_budget);
+
+	/* the bitmap staging area, or LOST+FOUND and its files */
+	end = MAX(W_MEM_SIZE(BITMAP_STAGING_SECTS * BITMAP_SECT_SIZE),
+		  exfat_inode_heap_size(0) + 3 * exfat_dentry_set_heap_size(3) +
+		  extents + 2 * wcs);
+
+	if (show) {
+		exfat_debug("memory plan:  %zu bytes in use, bitmaps %zu, FAT %zu, directory reads %zu\n",
+			    in_use, bitmaps, fat, dirs);
+		exfat_debug("memory plan:  upcase %zu, inodes %zu, paths %zu\n",
+			    upcase, inodes, paths);
+		exfat_debug("memory plan:  FAT sweep %zu, directory walk %zu, end %zu\n",
+			    sweep, walk, end);
+	}
+	return in_use + bitmaps + fat + dirs + upcase + inodes + paths +
+		MAX(MAX(sweep, walk), end);
+}
+
+/*
+ * double *@val, or add one to it with @step, up to @max while @plan
+ * takes at most @limit bytes
+ */
+static void fsck_plan_grow(struct fsck_mem_plan *plan, size_t *val,
+			   size_t max, bool step, size_t limit)
+{
+	size_t old;
+
+	while (*val < max) {
+		old = *val;
+		*val = step ? old + 1 : MIN(old * 2, max);
+		if (fsck_plan_size(plan, false) > limit) {
+			*val = old;
+			break;
+		}
+	}
+}
+
+/*
+ * fit fsck in @fsck->mem_budget bytes of heap. bitmaps are paged to the
+ * scratch area, with the disk bitmap streamed, and queued directories
+ * spill to it, so nothing on the heap grows with the volume. the
+ * scratch area on the device must be large enough for all of them.
+ * every item starts at the least it works with, then bitmap pages get half of what is left, and the FAT
+ * cache, the read-ahead, the directory queue and the name index an
+ * eighth each. what an item does not take goes to the next one.
+ * w_malloc() refuses to go past the budget, this keeps fsck from
+ * running into it halfway through a repair.
+ */
+static int fsck_plan_memory(struct exfat_fsck *fsck, struct exfat_blk_dev *bd,
+			    struct pbr *bs, struct exfat_bitmap_opts *opts,
+			    bool order_set)
+{
+	clus_t clus_count = le32_to_cpu(bs->bsx.clu_count);
+	struct exfat_scratch *scratch = opts->scratch;
+	struct fsck_mem_plan plan = {
+		.fsck		= fsck,
+		.bs		= bs,
+		.opts		= opts,
+		.pages		= 2,
+		.runs		= 16,
+		.fat_lines	= 1,
+		.sweep_jumps	= 256,
+		.sweep_chunk	= 4 * KB,
+		.ra_blocks	= 0,
+		.dir_budget	= fsck->dir_budget ? fsck->dir_budget :
+			DIR_QUEUE_MIN_SIZE * sizeof(struct dir_rec),
+		.rec_budget	= DIR_QUEUE_MIN_SIZE *
+			(sizeof(struct dir_rec) + sizeof(struct dir_pause)),
+		.name_budget	= name_index_heap_size(NAME_INDEX_MIN_SIZE),
+		.chk_max	= 16,
+	};
+	uint64_t scratch_size;
+	size_t size, limit, avail;
+	unsigned int bitmaps, page_count;
+
+	opts->type = EXFAT_BITMAP_PAGED;
+	opts->stream_disk = true;
+	opts->max_extents = FSCK_BUDGET_EXTENTS;
+	path_resolve_ctx.max_depth = FSCK_BUDGET_PATH_DEPTH;
+	path_resolve_ctx.max_len = FSCK_BUDGET_PATH_LEN;
+	exfat_disable_caches();
+
+	/* pages of the paged bitmaps, and every directory spilled */
+	page_count = DIV_ROUND_UP(EXFAT_BITMAP_SIZE(clus_count),
+				  EXFAT_BITMAP_PAGE_SIZE);
+	bitmaps = fsck->options & FSCK_OPTS_FAT_SWEEP ? 5 : 2;
+	scratch_size = (uint64_t)bitmaps * page_count * EXFAT_BITMAP_PAGE_SIZE +
+		(uint64_t)(clus_count + DIR_QUEUE_SPILL_BATCH) *
+		sizeof(struct dir_rec);
+	if (scratch->size && (uint64_t)scratch->size < scratch_size) {
+		exfat_err("scratch area of %" PRId64 " bytes is below the %" PRIu64 " bytes needed\n",
+			  (int64_t)scratch->size, scratch_size);
+		return -ENOSPC;
+	}
+
+	plan.upcase_pages = fsck_upcase_pages(bd, bs);
+	size = fsck_plan_size(&plan, true);
+	if (size > fsck->mem_budget) {
+		exfat_err("memory budget %zu is below the %zu bytes needed\n",
+			  fsck->mem_budget, size);
+		return -ENOMEM;
+	}
+	avail = fsck->mem_budget - size;
+	limit = size;
+
+	limit += avail / 2 - avail / 16;
+	fsck_plan_grow(&plan, &plan.pages,
+		       MIN(EXFAT_BITMAP_RESIDENT_PAGES, page_count), true, limit);
+	limit += avail / 16;
+	fsck_plan_grow(&plan, &plan.runs, clus_count, false, limit);
+
+	limit += avail / 8;
+	fsck_plan_grow(&plan, &plan.fat_lines, EXFAT_FAT_CACHE_LINES, true,
+		       limit);
+	if (fsck->options & FSCK_OPTS_FAT_SWEEP) {
+		fsck_plan_grow(&plan, &plan.sweep_jumps,
+			       EXFAT_FAT_SWEEP_MAX_JUMPS, false, limit);
+		fsck_plan_grow(&plan, &plan.sweep_chunk,
+			       EXFAT_FAT_SWEEP_CHUNK_SIZE, false, limit);
+	}
+
+	limit += avail / 8;
+	fsck_plan_grow(&plan, &plan.ra_blocks, fsck->ra_blocks, true, limit);
+
+	limit += avail / 8;
+	if (!fsck->dir_budget) {
+		fsck_plan_grow(&plan, &plan.dir_budget, SIZE_MAX,
+			       false, limit - avail / 16);
+	}
+	fsck_plan_grow(&plan, &plan.rec_budget, SIZE_MAX, false, limit);
+
+	limit = fsck->mem_budget;
+	fsck_plan_grow(&plan, &plan.name_budget, SIZE_MAX, false,
+		       limit - avail / 32);
+	fsck_plan_grow(&plan, &plan.chk_max, UINT_MAX, false, limit);
+
+	size = fsck_plan_size(&plan, true);
+	if (size > fsck->mem_budget) {
+		exfat_err("memory budget %zu is below the %zu bytes planned\n",
+			  fsck->mem_budget, size);
+		return -ENOMEM;
+	}
+
+	opts->resident_pages = plan.pages;
+	opts->mismatch_runs = plan.runs;
+	opts->fat_cache_lines = plan.fat_lines;
+	fsck->sweep_jumps = plan.sweep_jumps;
+	fsck->sweep_chunk = plan.sweep_chunk;
+	fsck->ra_blocks = plan.ra_blocks;
+	fsck->dir_budget = plan.dir_budget;
+	fsck->dir_rec_budget = plan.rec_budget;
+	fsck->name_budget = plan.name_budget;
+	fsck->chk_max = plan.chk_max;
+	if (!order_set)
+		fsck->dir_order = DIR_QUEUE_HYBRID;
+
+	exfat_info("memory plan:  paged bitmaps with %u resident pages, %u FAT cache lines, %lu bytes of directory queue, %zu of %zu bytes\n",
+		   opts->resident_pages, opts->fat_cache_lines,
+		   fsck->dir_budget, size, fsck->mem_budget);
+	return 0;
+}
+
 static void exfat_show_info(struct exfat_fsck *fsck, const char *dev_name)
 {
 	struct exfat *exfat = fsck->exfat;
+	struct w_mem_stats mem;
 	bool clean;
 
 	exfat_info("sector size:  %s\n",
@@ -1592,6 +2543,52 @@ static void exfat_show_info(struct exfat_fsck *fsck, const char *dev_name)
 		bytes_to_human_readable(exfat->clus_size));
 	exfat_info("volume size:  %s\n",
 		bytes_to_human_readable(exfat->blk_dev->size));
+	if (exfat->fat_cache)
+		exfat_info("FAT cache:    %u x %u bytes, hits %lu, misses %lu, writebacks %lu\n",
+			   exfat->fat_cache->line_count,
+			   exfat->fat_cache->line_size,
+			   exfat->fat_cache->hits, exfat->fat_cache->misses,
+			   exfat->fat_cache->writebacks);
+	exfat_info("bitmaps:      %s, %zu bytes\n",
+		   exfat->alloc_bitmap->words ? "flat" :
+		   exfat->alloc_bitmap->pages ? "paged" : "compressed",
+		   exfat_bitmap_mem_size(exfat->alloc_bitmap) +
+		   exfat_bitmap_mem_size(exfat->disk_bitmap) +
+		   exfat_bitmap_mem_size(exfat->ohead_bitmap));
+	if (exfat->disk_mismatch)
+		exfat_info("disk bitmap:  streamed, faults %lu, mismatch runs %u\n",
+			   exfat->disk_bitmap->faults,
+			   exfat->disk_mismatch->count);
+	exfat_info("dir reads:    %u bytes, %u if not contiguous\n",
+		   exfat->read_size, exfat_get_read_size(exfat));
+	if (exfat->prefetch)
+		exfat_info("read-ahead:   %u blocks, %lu reads for %lu blocks, hits %lu, wasted %lu\n",
+			   exfat->prefetch->slot_count,
+			   exfat->prefetch->reads, exfat->prefetch->blocks,
+			   exfat->prefetch->hits, exfat->prefetch->wasted);
+	if (fsck->dir_queue.peak)
+		exfat_info("dir queue:    peak %zu bytes, %zu bytes per dir\n",
+			   fsck->dir_queue.peak_bytes, sizeof(struct dir_rec));
+	if (fsck->dir_queue.spill_writes)
+		exfat_info("dir spill:    %lu batch writes, %lu batch reads, %u batches\n",
+			   fsck->dir_queue.spill_writes,
+			   fsck->dir_queue.spill_reads,
+			   fsck->dir_queue.spill_alloc);
+	if (fsck->dir_queue.lost_count)
+		exfat_info("dir records:  %lu directories read without a parent record\n",
+			   fsck->dir_queue.lost_count);
+	if (exfat->alloc_bitmap->pages && exfat->disk_bitmap)
+		exfat_info("bitmap pages: faults %lu, writebacks %lu\n",
+			   exfat->alloc_bitmap->faults +
+			   exfat->disk_bitmap->faults +
+			   exfat->ohead_bitmap->faults,
+			   exfat->alloc_bitmap->writebacks +
+			   exfat->disk_bitmap->writebacks +
+			   exfat->ohead_bitmap->writebacks);
+
+	w_mem_get_stats(&mem);
+	exfat_info("heap:         peak %zu bytes, %lu allocations failed\n",
+		   mem.peak - fsck->mem_base, mem.failures);
 
 	clean = exfat_stat.error_count == 0 ||
 		exfat_stat.error_count == exfat_stat.fixed_count;
@@ -1602,6 +2599,12 @@ static void exfat_show_info(struct exfat_fsck *fsck, const char *dev_name)
 		printf("%s: files corrupted %ld, files fixed %ld\n", dev_name,
 			exfat_stat.error_count - exfat_stat.fixed_count,
 			exfat_stat.fixed_count);
+	if (fsck->dir_queue.peak)
+		printf("%s: peak frontier %u directories\n", dev_name,
+			fsck->dir_queue.peak);
+	if (fsck->mem_budget)
+		printf("%s: peak heap %zu of %zu bytes\n", dev_name,
+			mem.peak - fsck->mem_base, fsck->mem_budget);
 }
 
 int fsck_exfat_entry_point(int argc, char * const argv[])
@@ -1609,11 +2612,15 @@ int fsck_exfat_entry_point(int argc, char * const argv[])
 struct fsck_user_input ui;
 struct exfat_blk_dev bd;
 struct pbr *bs = NULL;
+struct exfat_bitmap_opts bitmap_opts = { .type = EXFAT_BITMAP_FLAT };
+struct exfat_scratch scratch = { .fd = -1 };
+struct w_mem_stats mem;
 int c, ret, exit_code;
 bool version_only = false;
 
 memset(&ui, 0, sizeof(ui));
 memset(&bd, 0, sizeof(bd));
+ui.ra_blocks = EXFAT_READAHEAD_BLOCKS;
 
 print_level = EXFAT_ERROR;
 
@@ -1624,7 +2631,7 @@ opterr = 0;
 optind = 0;
 optopt = 0;
 
-while ((c = getopt_long(argc, argv, "arynpbsVvh", opts, NULL)) != EOF)
+while ((c = getopt_long(argc, argv, "arynpbsFcS:Bt:Q:M:R:D:Vvh", opts, NULL)) != EOF)
 {
     switch (c)
     {
@@ -1667,6 +2674,47 @@ while ((c = getopt_long(argc, argv, "arynpbsVvh", opts, NULL)) != EOF)
         case 's':
             ui.options |= FSCK_OPTS_RESCUE_CLUS;
             break;
+        case 'F':
+            ui.options |= FSCK_OPTS_FAT_SWEEP;
+            break;
+        case 'c':
+            ui.options |= FSCK_OPTS_COMPRESS_BITMAP;
+            break;
+        case 'S':
+            ui.scratch = optarg;
+            break;
+        case 'B':
+            ui.options |= FSCK_OPTS_STREAM_BITMAP;
+            break;
+        case 't':
+            if (!strcmp(optarg, "bfs"))
+                ui.dir_order = DIR_QUEUE_BFS;
+            else if (!strcmp(optarg, "dfs"))
+                ui.dir_order = DIR_QUEUE_DFS;
+            else if (!strcmp(optarg, "hybrid"))
+                ui.dir_order = DIR_QUEUE_HYBRID;
+            else
+                usage(argv[0]);
+            ui.dir_order_set = true;
+            break;
+        case 'Q':
+            if (exfat_parse_ulong(optarg, &ui.dir_budget))
+                usage(argv[0]);
+            break;
+        case 'M':
+            if (exfat_parse_ulong(optarg, &ui.mem_budget) || !ui.mem_budget)
+                usage(argv[0]);
+            break;
+        case 'R':
+            if (exfat_parse_ulong(optarg, &ui.ra_blocks) ||
+                ui.ra_blocks > UINT_MAX)
+                usage(argv[0]);
+            break;
+        case 'D':
+            if (exfat_parse_ulong(optarg, &ui.dir_read_size) ||
+                !ui.dir_read_size || ui.dir_read_size > UINT_MAX)
+                usage(argv[0]);
+            break;
         case 'V':
             version_only = true;
             break;
@@ -1706,14 +2754,35 @@ else
     ui.ei.writeable = false;
 }
 
+if (ui.mem_budget && !ui.scratch)
+{
+    printf("Ошибка: Опция -M требует рабочей области, заданной опцией -S.\n");
+    usage(argv[0]);
+}
+
 	exfat_fsck.options = ui.options;
+	exfat_fsck.dir_order = ui.dir_order;
+	exfat_fsck.dir_budget = ui.dir_budget;
+	exfat_fsck.name_budget = 0;
+	exfat_fsck.mem_budget = ui.mem_budget;
+	exfat_fsck.sweep_chunk = EXFAT_FAT_SWEEP_CHUNK_SIZE;
+	exfat_fsck.sweep_jumps = EXFAT_FAT_SWEEP_MAX_JUMPS;
+	exfat_fsck.ra_blocks = ui.ra_blocks;
 
 	ui.ei.dev_name = argv[optind];
 
+	/* the budget and the peak only count what fsck allocates */
+	w_mem_get_stats(&mem);
+	exfat_fsck.mem_base = mem.used;
+	w_mem_reset_peak();
+	if (exfat_fsck.mem_budget)
+		w_mem_set_limit(mem.used + exfat_fsck.mem_budget);
+
 	logI("Getting blkdev info");
 	ret = exfat_get_blk_dev_info(&ui.ei, &bd);
 	if (ret < 0) {
 		exfat_err("failed to open %s. %d\n", ui.ei.dev_name, ret);
+		w_mem_set_limit(0);
 		return FSCK_EXIT_OPERATION_ERROR;
 	}
 
@@ -1724,12 +2793,42 @@ else
 	if (ret)
 		goto err;
 
-	exfat_fsck.exfat = exfat_alloc_exfat(&bd, bs);
+	if (ui.options & FSCK_OPTS_COMPRESS_BITMAP)
+		bitmap_opts.type = EXFAT_BITMAP_COMPRESSED;
+
+	if (ui.scratch) {
+		ret = open_scratch(ui.scratch, &bd, ui.ei.writeable, bs,
+				   &scratch);
+		if (ret) {
+			exfat_err("failed to open scratch area %s. %d\n",
+				  ui.scratch, ret);
+			w_free(bs);
+			goto err;
+		}
+		bitmap_opts.type = EXFAT_BITMAP_PAGED;
+		bitmap_opts.scratch = &scratch;
+	}
+	bitmap_opts.stream_disk = ui.options & FSCK_OPTS_STREAM_BITMAP;
+	bitmap_opts.dir_read_size = ui.dir_read_size;
+
+	if (exfat_fsck.mem_budget) {
+		ret = fsck_plan_memory(&exfat_fsck, &bd, bs, &bitmap_opts,
+				       ui.dir_order_set);
+		if (ret) {
+			w_free(bs);
+			goto err;
+		}
+	}
+
+	exfat_fsck.exfat = exfat_alloc_exfat(&bd, bs, &bitmap_opts);
 	if (!exfat_fsck.exfat) {
 		ret = -ENOMEM;
 		goto err;
 	}
 
+	if (exfat_prefetch_init(exfat_fsck.exfat, exfat_fsck.ra_blocks))
+		exfat_debug("no memory for directory read-ahead\n");
+
 	exfat_fsck.buffer_desc = exfat_alloc_buffer(exfat_fsck.exfat);
 	if (!exfat_fsck.buffer_desc) {
 		ret = -ENOMEM;
@@ -1742,6 +2841,13 @@ else
 		goto err;
 	}
 
+	if (exfat_fsck.options & FSCK_OPTS_FAT_SWEEP) {
+		logI("sweeping FAT...");
+		ret = fat_sweep(&exfat_fsck);
+		if (ret)
+			goto out;
+	}
+
 	logI("verifying root directory...");
 	ret = exfat_root_dir_check(exfat_fsck.exfat);
 	if (ret) {
@@ -1769,7 +2875,8 @@ else
 		}
 	}
 
-	if (ui.ei.writeable && w_fsync(bd.dev_fd)) {
+	if (ui.ei.writeable && (exfat_fat_cache_flush(exfat_fsck.exfat) ||
+				w_fsync(bd.dev_fd))) {
 		exfat_err("failed to sync\n");
 		ret = -EIO;
 		goto out;
@@ -1794,6 +2901,10 @@ err:
 		exfat_free_buffer(exfat_fsck.exfat, exfat_fsck.buffer_desc);
 	if (exfat_fsck.exfat)
 		exfat_free_exfat(exfat_fsck.exfat);
+	exfat_arena_free(&exfat_fsck.dir_arena);
+	if (scratch.fd >= 0 && scratch.fd != bd.dev_fd)
+		w_close(scratch.fd);
 	w_close(bd.dev_fd);
+	w_mem_set_limit(0);
 	return exit_code;
 }
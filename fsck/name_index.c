@@ -0,0 +1,182 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Index of the names of the directory being read. a name hash which
+ *   is already in the directory is looked up here, and only the files
+ *   with the same hash, length and name fingerprint have to be read
+ *   again to tell whether the name is duplicated.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "exfat_ondisk.h"
+#include "libexfat.h"
+#include "name_index.h"
+#include "mem_wrapper.h"
+
+/* a second hash of the name as it is, unlike the upcased name hash */
+static __u8 name_fingerprint(__le16 *name, int name_len)
+{
+	__u32 fp = name_len;
+	int i;
+
+	for (i = 0; i < name_len; i++)
+		fp = fp * 31 + le16_to_cpu(name[i]);
+	fp ^= fp >> 16;
+	return (__u8)(fp ^ (fp >> 8));
+}
+
+static unsigned int name_index_bucket(struct name_index *ni, __u16 hash)
+{
+	return hash & (ni->alloc / 2 - 1);
+}
+
+/* chain the records again, keeping each bucket in the order added */
+static void name_index_rehash(struct name_index *ni)
+{
+	unsigned int i, b;
+
+	for (i = 0; i < ni->alloc / 2; i++)
+		ni->heads[i] = NAME_REC_NONE;
+	for (i = ni->count; i > 0; i--) {
+		b = name_index_bucket(ni, ni->recs[i - 1].hash);
+		ni->recs[i - 1].next = ni->heads[b];
+		ni->heads[b] = i - 1;
+	}
+}
+
+/* heap of an index of @alloc records, and of the one it grew from */
+size_t name_index_heap_size(unsigned int alloc)
+{
+	return W_MEM_SIZE(alloc * sizeof(struct name_rec)) +
+		W_MEM_SIZE(alloc / 2 * sizeof(__u32)) +
+		W_MEM_SIZE(alloc / 2 * sizeof(struct name_rec)) +
+		W_MEM_SIZE(alloc / 4 * sizeof(__u32));
+}
+
+static int name_index_grow(struct name_index *ni)
+{
+	struct name_rec *recs;
+	__u32 *heads;
+	unsigned int alloc;
+
+	alloc = ni->alloc ? ni->alloc * 2 : NAME_INDEX_MIN_SIZE;
+	if (ni->budget && name_index_heap_size(alloc) > ni->budget)
+		return -ENOMEM;
+
+	recs = w_malloc(alloc * sizeof(*recs));
+	heads = w_malloc(alloc / 2 * sizeof(*heads));
+	if (!recs || !heads) {
+		if (recs)
+			w_free(recs);
+		if (heads)
+			w_free(heads);
+		return -ENOMEM;
+	}
+
+	if (ni->recs) {
+		memcpy(recs, ni->recs, ni->count * sizeof(*recs));
+		w_free(ni->recs);
+		w_free(ni->heads);
+	}
+	ni->recs = recs;
+	ni->heads = heads;
+	ni->alloc = alloc;
+	name_index_rehash(ni);
+	return 0;
+}
+
+/*
+ * add the file whose file dentry is at @dev_offset. once a name could
+ * not be added, the index is incomplete until the next reset.
+ */
+int name_index_add(struct name_index *ni, __u16 hash, __le16 *name,
+		   int name_len, off64_t dev_offset)
+{
+	struct name_rec *rec;
+	unsigned int b;
+
+	if (ni->failed)
+		return -ENOMEM;
+	if (ni->count == ni->alloc && name_index_grow(ni)) {
+		ni->failed = true;
+		return -ENOMEM;
+	}
+
+	rec = &ni->recs[ni->count];
+	rec->dev_offset = dev_offset;
+	rec->hash = hash;
+	rec->name_len = (__u8)name_len;
+	rec->fingerprint = name_fingerprint(name, name_len);
+
+	/* append to the bucket, so the earliest file is found first */
+	b = name_index_bucket(ni, hash);
+	rec->next = NAME_REC_NONE;
+	if (ni->heads[b] == NAME_REC_NONE) {
+		ni->heads[b] = ni->count;
+	} else {
+		struct name_rec *last = &ni->recs[ni->heads[b]];
+
+		while (last->next != NAME_REC_NONE)
+			last = &ni->recs[last->next];
+		last->next = ni->count;
+	}
+	ni->count++;
+	return 0;
+}
+
+/*
+ * return the next file after @rec, or the first one if @rec is NULL,
+ * which may be named @name. NULL if there are no more.
+ */
+struct name_rec *name_index_find(struct name_index *ni, struct name_rec *rec,
+				 __u16 hash, __le16 *name, int name_len)
+{
+	__u32 i;
+	__u8 fp;
+
+	if (!ni->count)
+		return NULL;
+
+	fp = name_fingerprint(name, name_len);
+	i = rec ? rec->next : ni->heads[name_index_bucket(ni, hash)];
+	for (; i != NAME_REC_NONE; i = ni->recs[i].next) {
+		rec = &ni->recs[i];
+		if (rec->hash == hash && rec->name_len == name_len &&
+		    rec->fingerprint == fp)
+			return rec;
+	}
+	return NULL;
+}
+
+/* forget the names, touching only the buckets in use */
+void name_index_reset(struct name_index *ni)
+{
+	unsigned int i;
+
+	for (i = 0; i < ni->count; i++)
+		ni->heads[name_index_bucket(ni, ni->recs[i].hash)] =
+			NAME_REC_NONE;
+	ni->count = 0;
+	ni->failed = false;
+}
+
+/* @budget is the most bytes for the index, 0 for no limit */
+void name_index_init(struct name_index *ni, size_t budget)
+{
+	memset(ni, 0, sizeof(*ni));
+	ni->budget = budget;
+}
+
+void name_index_free(struct name_index *ni)
+{
+	if (ni->recs)
+		w_free(ni->recs);
+	if (ni->heads)
+		w_free(ni->heads);
+	ni->recs = NULL;
+	ni->heads = NULL;
+	ni->count = 0;
+	ni->alloc = 0;
+}
@@ -162,11 +162,11 @@ int exfat_repair_ask(struct exfat_fsck *fsck, er_problem_code_t prcode,
 	return repair;
 }
 
-static int get_rename_from_user(struct exfat_de_iter *iter,
-		__le16 *utf16_name, int name_size)
+static int get_rename_from_user(struct exfat_fsck *fsck,
+		struct exfat_de_iter *iter, __le16 *utf16_name, int name_size)
 {
 	int len = 0;
-	char *rename = w_malloc(ENTRY_NAME_MAX + 2);
+	char *rename = exfat_arena_alloc(&fsck->dir_arena, ENTRY_NAME_MAX + 2);
 
 	if (!rename)
 		return -ENOMEM;
@@ -198,19 +198,158 @@ retry:
 		exfat_de_iter_flush(iter);
 		err = exfat_lookup_file(iter->exfat, iter->parent, rename, &filter);
 		if (!err) {
+			exfat_free_dentry_set(filter.out.dentry_set);
 			printf("file(%s) already exists, retry to insert name\n", rename);
 			goto retry;
 		}
 	}
 
 out:
-	w_free(rename);
-
 	return len;
 }
 
-static int generate_rename(struct exfat_de_iter *iter, __le16 *utf16_name,
-		int name_size)
+#define CHK_NAME_PREFIX		"FILE"
+#define CHK_NAME_SUFFIX		".CHK"
+#define CHK_NAME_DIGITS		7
+
+/* the number of a FILE%07d.CHK name, or -1 */
+static int chk_name_num(const __le16 *name)
+{
+	int i, num = 0;
+	__u16 c;
+
+	for (i = 0; i < ENTRY_NAME_MAX; i++) {
+		c = le16_to_cpu(name[i]);
+		if (i < 4) {
+			if (c != CHK_NAME_PREFIX[i])
+				return -1;
+		} else if (i < 4 + CHK_NAME_DIGITS) {
+			if (c < '0' || c > '9')
+				return -1;
+			num = num * 10 + c - '0';
+		} else if (c != CHK_NAME_SUFFIX[i - 4 - CHK_NAME_DIGITS]) {
+			return -1;
+		}
+	}
+	return num;
+}
+
+static int chk_name_add(struct exfat_fsck *fsck, unsigned int num)
+{
+	unsigned int *nums;
+	unsigned int alloc;
+
+	if (fsck->chk_count == fsck->chk_alloc) {
+		alloc = fsck->chk_alloc ? fsck->chk_alloc * 2 : 16;
+		if (fsck->chk_max && alloc > fsck->chk_max)
+			return -ENOMEM;
+		nums = w_malloc(alloc * sizeof(*nums));
+		if (!nums)
+			return -ENOMEM;
+		if (fsck->chk_nums) {
+			memcpy(nums, fsck->chk_nums,
+			       fsck->chk_count * sizeof(*nums));
+			w_free(fsck->chk_nums);
+		}
+		fsck->chk_nums = nums;
+		fsck->chk_alloc = alloc;
+	}
+	fsck->chk_nums[fsck->chk_count++] = num;
+	return 0;
+}
+
+/*
+ * record the number of each file whose first name dentry holds a
+ * FILE%07d.CHK name. always return 1, so the lookup scans the whole
+ * directory.
+ */
+static int filter_chk_names(struct exfat_de_iter *iter, void *param,
+			    int *dentry_count)
+{
+	struct exfat_fsck *fsck = param;
+	struct exfat_dentry *file_de, *stream_de, *name_de;
+	__le16 name[ENTRY_NAME_MAX];
+	int num;
+
+	if (exfat_de_iter_get(iter, 0, &file_de) ||
+	    file_de->dentry.file.num_ext < 2 ||
+	    exfat_de_iter_get(iter, 1, &stream_de) ||
+	    stream_de->type != EXFAT_STREAM ||
+	    exfat_de_iter_get(iter, 2, &name_de) ||
+	    name_de->type != EXFAT_NAME)
+		return 1;
+
+	memcpy(name, name_de->name_unicode, sizeof(name));
+	num = chk_name_num(name);
+	if (num >= 0 && chk_name_add(fsck, num))
+		return -ENOMEM;
+	return 1;
+}
+
+static int cmp_chk_num(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * find the FILE%07d.CHK names in the directory in one pass, so that
+ * free numbers are handed out without a lookup for each one.
+ */
+static void read_chk_names(struct exfat_fsck *fsck, struct exfat_de_iter *iter)
+{
+	struct exfat_lookup_filter filter;
+	int err;
+
+	fsck->chk_count = 0;
+	fsck->chk_next = 0;
+
+	filter.in.type = EXFAT_FILE;
+	filter.in.filter = filter_chk_names;
+	filter.in.param = fsck;
+	filter.in.dentry_count = 0;
+	err = exfat_lookup_dentry_set(iter->exfat, iter->parent, &filter);
+	if (err != EOF) {
+		if (!err)
+			exfat_free_dentry_set(filter.out.dentry_set);
+		return;
+	}
+
+	if (fsck->chk_count)
+		qsort(fsck->chk_nums, fsck->chk_count,
+		      sizeof(*fsck->chk_nums), cmp_chk_num);
+	fsck->chk_known = true;
+}
+
+/* true if FILE@num.CHK is in the directory, for increasing @num */
+static bool chk_name_taken(struct exfat_fsck *fsck, unsigned int num)
+{
+	while (fsck->chk_next < fsck->chk_count &&
+	       fsck->chk_nums[fsck->chk_next] < num)
+		fsck->chk_next++;
+	return fsck->chk_next < fsck->chk_count &&
+		fsck->chk_nums[fsck->chk_next] == num;
+}
+
+/* keep the FILE%07d.CHK names known if one is given by the user */
+static void note_chk_name(struct exfat_fsck *fsck, __le16 *name)
+{
+	int num = chk_name_num(name);
+
+	if (num < 0)
+		return;
+	if (chk_name_add(fsck, num)) {
+		fsck->chk_known = false;
+		return;
+	}
+	qsort(fsck->chk_nums, fsck->chk_count, sizeof(*fsck->chk_nums),
+	      cmp_chk_num);
+	fsck->chk_next = 0;
+}
+
+static int generate_rename(struct exfat_fsck *fsck,
+		struct exfat_de_iter *iter, __le16 *utf16_name, int name_size)
 {
 	int err;
 	char *rename;
@@ -218,25 +357,36 @@ static int generate_rename(struct exfat_de_iter *iter, __le16 *utf16_name,
 	if (iter->invalid_name_num > INVALID_NAME_NUM_MAX)
 		return -ERANGE;
 
-	rename = w_malloc(ENTRY_NAME_MAX + 1);
+	rename = exfat_arena_alloc(&fsck->dir_arena, ENTRY_NAME_MAX + 1);
 	if (!rename)
 		return -ENOMEM;
 
+	if (!fsck->chk_known)
+		read_chk_names(fsck, iter);
+
 	while (1) {
 		struct exfat_lookup_filter filter;
 
 		snprintf(rename, ENTRY_NAME_MAX + 1, "FILE%07d.CHK",
 			 iter->invalid_name_num++);
+		if (fsck->chk_known) {
+			if (chk_name_taken(fsck, iter->invalid_name_num - 1))
+				continue;
+			break;
+		}
+
+		/* without the names of the directory, look each one up */
 		err = exfat_lookup_file(iter->exfat, iter->parent, rename,
 					&filter);
-		if (!err)
+		if (!err) {
+			exfat_free_dentry_set(filter.out.dentry_set);
 			continue;
+		}
 		break;
 	}
 
 	memset(utf16_name, 0, name_size);
 	err = exfat_utf16_enc(rename, utf16_name, name_size);
-	w_free(rename);
 
 	return err;
 }
@@ -247,7 +397,9 @@ int exfat_repair_rename_ask(struct exfat_fsck *fsck, struct exfat_de_iter *iter,
 	int num;
 	char old_name[PATH_MAX + 1] = {0};
 
-	if (exfat_utf16_dec(uname, NAME_BUFFER_SIZE, old_name, PATH_MAX) <= 0) {
+	if (exfat_utf16_dec(uname,
+			    (exfat_utf16_len(uname, EXFAT_NAME_MAX) + 1) * 2,
+			    old_name, PATH_MAX) <= 0) {
 		exfat_err("failed to decode filename\n");
 		return -EINVAL;
 	}
@@ -266,11 +418,13 @@ ask_again:
 
 		switch (num) {
 		case 1:
-			ret = get_rename_from_user(iter, utf16_name,
+			ret = get_rename_from_user(fsck, iter, utf16_name,
 					sizeof(utf16_name));
+			if (ret >= 0 && fsck->chk_known)
+				note_chk_name(fsck, utf16_name);
 			break;
 		case 2:
-			ret = generate_rename(iter, utf16_name,
+			ret = generate_rename(fsck, iter, utf16_name,
 					sizeof(utf16_name));
 			break;
 		case 3:
@@ -279,6 +433,8 @@ ask_again:
 			exfat_info("select 1 or 2 number instead of %d\n", num);
 			goto ask_again;
 		}
+		/* the new name is in @utf16_name */
+		exfat_arena_reset(&fsck->dir_arena);
 
 		if (ret < 0)
 			return -EINVAL;
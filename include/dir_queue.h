@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef _DIR_QUEUE_H
+#define _DIR_QUEUE_H
+
+#include "exfat_ondisk.h"
+#include "libexfat.h"
+
+#define DIR_REC_NONE		UINT32_MAX
+/* a directory read without a record, its subdirectories lose their path */
+#define DIR_REC_LOST		(UINT32_MAX - 1)
+#define DIR_QUEUE_MIN_SIZE	16
+#define DIR_QUEUE_HYBRID_CAP	256
+#define DIR_QUEUE_SPILL_BATCH	128	/* records written or read at once */
+
+enum dir_queue_order {
+	DIR_QUEUE_BFS,
+	DIR_QUEUE_DFS,
+	/* breadth-first until DIR_QUEUE_HYBRID_CAP directories are queued */
+	DIR_QUEUE_HYBRID,
+};
+
+/*
+ * a directory to read, or one which is being read or has subdirectories
+ * still queued. it has no name, paths are rebuilt from @parent when an
+ * error is reported.
+ */
+struct dir_rec {
+	uint64_t	size;
+	clus_t		first_clus;
+	__u32		parent;		/* index in dir_queue.recs */
+	__u32		refs;		/* reader and queued subdirectories */
+	bool		is_contiguous;
+	bool		dropped;	/* skip the queued subdirectories */
+	bool		paused;
+};
+
+/* a directory whose reading stopped for want of room in the queue */
+struct dir_pause {
+	__u32		idx;		/* in dir_queue.recs */
+	off64_t		resume;		/* file offset to read from */
+	unsigned int	mark;		/* resumed once no more are pending */
+};
+
+struct dir_queue {
+	enum dir_queue_order order;
+
+	/* directories to read, a ring of ring_size from @head */
+	struct dir_rec	*ring;
+	unsigned int	ring_size;
+	unsigned int	max_size;	/* 0 for no limit */
+	unsigned int	head;
+	unsigned int	count;
+
+	/*
+	 * batches of directories moved out of a full ring, a stack in
+	 * @scratch from @spill_base. the last one is read back once the
+	 * ring is empty.
+	 */
+	struct exfat_scratch *scratch;
+	off64_t		spill_base;
+	unsigned int	batch;
+	unsigned int	spill_count;
+	unsigned int	spill_alloc;
+	unsigned long	spill_writes;
+	unsigned long	spill_reads;
+
+	/* parents, freed ones are chained through @parent */
+	struct dir_rec	*recs;
+	unsigned int	rec_alloc;
+	unsigned int	rec_max;	/* 0 for no limit */
+	__u32		free_rec;
+	struct dir_rec	lost;		/* held as DIR_REC_LOST */
+	unsigned long	lost_count;
+
+	/* a stack of paused directories, as many as @recs can hold */
+	struct dir_pause *pauses;
+	unsigned int	pause_count;
+
+	unsigned int	peak;
+	size_t		peak_bytes;
+};
+
+struct exfat_inode;
+
+void dir_queue_init(struct dir_queue *q, enum dir_queue_order order,
+		    size_t budget, size_t rec_budget,
+		    struct exfat_scratch *scratch);
+size_t dir_queue_heap_size(size_t budget, size_t rec_budget);
+int dir_queue_push(struct dir_queue *q, struct exfat_inode *dir,
+		   __u32 parent);
+int dir_queue_reserve(struct dir_queue *q);
+int dir_queue_pop(struct dir_queue *q, __u32 *idx, off64_t *resume);
+void dir_queue_pause(struct dir_queue *q, __u32 idx, off64_t resume);
+struct dir_rec *dir_queue_peek(struct dir_queue *q);
+void dir_queue_put(struct dir_queue *q, __u32 idx);
+void dir_queue_drop_children(struct dir_queue *q, __u32 idx);
+void dir_queue_free(struct dir_queue *q);
+
+static inline struct dir_rec *dir_queue_rec(struct dir_queue *q, __u32 idx)
+{
+	return idx == DIR_REC_LOST ? &q->lost : &q->recs[idx];
+}
+
+#endif
@@ -20,18 +20,22 @@ struct exfat_de_iter {
 	struct exfat		*exfat;
 	struct exfat_inode	*parent;
 	struct buffer_desc	*buffer_desc;
-	__u32			ra_next_clus;
-	unsigned int		ra_begin_offset;
-	unsigned int		ra_partial_size;
-	unsigned int		read_size;		/* cluster size */
+	unsigned int		read_size;		/* block size */
 	unsigned int		write_size;		/* sector size */
+	unsigned int		buffer_count;		/* blocks carved */
 	off64_t			de_file_offset;
 	off64_t			next_read_offset;
 	int			max_skip_dentries;
 #define INVALID_NAME_NUM_MAX	9999999
 	unsigned int		invalid_name_num;
 
-	char *name_hash_bitmap;		/* bitmap of children's name hashes */
+	/* dentries from de_file_offset pinned by exfat_de_iter_pin() */
+	struct exfat_dentry	*pin_de;
+	int			pin_count;
+	bool			pin_stitched;	/* @pin_de is a copy */
+	bool			pin_changed;	/* a pinned dentry is dirty */
+	bitmap_t		pin_dirty[EXFAT_BITMAP_SIZE(MAX_EXT_DENTRIES + 1) /
+					  sizeof(bitmap_t)];
 };
 
 struct exfat_lookup_filter {
@@ -63,12 +67,26 @@ struct exfat_lookup_filter {
 	} out;
 };
 
+/* a file dentry set checked in one pass by exfat_check_dentry_set() */
+struct exfat_dset_check {
+	uint16_t		checksum;	/* of all the dentries */
+	uint16_t		name_hash;	/* of the upcased name */
+	int			name_dentries;	/* name dentries in a row */
+	int			name_len;	/* characters before a NUL */
+	int			bad_char;	/* first invalid one, or name_len */
+	int			dots;		/* leading '.' characters */
+};
+
 int exfat_de_iter_init(struct exfat_de_iter *iter, struct exfat *exfat,
 		       struct exfat_inode *dir, struct buffer_desc *bd);
 int exfat_de_iter_get(struct exfat_de_iter *iter,
 		      int ith, struct exfat_dentry **dentry);
 int exfat_de_iter_get_dirty(struct exfat_de_iter *iter,
 			    int ith, struct exfat_dentry **dentry);
+void exfat_de_iter_set_dirty(struct exfat_de_iter *iter, int ith);
+int exfat_de_iter_pin(struct exfat_de_iter *iter, int count,
+		      struct exfat_dentry **dset);
+int exfat_de_iter_unpin(struct exfat_de_iter *iter);
 int exfat_de_iter_flush(struct exfat_de_iter *iter);
 int exfat_de_iter_advance(struct exfat_de_iter *iter, int skip_dentries);
 off64_t exfat_de_iter_device_offset(struct exfat_de_iter *iter);
@@ -95,8 +113,14 @@ int exfat_build_file_dentry_set(struct exfat *exfat, const char *name,
 int exfat_add_dentry_set(struct exfat *exfat, struct exfat_dentry_loc *loc,
 			 struct exfat_dentry *dset, int dcount,
 			 bool need_next_loc);
+int exfat_read_dentry_set(struct exfat *exfat, struct exfat_inode *dir,
+			  struct exfat_dentry *dset, int dcount,
+			  off64_t dev_off);
 void exfat_calc_dentry_checksum(struct exfat_dentry *dentry,
 				uint16_t *checksum, bool primary);
+void exfat_check_dentry_set(struct exfat *exfat, struct exfat_dentry *dset,
+			    int count, int name_dentries, __le16 *name,
+			    struct exfat_dset_check *chk);
 uint16_t exfat_calc_name_hash(struct exfat *exfat,
 			      __le16 *name, int len);
 
@@ -15,25 +15,139 @@ struct exfat_dentry;
 #define EXFAT_NAME_MAX			255
 #define NAME_BUFFER_SIZE		((EXFAT_NAME_MAX + 1) * 2)
 
+/* run of @len clusters starting at @clus, mapped from file cluster @fclus */
+struct exfat_extent {
+	clus_t			fclus;
+	clus_t			clus;
+	clus_t			len;
+};
+
+/*
+ * 64-bit fields come first and the small ones last, so the struct has
+ * no holes on 32-bit targets. the name is stored right after it and is
+ * sized to the name, see exfat_alloc_inode_name().
+ */
 struct exfat_inode {
+	uint64_t		size;
+	off64_t			dev_offset;
 	struct exfat_inode	*parent;
-	uint32_t padding0;
 	struct list_head	children;
 	struct list_head	sibling;
 	struct list_head	list;
+	struct exfat_dentry	*dentry_set;
+	struct exfat_extent	*extents;	/* built lazily, sorted by fclus */
 	clus_t			first_clus;
+	unsigned int		extent_count;
+	unsigned int		extent_alloc;
+	int			dentry_count;
 	__u16			attr;
-	uint64_t		size;
+	__u8			name_slots;	/* name dentries that fit */
 	bool			is_contiguous;
-	struct exfat_dentry	*dentry_set;
-	uint32_t padding1;
-	int			dentry_count;
-	off64_t			dev_offset;
-	__le16			name[0];	/* only for directory */
+	__le16			name[];
+};
+
+/* an inode with room for the longest name, to be kept on the stack */
+union exfat_inode_buf {
+	struct exfat_inode	inode;
+	char			buf[sizeof(struct exfat_inode) + NAME_BUFFER_SIZE];
 };
 
 
 
+/*
+ * FAT cache. The FAT is cached in windows of @line_size bytes which
+ * never cross the end of the FAT region. Lines are replaced in LRU
+ * order, and entries changed by exfat_set_fat() are written back on
+ * eviction or on exfat_fat_cache_flush().
+ */
+struct fat_cache_line {
+	off64_t		offset;		/* device offset, or -1 if unused */
+	unsigned int	size;
+	unsigned int	lru;
+	bool		dirty;
+	char		*buffer;
+};
+
+struct exfat_fat_cache {
+	struct fat_cache_line	*lines;
+	unsigned int		line_count;
+	unsigned int		line_size;
+	unsigned int		last_line;	/* most recently used */
+	unsigned int		lru_clock;
+	unsigned long		hits;
+	unsigned long		misses;
+	unsigned long		writebacks;
+};
+
+/*
+ * directory blocks read ahead of the iterators. a block which misses is
+ * read together with the blocks predicted to follow it, as long as they
+ * are contiguous on the device, in one read into adjacent slots. the
+ * prediction follows the directory, then the first cluster of the next
+ * directory given by exfat_prefetch_hint(). read_block() points the
+ * buffer_desc at the slot instead of copying it, and the slot stays
+ * borrowed until that buffer_desc is read into again.
+ */
+struct exfat_ra_slot {
+	off64_t		offset;		/* device offset, or -1 if unused */
+	bool		borrowed;
+};
+
+struct exfat_prefetch {
+	int			fd;
+	char			*data;		/* slot_count * slot_size */
+	struct exfat_ra_slot	*slots;
+	unsigned int		slot_count;
+	unsigned int		slot_size;
+	unsigned int		next;		/* first slot of the next run */
+	clus_t			next_dir_clus;	/* 0 if not known */
+	uint64_t		next_dir_size;
+	unsigned long		reads;
+	unsigned long		blocks;
+	unsigned long		hits;
+	unsigned long		wasted;
+};
+
+/*
+ * FAT map built by a single sequential sweep of the FAT. Entries which
+ * point to the next cluster or are EOF are kept as one bit each, all
+ * the other non-free entries are kept in @jumps sorted by cluster. If
+ * @jumps overflowed, @complete is false and entries missing from the
+ * map are read through the FAT cache.
+ */
+struct fat_map_jump {
+	clus_t		clus;
+	clus_t		next;
+};
+
+struct exfat_fat_map {
+	struct exfat_bitmap	*seq_bitmap;	/* FAT[c] == c + 1 */
+	struct exfat_bitmap	*eof_bitmap;	/* FAT[c] == EOF */
+	struct fat_map_jump	*jumps;
+	unsigned int		jump_count;
+	unsigned int		jump_max;
+	bool			complete;
+};
+
+struct exfat_fat_sweep_stat {
+	clus_t		used;		/* non-free entries */
+	clus_t		heads;		/* used entries nobody points to */
+	clus_t		cross_links;	/* links to already referenced clusters */
+	clus_t		dangling;	/* links out of heap or to free entries */
+	clus_t		bad;		/* entries marked as BAD */
+	clus_t		jumps;		/* fragment boundaries */
+};
+
+/*
+ * two-level index of the bitmap words which have a cluster that is free
+ * in both alloc_bitmap and disk_bitmap.
+ */
+struct exfat_free_summary {
+	bitmap_t		*l1;		/* a bit per bitmap word */
+	bitmap_t		*l2;		/* a bit per l1 word */
+	unsigned int		words;		/* bitmap words covered */
+};
+
 struct exfat {
 	struct exfat_blk_dev	*blk_dev;
 	struct pbr		*bs;
@@ -43,15 +157,28 @@ struct exfat {
 	clus_t			clus_count;
 	unsigned int		clus_size;
 	unsigned int		sect_size;
-	char			*disk_bitmap;
-	char			*alloc_bitmap;
-	char			*ohead_bitmap;
+	struct exfat_bitmap	*disk_bitmap;
+	struct exfat_bitmap	*alloc_bitmap;
+	struct exfat_bitmap	*ohead_bitmap;
+	struct exfat_bitmap_opts bitmap_opts;
 	clus_t			disk_bitmap_clus;
 	unsigned int		disk_bitmap_size;
-	__u16			*upcase_table;
+	/*
+	 * upcase table, what to add to each character in pages of
+	 * EXFAT_UPCASE_PAGE_CHARS. pages which change no character share
+	 * the zeroed page at the start of @upcase_data.
+	 */
+	__u16			*upcase_pages[EXFAT_UPCASE_PAGES];
+	__u16			*upcase_data;
 	clus_t			start_clu;
+	unsigned int		read_size;	/* see EXFAT_DIR_READ_SIZE */
 	unsigned int		buffer_count;
 	struct buffer_desc	*lookup_buffer; /* for dentry set lookup */
+	struct exfat_fat_cache	*fat_cache;
+	struct exfat_prefetch	*prefetch;
+	struct exfat_fat_map	*fat_map;
+	struct exfat_free_summary *free_summary;
+	struct exfat_clus_list	*disk_mismatch;	/* disk_bitmap is streamed */
 };
 
 struct exfat_dentry_loc {
@@ -60,24 +187,75 @@ struct exfat_dentry_loc {
 	off64_t			dev_offset;
 };
 
+#define PATH_RESOLVE_MAX_DEPTH	255
+
+/*
+ * path of an inode for messages. @local_path is allocated to the size of
+ * the path when it is resolved, and freed by exfat_release_path().
+ */
 struct path_resolve_ctx {
-	struct exfat_inode	*ancestors[255];
-	__le16			utf16_path[PATH_MAX + 2];
-	char			local_path[PATH_MAX * MB_LEN_MAX + 1];
+	char			*local_path;
+	size_t			size;		/* 0 if not allocated */
+	int			max_depth;	/* 0 for PATH_RESOLVE_MAX_DEPTH */
+	int			max_len;	/* 0 for PATH_MAX */
 };
 
+/* shared by the error messages of the library and the tools */
+extern struct path_resolve_ctx path_resolve_ctx;
+
 struct buffer_desc {
 	__u32		p_clus;
 	unsigned int	offset;
-	char		*buffer;
-	char		dirty[EXFAT_BITMAP_SIZE(4 * KB / 512)];
+	char		*buffer;	/* a read-ahead slot, or @own_buffer */
+	char		*own_buffer;	/* block sized for the directory */
+	char		*dirty;		/* bitmap of sectors to write back */
 };
 
-struct exfat *exfat_alloc_exfat(struct exfat_blk_dev *blk_dev, struct pbr *bs);
+struct exfat *exfat_alloc_exfat(struct exfat_blk_dev *blk_dev, struct pbr *bs,
+				const struct exfat_bitmap_opts *bitmap_opts);
 void exfat_free_exfat(struct exfat *exfat);
 
+int exfat_fat_cache_init(struct exfat *exfat, unsigned int line_count,
+			 unsigned int line_size);
+size_t exfat_fat_cache_heap_size(unsigned int line_count,
+				 unsigned int line_size, unsigned int sect_size);
+int exfat_fat_cache_flush(struct exfat *exfat);
+void exfat_fat_cache_free(struct exfat *exfat);
+int exfat_fat_sweep(struct exfat *exfat, unsigned int chunk_size,
+		    unsigned int jump_max, struct exfat_fat_sweep_stat *stat);
+void exfat_fat_map_free(struct exfat *exfat);
+
+int exfat_prefetch_init(struct exfat *exfat, unsigned int slot_count);
+size_t exfat_prefetch_heap_size(unsigned int slot_count,
+				unsigned int slot_size);
+void exfat_prefetch_free(struct exfat *exfat);
+void exfat_prefetch_hint(struct exfat *exfat, clus_t first_clus, uint64_t size);
+void exfat_prefetch_invalidate(int fd, off64_t offset, size64_t size);
+void exfat_prefetch_put(struct exfat_prefetch *pf, struct buffer_desc *desc);
+
+int exfat_free_summary_init(struct exfat *exfat);
+void exfat_free_summary_free(struct exfat *exfat);
+int exfat_free_summary_find(struct exfat *exfat, clus_t start_clu,
+			    clus_t end_clu, clus_t *free_clu);
+int exfat_disk_bitmap_stream(struct exfat *exfat, off64_t offset,
+			     size_t size, unsigned int page_size,
+			     unsigned int resident);
+void exfat_alloc_bitmap_set(struct exfat *exfat, clus_t clus);
+void exfat_alloc_bitmap_set_range(struct exfat *exfat, clus_t start_clus,
+				  clus_t count);
+
+void exfat_disable_caches(void);
+size_t exfat_inode_heap_size(unsigned int name_len);
+size_t exfat_dentry_set_heap_size(int count);
 struct exfat_inode *exfat_alloc_inode(__u16 attr);
+struct exfat_inode *exfat_alloc_inode_name(__u16 attr, unsigned int name_len);
+size_t exfat_inode_mem_size(const struct exfat_inode *node);
+struct exfat_inode *exfat_inode_init(union exfat_inode_buf *buf, __u16 attr);
 void exfat_free_inode(struct exfat_inode *node);
+struct exfat_dentry *exfat_alloc_dentry_set(int count);
+void exfat_free_dentry_set(struct exfat_dentry *dset);
+void exfat_shrink_caches(void);
+void exfat_inode_drop_extents(struct exfat_inode *node);
 
 void exfat_free_children(struct exfat_inode *dir, bool file_only);
 void exfat_free_file_children(struct exfat_inode *dir);
@@ -85,14 +263,38 @@ void exfat_free_ancestors(struct exfat_inode *child);
 void exfat_free_dir_list(struct exfat *exfat);
 
 int exfat_resolve_path(struct path_resolve_ctx *ctx, struct exfat_inode *child);
+void exfat_release_path(struct path_resolve_ctx *ctx);
+size_t exfat_resolve_path_heap_size(const struct path_resolve_ctx *ctx);
 int exfat_resolve_path_parent(struct path_resolve_ctx *ctx,
 			      struct exfat_inode *parent, struct exfat_inode *child);
 
+unsigned int exfat_dir_read_size(unsigned int size, unsigned int sect_size);
+size_t exfat_buffer_mem_size(unsigned int read_size, unsigned int clus_size,
+			     unsigned int sect_size);
+size_t exfat_buffer_heap_size(unsigned int read_size, unsigned int clus_size,
+			      unsigned int sect_size);
 struct buffer_desc *exfat_alloc_buffer(struct exfat *exfat);
+void exfat_buffer_set_block(const struct exfat *exfat, struct buffer_desc *bd,
+			    unsigned int block_size);
+struct exfat_dentry *exfat_buffer_stitch(struct buffer_desc *bd,
+					 unsigned int count);
 void exfat_free_buffer(const struct exfat *exfat, struct buffer_desc *bd);
 
+/* buffers which hold the largest dentry set across blocks of @block_size */
+static inline unsigned int exfat_buffer_count(unsigned int block_size)
+{
+	return MAX(((MAX_EXT_DENTRIES + 1) * DENTRY_SIZE) / block_size + 1, 2);
+}
+
+static inline __u16 exfat_upcase(const struct exfat *exfat, __u16 c)
+{
+	return c + exfat->upcase_pages[c / EXFAT_UPCASE_PAGE_CHARS]
+				      [c % EXFAT_UPCASE_PAGE_CHARS];
+}
+
+/* read size of directories which are not contiguous */
 static inline unsigned int exfat_get_read_size(const struct exfat *exfat)
 {
-	return MIN(exfat->clus_size, 4 * KB);
+	return MIN(exfat->clus_size, exfat->read_size);
 }
 #endif
@@ -7,6 +7,8 @@
 
 #include "list.h"
 #include "exfat_dir.h"
+#include "dir_queue.h"
+#include "name_index.h"
 #include "my_types.h"
 
 enum fsck_ui_options {
@@ -18,20 +20,56 @@ enum fsck_ui_options {
 	FSCK_OPTS_REPAIR_ALL	= 0x0f,
 	FSCK_OPTS_IGNORE_BAD_FS_NAME	= 0x10,
 	FSCK_OPTS_RESCUE_CLUS	= 0x20,
+	FSCK_OPTS_FAT_SWEEP	= 0x40,
+	FSCK_OPTS_COMPRESS_BITMAP	= 0x80,
+	FSCK_OPTS_STREAM_BITMAP	= 0x100,
 };
 
 struct exfat;
 struct exfat_inode;
 
+#define FSCK_NAME_HASH_TOUCHED	256
+
 struct exfat_fsck {
 	struct exfat		*exfat;
 	struct exfat_de_iter	de_iter;
 	struct buffer_desc	*buffer_desc;	/* cluster * 2 */
 	enum fsck_ui_options	options;
+	size_t			mem_budget;	/* heap bytes, 0 for no limit */
+	size_t			mem_base;	/* heap in use before fsck */
 	bool			dirty:1;
 	bool			dirty_fat:1;
 
-	char *name_hash_bitmap;
+	/*
+	 * name hashes of the children of the directory being read. the
+	 * first FSCK_NAME_HASH_TOUCHED words set are listed so that only
+	 * those are cleared for the next directory.
+	 */
+	bitmap_t		*name_hash_bitmap;
+	__u16			*name_hash_touched;
+	unsigned int		name_hash_touched_count;
+	struct name_index	name_index;	/* files of the directory */
+	size_t			name_budget;	/* bytes, 0 for no limit */
+
+	/* FILE%07d.CHK names of the directory, read at its first rename */
+	unsigned int		*chk_nums;	/* sorted */
+	unsigned int		chk_count;
+	unsigned int		chk_alloc;
+	unsigned int		chk_max;	/* 0 for no limit */
+	unsigned int		chk_next;	/* first not below the candidate */
+	bool			chk_known;
+	struct exfat_arena	dir_arena;	/* reset after each rename */
+
+	enum dir_queue_order	dir_order;
+	unsigned long		dir_budget;	/* bytes, 0 for no limit */
+	size_t			dir_rec_budget;	/* bytes, 0 for no limit */
+	struct dir_queue	dir_queue;
+	struct exfat_inode	*dir;		/* being read, no name or parent */
+	__u32			dir_rec;
+
+	unsigned int		sweep_chunk;	/* FAT sweep read size */
+	unsigned int		sweep_jumps;	/* FAT sweep fragment table */
+	unsigned int		ra_blocks;	/* directory read-ahead */
 };
 
 //off64_t exfat_c2o(struct exfat *exfat, unsigned int clus);
@@ -45,6 +45,11 @@ typedef __u32 clus_t;
 #define EXFAT_UPCASE_TABLE_CHARS	(0x10000)
 #define EXFAT_UPCASE_TABLE_SIZE		(5836)
 
+/* the upcase table is kept in pages of this many characters */
+#define EXFAT_UPCASE_PAGE_CHARS		256
+#define EXFAT_UPCASE_PAGES		\
+	(EXFAT_UPCASE_TABLE_CHARS / EXFAT_UPCASE_PAGE_CHARS)
+
 /* Flags for tune.exfat and exfatlabel */
 #define EXFAT_GET_VOLUME_LABEL		0x01
 #define EXFAT_SET_VOLUME_LABEL		0x02
@@ -61,6 +66,69 @@ typedef __u32 clus_t;
 
 #define EXFAT_MAX_HASH_COUNT		(UINT16_MAX + 1)
 
+/* FAT cache geometry, 0 lines disables the cache */
+#ifndef EXFAT_FAT_CACHE_LINES
+#define EXFAT_FAT_CACHE_LINES		8
+#endif
+#ifndef EXFAT_FAT_CACHE_LINE_SIZE
+#define EXFAT_FAT_CACHE_LINE_SIZE	(4 * KB)
+#endif
+
+/*
+ * bytes read from a directory at once. directories which are not
+ * contiguous are read at most a cluster at a time.
+ */
+#ifndef EXFAT_DIR_READ_SIZE
+#define EXFAT_DIR_READ_SIZE		(4 * KB)
+#endif
+#define EXFAT_DIR_READ_MAX		(256 * KB)
+
+/* directory blocks read ahead, 0 disables read-ahead */
+#ifndef EXFAT_READAHEAD_BLOCKS
+#define EXFAT_READAHEAD_BLOCKS		4
+#endif
+
+/* read size and fragment table size of the sequential FAT sweep */
+#ifndef EXFAT_FAT_SWEEP_CHUNK_SIZE
+#define EXFAT_FAT_SWEEP_CHUNK_SIZE	(32 * KB)
+#endif
+#ifndef EXFAT_FAT_SWEEP_MAX_JUMPS
+#define EXFAT_FAT_SWEEP_MAX_JUMPS	(16 * 1024)
+#endif
+
+/*
+ * bitmap write-back: one write never crosses an allocation unit of the
+ * media, and dirty sectors at most EXFAT_BITMAP_WRITE_GAP clean sectors
+ * apart are merged into one write. 0 AU size means no AU limit.
+ */
+#ifndef EXFAT_BITMAP_AU_SIZE
+#define EXFAT_BITMAP_AU_SIZE		(4 * MB)
+#endif
+#ifndef EXFAT_BITMAP_WRITE_GAP
+#define EXFAT_BITMAP_WRITE_GAP		8
+#endif
+
+/* page size and resident pages of a paged cluster bitmap */
+#ifndef EXFAT_BITMAP_PAGE_SIZE
+#define EXFAT_BITMAP_PAGE_SIZE		(4 * KB)
+#endif
+#ifndef EXFAT_BITMAP_RESIDENT_PAGES
+#define EXFAT_BITMAP_RESIDENT_PAGES	16
+#endif
+
+/* chunk size of the object caches and block size of the arenas */
+#ifndef EXFAT_SLAB_CHUNK_SIZE
+#define EXFAT_SLAB_CHUNK_SIZE		(4 * KB)
+#endif
+#ifndef EXFAT_ARENA_BLOCK_SIZE
+#define EXFAT_ARENA_BLOCK_SIZE		(1 * KB)
+#endif
+
+/* keep a summary of free bitmap words for the free cluster search */
+#ifndef EXFAT_FREE_SUMMARY
+#define EXFAT_FREE_SUMMARY		1
+#endif
+
 enum {
 	BOOT_SEC_IDX = 0,
 	EXBOOT_SEC_IDX,
@@ -122,37 +190,227 @@ typedef __u32	bitmap_t;
 #define BITMAP_CLEAR(bmap, bit)	\
 	(((bitmap_t *)(bmap))[BIT_ENTRY(bit)] &= ~BIT_MASK(bit))
 
-static inline bool exfat_bitmap_get(char *bmap, clus_t c)
+/* clusters covered by one chunk of a compressed cluster bitmap */
+#define EXFAT_BITMAP_CHUNK_BITS		4096
+#define EXFAT_BITMAP_CHUNK_WORDS	(EXFAT_BITMAP_CHUNK_BITS / BITS_PER)
+
+enum exfat_bitmap_type {
+	EXFAT_BITMAP_FLAT,		/* one array of all bits */
+	EXFAT_BITMAP_COMPRESSED,	/* all-zero/all-one chunks not stored */
+	EXFAT_BITMAP_PAGED,		/* pages kept in a scratch area */
+};
+
+/*
+ * storage outside of the checked volume for data which does not fit in
+ * memory: a file, or a region of a device. space is handed out by
+ * exfat_scratch_reserve() and never given back.
+ */
+struct exfat_scratch {
+	int			fd;
+	off64_t			offset;		/* start of the area in @fd */
+	off64_t			size;		/* 0 for no limit */
+	off64_t			used;		/* bytes handed out */
+};
+
+/* a page of a paged bitmap held in memory */
+struct exfat_bitmap_page {
+	unsigned int		index;		/* page number, or UINT_MAX */
+	unsigned int		lru;
+	bool			dirty;
+	bitmap_t		*buf;
+};
+
+/*
+ * bitmap indexed by cluster number. a flat bitmap is a plain bitmap_t
+ * array in @words. a compressed one stores only the chunks which have
+ * both set and clear bits, the others are recorded in @ones. a paged
+ * one keeps @resident pages in memory and the rest in a scratch area,
+ * pages never written out read as zeroes. a mapped one is paged and
+ * read-only, its pages are read from @source.
+ */
+struct exfat_bitmap {
+	enum exfat_bitmap_type	type;
+	clus_t			clus_count;
+	unsigned int		word_count;
+	bitmap_t		*words;		/* flat */
+	unsigned int		chunk_count;
+	bitmap_t		**chunks;	/* NULL for a uniform chunk */
+	bitmap_t		*ones;		/* uniform chunk is all ones */
+	__u16			*weight;	/* set bits of a stored chunk */
+	unsigned int		stored;		/* stored chunks */
+	struct exfat_scratch	*scratch;	/* paged */
+	off64_t			scratch_off;
+	unsigned int		page_words;
+	unsigned int		page_count;
+	bitmap_t		*written;	/* page is in the scratch area */
+	struct exfat_bitmap_page *pages;
+	unsigned int		resident;
+	unsigned int		last_page;	/* slot used last */
+	unsigned int		lru_clock;
+	unsigned long		faults;
+	unsigned long		writebacks;
+	bool			mapped;
+	struct exfat_scratch	source;		/* mapped */
+	int			err;		/* sticky error of set/clear */
+};
+
+/*
+ * layout of the cluster bitmaps allocated by exfat_alloc_exfat(), and
+ * the FAT cache lines and directory read size set up with them
+ */
+struct exfat_bitmap_opts {
+	enum exfat_bitmap_type	type;
+	struct exfat_scratch	*scratch;	/* paged */
+	unsigned int		page_size;	/* paged, 0 for the default */
+	unsigned int		resident_pages;	/* paged, 0 for the default */
+	bool			stream_disk;	/* see exfat_disk_bitmap_stream() */
+	unsigned int		mismatch_runs;	/* streamed, 0 for no limit */
+	unsigned int		fat_cache_lines; /* 0 for the default */
+	unsigned int		dir_read_size;	/* 0 for the default */
+	unsigned int		max_extents;	/* of an inode, 0 for no limit */
+};
+
+void exfat_bitmap_put_word(struct exfat_bitmap *bm, unsigned int w,
+			   bitmap_t word);
+bitmap_t exfat_bitmap_paged_word(struct exfat_bitmap *bm, unsigned int w);
+
+static inline bitmap_t exfat_bitmap_word(struct exfat_bitmap *bm,
+					 unsigned int w)
+{
+	bitmap_t *chunk;
+
+	if (bm->words)
+		return bm->words[w];
+	if (bm->pages)
+		return exfat_bitmap_paged_word(bm, w);
+
+	chunk = bm->chunks[w / EXFAT_BITMAP_CHUNK_WORDS];
+	if (chunk)
+		return chunk[w % EXFAT_BITMAP_CHUNK_WORDS];
+	return BITMAP_GET(bm->ones, w / EXFAT_BITMAP_CHUNK_WORDS) ?
+		(bitmap_t)~0 : 0;
+}
+
+static inline bool exfat_bitmap_get(struct exfat_bitmap *bm, clus_t c)
 {
 	clus_t cc = c - EXFAT_FIRST_CLUSTER;
 
-	return BITMAP_GET(bmap, cc);
+	return exfat_bitmap_word(bm, BIT_ENTRY(cc)) & BIT_MASK(cc);
 }
 
-static inline void exfat_bitmap_set(char *bmap, clus_t c)
+static inline void exfat_bitmap_set(struct exfat_bitmap *bm, clus_t c)
 {
 	clus_t cc = c - EXFAT_FIRST_CLUSTER;
 
-	BITMAP_SET(bmap, cc);
+	if (bm->words)
+		BITMAP_SET(bm->words, cc);
+	else
+		exfat_bitmap_put_word(bm, BIT_ENTRY(cc),
+				      exfat_bitmap_word(bm, BIT_ENTRY(cc)) |
+				      BIT_MASK(cc));
 }
 
-static inline void exfat_bitmap_clear(char *bmap, clus_t c)
+static inline void exfat_bitmap_clear(struct exfat_bitmap *bm, clus_t c)
 {
 	clus_t cc = c - EXFAT_FIRST_CLUSTER;
-	(((bitmap_t *)(bmap))[BIT_ENTRY(cc)] &= ~BIT_MASK(cc));
+
+	if (bm->words)
+		BITMAP_CLEAR(bm->words, cc);
+	else
+		exfat_bitmap_put_word(bm, BIT_ENTRY(cc),
+				      exfat_bitmap_word(bm, BIT_ENTRY(cc)) &
+				      ~BIT_MASK(cc));
 }
 
-void exfat_bitmap_set_range(struct exfat *exfat, char *bitmap,
+/* sorted and disjoint runs of clusters */
+struct exfat_clus_run {
+	clus_t			start;
+	clus_t			count;
+};
+
+struct exfat_clus_list {
+	struct exfat_clus_run	*runs;
+	unsigned int		count;
+	unsigned int		alloc;
+	unsigned int		max;		/* runs, 0 for no limit */
+	int			err;		/* sticky error of add */
+};
+
+/* cache of objects of @obj_size bytes which are reused once freed */
+struct exfat_slab {
+	size_t			obj_size;
+	void			*free_list;
+	union exfat_slab_chunk	*chunks;
+	unsigned int		chunk_count;
+	unsigned int		in_use;
+};
+
+/* bump allocator whose objects are all freed at once */
+struct exfat_arena {
+	size_t			block_size;	/* 0 for the default */
+	struct exfat_arena_block *blocks;	/* newest first */
+};
+
+/* walks runs of set or clear bits of a cluster bitmap */
+struct exfat_bitmap_iter {
+	struct exfat_bitmap *bmap;
+	clus_t next;		/* cluster to resume the scan from */
+	clus_t end;		/* one past the last cluster */
+};
+
+int exfat_scratch_reserve(struct exfat_scratch *scratch, size_t size,
+			  off64_t *offset);
+struct exfat_bitmap *exfat_bitmap_alloc(const struct exfat_bitmap_opts *opts,
+					clus_t clus_count);
+struct exfat_bitmap *exfat_bitmap_map(int fd, off64_t offset, size_t size,
+				      clus_t clus_count, unsigned int page_size,
+				      unsigned int resident);
+void exfat_bitmap_free(struct exfat_bitmap *bm);
+size_t exfat_bitmap_mem_size(struct exfat_bitmap *bm);
+size_t exfat_bitmap_heap_size(const struct exfat_bitmap_opts *opts,
+			      clus_t clus_count);
+size_t exfat_bitmap_map_heap_size(clus_t clus_count, unsigned int page_size,
+				  unsigned int resident);
+int exfat_bitmap_load(struct exfat_bitmap *bm, unsigned int first_word,
+		      const bitmap_t *src, unsigned int count);
+void exfat_bitmap_store(struct exfat_bitmap *bm, unsigned int first_word,
+			bitmap_t *dst, unsigned int count);
+int exfat_bitmap_read(struct exfat_bitmap *bm, int fd, off64_t offset,
+		      size_t size);
+clus_t exfat_bits_scan(bitmap_t *map, clus_t b, clus_t end, int bit);
+void exfat_bitmap_set_range(struct exfat *exfat, struct exfat_bitmap *bm,
 			    clus_t start_clus, clus_t count);
-int exfat_bitmap_find_zero(struct exfat *exfat, char *bmap,
+void exfat_bitmap_clear_range(struct exfat *exfat, struct exfat_bitmap *bm,
+			      clus_t start_clus, clus_t count);
+clus_t exfat_bitmap_scan(struct exfat_bitmap *bm, clus_t start_clu,
+			 clus_t end_clu, int bit);
+int exfat_bitmap_find_zero(struct exfat *exfat, struct exfat_bitmap *bm,
 			   clus_t start_clu, clus_t *next);
-int exfat_bitmap_find_one(struct exfat *exfat, char *bmap,
+int exfat_bitmap_find_one(struct exfat *exfat, struct exfat_bitmap *bm,
 			  clus_t start_clu, clus_t *next);
+void exfat_bitmap_iter_init(struct exfat *exfat, struct exfat_bitmap_iter *iter,
+			    struct exfat_bitmap *bm, clus_t start_clu);
+bool exfat_bitmap_iter_next(struct exfat_bitmap_iter *iter, int bit,
+			    clus_t *start_clu, clus_t *count);
+int exfat_clus_list_add(struct exfat_clus_list *list, clus_t start,
+			clus_t count);
+bool exfat_clus_list_next(struct exfat_clus_list *list, clus_t clus,
+			  clus_t *next);
+void exfat_clus_list_free(struct exfat_clus_list *list);
+size_t exfat_clus_list_heap_size(unsigned int max);
+
+void *exfat_slab_alloc(struct exfat_slab *slab);
+void exfat_slab_free(struct exfat_slab *slab, void *obj);
+void exfat_slab_shrink(struct exfat_slab *slab);
+void *exfat_arena_alloc(struct exfat_arena *arena, size_t size);
+void exfat_arena_reset(struct exfat_arena *arena);
+void exfat_arena_free(struct exfat_arena *arena);
+size_t exfat_arena_heap_size(const struct exfat_arena *arena);
 
 void show_version(void);
 
 wchar_t exfat_bad_char(wchar_t w);
-void boot_calc_checksum(unsigned char *sector, unsigned short size,
+void boot_calc_checksum(unsigned char *sector, unsigned int size,
 		bool is_boot_sec, __le32 *checksum);
 void init_user_input(struct exfat_user_input *ui);
 int exfat_get_blk_dev_info(struct exfat_user_input *ui,
@@ -197,6 +455,30 @@ int read_boot_sect(struct exfat_blk_dev *bdev, struct pbr **bs);
 int exfat_parse_ulong(const char *s, unsigned long *out);
 int exfat_check_name(__le16 *utf16_name, int len);
 
+static inline int exfat_bad_name_char(unsigned short w)
+{
+	return (w < 0x0020) || (w == '*') || (w == '?') || (w == '<') ||
+		(w == '>') || (w == '|') || (w == '"') || (w == ':') ||
+		(w == '/') || (w == '\\');
+}
+
+/*
+ * one byte of the rotate-and-add sums of the boot region and upcase
+ * table (32-bit), and of dentry sets and name hashes (16-bit). the carry
+ * of each add is rotated into the next one, so bytes can only be summed
+ * one after another.
+ */
+static inline uint32_t exfat_sum32_add(uint32_t sum, uint8_t b)
+{
+	return ((sum << 31) | (sum >> 1)) + b;
+}
+
+static inline uint16_t exfat_sum16_add(uint16_t sum, uint8_t b)
+{
+	/* the shift of the promoted value stays below INT_MAX */
+	return (uint16_t)(((sum << 15) | (sum >> 1)) + b);
+}
+
 /*
  * Exfat Print
  */
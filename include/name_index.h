@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef _NAME_INDEX_H
+#define _NAME_INDEX_H
+
+#include "exfat_ondisk.h"
+#include "libexfat.h"
+
+#define NAME_REC_NONE		UINT32_MAX
+#define NAME_INDEX_MIN_SIZE	32
+
+/* a file of the directory being read, found by its name hash */
+struct name_rec {
+	off64_t		dev_offset;	/* of the file dentry */
+	__u32		next;		/* in the same bucket */
+	__u16		hash;
+	__u8		name_len;
+	__u8		fingerprint;
+};
+
+/*
+ * the names of the directory being read, so that a duplicated name hash
+ * is told apart from a duplicated name without reading the directory
+ * again. records are chained in @heads by the low bits of their hash.
+ */
+struct name_index {
+	struct name_rec	*recs;
+	unsigned int	count;
+	unsigned int	alloc;
+	__u32		*heads;		/* alloc / 2 buckets */
+	size_t		budget;		/* bytes, 0 for no limit */
+	bool		failed;		/* out of memory, not every name is in */
+};
+
+void name_index_init(struct name_index *ni, size_t budget);
+size_t name_index_heap_size(unsigned int alloc);
+int name_index_add(struct name_index *ni, __u16 hash, __le16 *name,
+		   int name_len, off64_t dev_offset);
+struct name_rec *name_index_find(struct name_index *ni, struct name_rec *rec,
+				 __u16 hash, __le16 *name, int name_len);
+void name_index_reset(struct name_index *ni);
+void name_index_free(struct name_index *ni);
+
+#endif
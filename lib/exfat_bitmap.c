@@ -0,0 +1,888 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Cluster bitmaps, kept either as one flat array, as chunks where
+ *   the chunks with all bits equal take no memory, or as pages of which
+ *   only a few are in memory and the others in a scratch area.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "exfat_ondisk.h"
+#include "libexfat.h"
+#include "exfat_fs.h"
+#include "mem_wrapper.h"
+
+#define CHUNK_WORDS	EXFAT_BITMAP_CHUNK_WORDS
+#define CHUNK_BYTES	(CHUNK_WORDS * sizeof(bitmap_t))
+
+/* chunks read at once by exfat_bitmap_read() */
+#define READ_CHUNKS	16
+
+/* words of the @k-th chunk which hold bits of @bm */
+static unsigned int chunk_words(struct exfat_bitmap *bm, unsigned int k)
+{
+	return MIN(CHUNK_WORDS, bm->word_count - k * CHUNK_WORDS);
+}
+
+static bitmap_t chunk_fill(struct exfat_bitmap *bm, unsigned int k)
+{
+	return BITMAP_GET(bm->ones, k) ? (bitmap_t)~0 : 0;
+}
+
+static size_t page_bytes(struct exfat_bitmap *bm)
+{
+	return bm->page_words * sizeof(bitmap_t);
+}
+
+static int pages_alloc(struct exfat_bitmap *bm, unsigned int page_size,
+		       unsigned int resident)
+{
+	unsigned int i;
+
+	if (page_size < sizeof(bitmap_t))
+		return -EINVAL;
+
+	bm->page_words = page_size / sizeof(bitmap_t);
+	bm->page_count = MAX(DIV_ROUND_UP(bm->word_count, bm->page_words), 1);
+	bm->resident = MIN(resident ? resident : EXFAT_BITMAP_RESIDENT_PAGES,
+			   bm->page_count);
+
+	bm->pages = w_calloc(bm->resident, sizeof(*bm->pages));
+	if (!bm->pages)
+		return -ENOMEM;
+
+	for (i = 0; i < bm->resident; i++) {
+		bm->pages[i].index = UINT_MAX;
+		bm->pages[i].buf = w_malloc(page_bytes(bm));
+		if (!bm->pages[i].buf)
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+static int paged_init(struct exfat_bitmap *bm,
+		      const struct exfat_bitmap_opts *opts)
+{
+	int ret;
+
+	if (!opts->scratch)
+		return -EINVAL;
+
+	ret = pages_alloc(bm, opts->page_size ? opts->page_size :
+			  EXFAT_BITMAP_PAGE_SIZE, opts->resident_pages);
+	if (ret)
+		return ret;
+
+	bm->scratch = opts->scratch;
+	if (exfat_scratch_reserve(bm->scratch,
+				  (size_t)bm->page_count * page_bytes(bm),
+				  &bm->scratch_off))
+		return -ENOSPC;
+
+	bm->written = w_calloc(1, EXFAT_BITMAP_SIZE(bm->page_count));
+	if (!bm->written)
+		return -ENOMEM;
+	return 0;
+}
+
+struct exfat_bitmap *exfat_bitmap_alloc(const struct exfat_bitmap_opts *opts,
+					clus_t clus_count)
+{
+	enum exfat_bitmap_type type = opts ? opts->type : EXFAT_BITMAP_FLAT;
+	struct exfat_bitmap *bm;
+
+	bm = w_calloc(1, sizeof(*bm));
+	if (!bm)
+		return NULL;
+
+	bm->type = type;
+	bm->clus_count = clus_count;
+	bm->word_count = DIV_ROUND_UP(clus_count, BITS_PER);
+
+	if (type == EXFAT_BITMAP_FLAT) {
+		bm->words = w_calloc(1, EXFAT_BITMAP_SIZE(clus_count));
+		if (!bm->words)
+			goto err;
+		return bm;
+	}
+
+	if (type == EXFAT_BITMAP_PAGED) {
+		if (paged_init(bm, opts))
+			goto err;
+		return bm;
+	}
+
+	bm->chunk_count = DIV_ROUND_UP(bm->word_count, CHUNK_WORDS);
+	bm->chunks = w_calloc(bm->chunk_count, sizeof(*bm->chunks));
+	bm->ones = w_calloc(1, EXFAT_BITMAP_SIZE(bm->chunk_count));
+	bm->weight = w_calloc(bm->chunk_count, sizeof(*bm->weight));
+	if (!bm->chunks || !bm->ones || !bm->weight)
+		goto err;
+	return bm;
+err:
+	exfat_bitmap_free(bm);
+	return NULL;
+}
+
+/*
+ * a read-only paged bitmap over the @size bytes at @offset of @fd, e.g.
+ * an on-disk allocation bitmap. @resident pages of @page_size bytes are
+ * kept in memory and the pages are read again when they are needed.
+ */
+struct exfat_bitmap *exfat_bitmap_map(int fd, off64_t offset, size_t size,
+				      clus_t clus_count, unsigned int page_size,
+				      unsigned int resident)
+{
+	struct exfat_bitmap *bm;
+
+	bm = w_calloc(1, sizeof(*bm));
+	if (!bm)
+		return NULL;
+
+	bm->type = EXFAT_BITMAP_PAGED;
+	bm->clus_count = clus_count;
+	bm->word_count = DIV_ROUND_UP(clus_count, BITS_PER);
+	bm->mapped = true;
+	bm->source.fd = fd;
+	bm->source.offset = offset;
+	bm->source.size = size;
+	bm->scratch = &bm->source;
+	bm->scratch_off = offset;
+
+	if (pages_alloc(bm, page_size, resident)) {
+		exfat_bitmap_free(bm);
+		return NULL;
+	}
+	return bm;
+}
+
+void exfat_bitmap_free(struct exfat_bitmap *bm)
+{
+	unsigned int k;
+
+	if (!bm)
+		return;
+
+	if (bm->words)
+		w_free(bm->words);
+	if (bm->chunks) {
+		for (k = 0; k < bm->chunk_count; k++) {
+			if (bm->chunks[k])
+				w_free(bm->chunks[k]);
+		}
+		w_free(bm->chunks);
+	}
+	if (bm->ones)
+		w_free(bm->ones);
+	if (bm->weight)
+		w_free(bm->weight);
+	if (bm->pages) {
+		for (k = 0; k < bm->resident; k++) {
+			if (bm->pages[k].buf)
+				w_free(bm->pages[k].buf);
+		}
+		w_free(bm->pages);
+	}
+	if (bm->written)
+		w_free(bm->written);
+	w_free(bm);
+}
+
+/* heap bytes held by @bm */
+size_t exfat_bitmap_mem_size(struct exfat_bitmap *bm)
+{
+	if (!bm)
+		return 0;
+	if (bm->words)
+		return EXFAT_BITMAP_SIZE(bm->clus_count);
+	if (bm->pages)
+		return bm->resident * (sizeof(*bm->pages) + page_bytes(bm)) +
+			(bm->written ? EXFAT_BITMAP_SIZE(bm->page_count) : 0);
+
+	return bm->chunk_count * (sizeof(*bm->chunks) + sizeof(*bm->weight)) +
+		EXFAT_BITMAP_SIZE(bm->chunk_count) +
+		(size_t)bm->stored * CHUNK_BYTES;
+}
+
+/* heap which pages_alloc() takes for @clus_count clusters */
+static size_t pages_heap_size(clus_t clus_count, unsigned int page_size,
+			      unsigned int resident)
+{
+	unsigned int words = DIV_ROUND_UP(clus_count, BITS_PER);
+	unsigned int page_count;
+
+	page_size = round_down(page_size, sizeof(bitmap_t));
+	page_count = MAX(DIV_ROUND_UP(words, page_size / sizeof(bitmap_t)), 1);
+	resident = MIN(resident ? resident : EXFAT_BITMAP_RESIDENT_PAGES,
+		       page_count);
+	return W_MEM_SIZE(resident * sizeof(struct exfat_bitmap_page)) +
+		resident * W_MEM_SIZE(page_size);
+}
+
+/*
+ * the most heap a bitmap of @clus_count clusters allocated with @opts
+ * takes, with every chunk of a compressed one holding mixed bits.
+ */
+size_t exfat_bitmap_heap_size(const struct exfat_bitmap_opts *opts,
+			      clus_t clus_count)
+{
+	unsigned int words = DIV_ROUND_UP(clus_count, BITS_PER);
+	unsigned int page_size, page_count, chunk_count;
+	size_t size = W_MEM_SIZE(sizeof(struct exfat_bitmap));
+
+	if (!opts || opts->type == EXFAT_BITMAP_FLAT)
+		return size + W_MEM_SIZE(EXFAT_BITMAP_SIZE(clus_count));
+
+	if (opts->type == EXFAT_BITMAP_PAGED) {
+		page_size = opts->page_size ? opts->page_size :
+			EXFAT_BITMAP_PAGE_SIZE;
+		page_count = MAX(DIV_ROUND_UP(words,
+					      page_size / sizeof(bitmap_t)), 1);
+		return size + pages_heap_size(clus_count, page_size,
+					      opts->resident_pages) +
+			W_MEM_SIZE(EXFAT_BITMAP_SIZE(page_count));
+	}
+
+	chunk_count = DIV_ROUND_UP(words, CHUNK_WORDS);
+	return size + W_MEM_SIZE(chunk_count * sizeof(bitmap_t *)) +
+		W_MEM_SIZE(EXFAT_BITMAP_SIZE(chunk_count)) +
+		W_MEM_SIZE(chunk_count * sizeof(__u16)) +
+		chunk_count * W_MEM_SIZE(CHUNK_BYTES);
+}
+
+/* heap which exfat_bitmap_map() takes */
+size_t exfat_bitmap_map_heap_size(clus_t clus_count, unsigned int page_size,
+				  unsigned int resident)
+{
+	return W_MEM_SIZE(sizeof(struct exfat_bitmap)) +
+		pages_heap_size(clus_count, page_size, resident);
+}
+
+/* drop the stored @k-th chunk if all of its bits became equal */
+static void chunk_try_collapse(struct exfat_bitmap *bm, unsigned int k)
+{
+	unsigned int bits = chunk_words(bm, k) * BITS_PER;
+
+	if (bm->weight[k] != 0 && bm->weight[k] != bits)
+		return;
+
+	if (bm->weight[k])
+		BITMAP_SET(bm->ones, k);
+	else
+		BITMAP_CLEAR(bm->ones, k);
+	w_free(bm->chunks[k]);
+	bm->chunks[k] = NULL;
+	bm->stored--;
+}
+
+static bitmap_t *chunk_expand(struct exfat_bitmap *bm, unsigned int k)
+{
+	bitmap_t *chunk, fill;
+	unsigned int i;
+
+	chunk = w_malloc(CHUNK_BYTES);
+	if (!chunk) {
+		bm->err = -ENOMEM;
+		return NULL;
+	}
+
+	fill = chunk_fill(bm, k);
+	for (i = 0; i < CHUNK_WORDS; i++)
+		chunk[i] = fill;
+	bm->chunks[k] = chunk;
+	bm->weight[k] = fill ? chunk_words(bm, k) * BITS_PER : 0;
+	bm->stored++;
+	return chunk;
+}
+
+/* make the @k-th chunk of a compressed bitmap all ones or all zeroes */
+static void chunk_set_uniform(struct exfat_bitmap *bm, unsigned int k,
+			      bool set)
+{
+	if (bm->chunks[k]) {
+		w_free(bm->chunks[k]);
+		bm->chunks[k] = NULL;
+		bm->stored--;
+	}
+	if (set)
+		BITMAP_SET(bm->ones, k);
+	else
+		BITMAP_CLEAR(bm->ones, k);
+}
+
+static int page_writeback(struct exfat_bitmap *bm, struct exfat_bitmap_page *p)
+{
+	if (exfat_write(bm->scratch->fd, p->buf, page_bytes(bm),
+			bm->scratch_off + (off64_t)p->index * page_bytes(bm)) !=
+	    (ssize64_t)page_bytes(bm))
+		return -EIO;
+
+	BITMAP_SET(bm->written, p->index);
+	p->dirty = false;
+	bm->writebacks++;
+	return 0;
+}
+
+/*
+ * read page @index into @buf. a mapped bitmap may end inside its last
+ * page, the rest of it reads as zeroes like a page never written out.
+ */
+static int page_read(struct exfat_bitmap *bm, bitmap_t *buf,
+		     unsigned int index)
+{
+	off64_t off = (off64_t)index * page_bytes(bm);
+	size_t len = 0;
+
+	if (bm->mapped)
+		len = MIN((off64_t)page_bytes(bm), bm->source.size - off);
+	else if (BITMAP_GET(bm->written, index))
+		len = page_bytes(bm);
+
+	if (len && exfat_read(bm->scratch->fd, buf, len,
+			      bm->scratch_off + off) != (ssize64_t)len)
+		return -EIO;
+	memset((char *)buf + len, 0, page_bytes(bm) - len);
+	return 0;
+}
+
+/*
+ * return the resident page @index of a paged bitmap. on a miss the
+ * least recently used page is written back if dirty and replaced.
+ * an I/O error is kept in @bm->err and NULL is returned.
+ */
+static struct exfat_bitmap_page *page_get(struct exfat_bitmap *bm,
+					  unsigned int index)
+{
+	struct exfat_bitmap_page *p, *victim;
+	unsigned int i;
+
+	p = &bm->pages[bm->last_page];
+	if (p->index == index)
+		goto found;
+
+	/* free slots have lru 0 and are taken first */
+	victim = &bm->pages[0];
+	for (i = 0; i < bm->resident; i++) {
+		p = &bm->pages[i];
+		if (p->index == index)
+			goto found;
+		if (p->lru < victim->lru)
+			victim = p;
+	}
+
+	bm->faults++;
+	p = victim;
+	if (p->dirty && page_writeback(bm, p))
+		goto err;
+
+	p->index = UINT_MAX;
+	p->lru = 0;
+	if (page_read(bm, p->buf, index))
+		goto err;
+	p->index = index;
+found:
+	p->lru = ++bm->lru_clock;
+	bm->last_page = p - bm->pages;
+	return p;
+err:
+	bm->err = -EIO;
+	return NULL;
+}
+
+bitmap_t exfat_bitmap_paged_word(struct exfat_bitmap *bm, unsigned int w)
+{
+	struct exfat_bitmap_page *p;
+
+	p = page_get(bm, w / bm->page_words);
+	return p ? p->buf[w % bm->page_words] : 0;
+}
+
+/* copy @count words between @buf and a paged bitmap a page at a time */
+static int paged_copy(struct exfat_bitmap *bm, unsigned int w, bitmap_t *buf,
+		      unsigned int count, bool load)
+{
+	struct exfat_bitmap_page *p;
+	unsigned int i, n;
+
+	if (load && bm->mapped) {
+		bm->err = -EROFS;
+		return bm->err;
+	}
+
+	while (count) {
+		p = page_get(bm, w / bm->page_words);
+		if (!p)
+			return bm->err;
+
+		i = w % bm->page_words;
+		n = MIN(count, bm->page_words - i);
+		if (load) {
+			memcpy(p->buf + i, buf, n * sizeof(bitmap_t));
+			p->dirty = true;
+		} else {
+			memcpy(buf, p->buf + i, n * sizeof(bitmap_t));
+		}
+		w += n;
+		buf += n;
+		count -= n;
+	}
+	return 0;
+}
+
+/*
+ * store @word as the @w-th word. on a compressed bitmap this may need
+ * memory and on a paged one I/O, a failure is kept in @bm->err and the
+ * word is left unchanged.
+ */
+void exfat_bitmap_put_word(struct exfat_bitmap *bm, unsigned int w,
+			   bitmap_t word)
+{
+	unsigned int k = w / CHUNK_WORDS;
+	bitmap_t *chunk;
+
+	if (bm->words) {
+		bm->words[w] = word;
+		return;
+	}
+
+	if (bm->mapped) {
+		bm->err = -EROFS;
+		return;
+	}
+
+	if (bm->pages) {
+		struct exfat_bitmap_page *p;
+
+		p = page_get(bm, w / bm->page_words);
+		if (p && p->buf[w % bm->page_words] != word) {
+			p->buf[w % bm->page_words] = word;
+			p->dirty = true;
+		}
+		return;
+	}
+
+	chunk = bm->chunks[k];
+	if (!chunk) {
+		if (word == chunk_fill(bm, k))
+			return;
+		chunk = chunk_expand(bm, k);
+		if (!chunk)
+			return;
+	}
+
+	bm->weight[k] += __builtin_popcount(word) -
+		__builtin_popcount(chunk[w % CHUNK_WORDS]);
+	chunk[w % CHUNK_WORDS] = word;
+	chunk_try_collapse(bm, k);
+}
+
+/* copy @count words from @src to @bm, starting at the @first_word-th */
+int exfat_bitmap_load(struct exfat_bitmap *bm, unsigned int first_word,
+		      const bitmap_t *src, unsigned int count)
+{
+	unsigned int w = first_word, end = first_word + count;
+	unsigned int k, n, i;
+	bitmap_t *chunk;
+	int weight;
+
+	if (bm->words) {
+		memcpy(bm->words + first_word, src, count * sizeof(bitmap_t));
+		return 0;
+	}
+	if (bm->pages)
+		return paged_copy(bm, first_word, (bitmap_t *)src, count, true);
+
+	while (w < end) {
+		k = w / CHUNK_WORDS;
+		n = chunk_words(bm, k);
+		if (w % CHUNK_WORDS || end - w < n) {
+			exfat_bitmap_put_word(bm, w, *src);
+			w++;
+			src++;
+			continue;
+		}
+
+		/* a whole chunk, keep it only if it is not uniform */
+		for (i = 0, weight = 0; i < n; i++)
+			weight += __builtin_popcount(src[i]);
+		if (weight == 0 || weight == (int)(n * BITS_PER)) {
+			chunk_set_uniform(bm, k, weight != 0);
+		} else {
+			chunk = bm->chunks[k];
+			if (!chunk) {
+				chunk = chunk_expand(bm, k);
+				if (!chunk)
+					return -ENOMEM;
+			}
+			memcpy(chunk, src, n * sizeof(bitmap_t));
+			bm->weight[k] = weight;
+		}
+		w += n;
+		src += n;
+	}
+	return bm->err;
+}
+
+/* copy @count words of @bm, starting at the @first_word-th, to @dst */
+void exfat_bitmap_store(struct exfat_bitmap *bm, unsigned int first_word,
+			bitmap_t *dst, unsigned int count)
+{
+	unsigned int i;
+
+	if (bm->words) {
+		memcpy(dst, bm->words + first_word, count * sizeof(bitmap_t));
+		return;
+	}
+	if (bm->pages) {
+		paged_copy(bm, first_word, dst, count, false);
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+		dst[i] = exfat_bitmap_word(bm, first_word + i);
+}
+
+/* read @size bytes of an on-disk bitmap at @offset of @fd into @bm */
+int exfat_bitmap_read(struct exfat_bitmap *bm, int fd, off64_t offset,
+		      size_t size)
+{
+	bitmap_t *buf;
+	size_t len, done;
+	int ret = 0;
+
+	if (bm->words) {
+		if (exfat_read(fd, bm->words, size, offset) != (ssize64_t)size)
+			return -EIO;
+		return 0;
+	}
+
+	buf = w_malloc(READ_CHUNKS * CHUNK_BYTES);
+	if (!buf)
+		return -ENOMEM;
+
+	for (done = 0; done < size; done += len) {
+		len = MIN(size - done, READ_CHUNKS * CHUNK_BYTES);
+		memset(buf, 0, READ_CHUNKS * CHUNK_BYTES);
+		if (exfat_read(fd, buf, len, offset + done) != (ssize64_t)len) {
+			ret = -EIO;
+			break;
+		}
+
+		ret = exfat_bitmap_load(bm, done / sizeof(bitmap_t), buf,
+					DIV_ROUND_UP(len, sizeof(bitmap_t)));
+		if (ret)
+			break;
+	}
+
+	w_free(buf);
+	return ret;
+}
+
+/* set or clear bits [@b, @end) of @bm a word or a chunk at a time */
+static void exfat_bitmap_fill(struct exfat_bitmap *bm, clus_t b, clus_t end,
+			      bool set)
+{
+	unsigned int w, k;
+	bitmap_t mask, word;
+	clus_t n, off;
+
+	while (b < end) {
+		w = BIT_ENTRY(b);
+		k = w / CHUNK_WORDS;
+		if (bm->chunks && b % EXFAT_BITMAP_CHUNK_BITS == 0 &&
+		    end - b >= chunk_words(bm, k) * BITS_PER) {
+			chunk_set_uniform(bm, k, set);
+			b += chunk_words(bm, k) * BITS_PER;
+			continue;
+		}
+
+		off = b % BITS_PER;
+		n = MIN(end - b, BITS_PER - off);
+		mask = (bitmap_t)((bitmap_t)~0 >> (BITS_PER - n) << off);
+		word = exfat_bitmap_word(bm, w);
+		exfat_bitmap_put_word(bm, w, set ? word | mask : word & ~mask);
+		b += n;
+	}
+}
+
+void exfat_bitmap_set_range(struct exfat *exfat, struct exfat_bitmap *bm,
+			    clus_t start_clus, clus_t count)
+{
+	if (!exfat_heap_clus(exfat, start_clus) ||
+	    !exfat_heap_clus(exfat, start_clus + count - 1))
+		return;
+
+	exfat_bitmap_fill(bm, start_clus - EXFAT_FIRST_CLUSTER,
+			  start_clus - EXFAT_FIRST_CLUSTER + count, true);
+}
+
+void exfat_bitmap_clear_range(struct exfat *exfat, struct exfat_bitmap *bm,
+			      clus_t start_clus, clus_t count)
+{
+	if (!exfat_heap_clus(exfat, start_clus) ||
+	    !exfat_heap_clus(exfat, start_clus + count - 1))
+		return;
+
+	exfat_bitmap_fill(bm, start_clus - EXFAT_FIRST_CLUSTER,
+			  start_clus - EXFAT_FIRST_CLUSTER + count, false);
+}
+
+/*
+ * return the first bit index in [@b, @end) of the array @map whose
+ * value is @bit, or @end if there is none. words without a match are
+ * skipped whole.
+ */
+clus_t exfat_bits_scan(bitmap_t *map, clus_t b, clus_t end, int bit)
+{
+	bitmap_t flip = bit ? 0 : (bitmap_t)~0;
+	bitmap_t word;
+	clus_t i;
+
+	if (b >= end)
+		return end;
+
+	i = BIT_ENTRY(b);
+	word = (bitmap_t)((map[i] ^ flip) & ((bitmap_t)~0 << (b % BITS_PER)));
+	while (!word) {
+		if (++i > BIT_ENTRY(end - 1))
+			return end;
+		word = map[i] ^ flip;
+	}
+
+	b = i * BITS_PER + __builtin_ctz(word);
+	return MIN(b, end);
+}
+
+/* exfat_bits_scan() for a compressed bitmap, uniform chunks are skipped */
+static clus_t exfat_chunks_scan(struct exfat_bitmap *bm, clus_t b, clus_t end,
+				int bit)
+{
+	bitmap_t flip = bit ? 0 : (bitmap_t)~0;
+	bitmap_t word;
+	clus_t i, k;
+
+	if (b >= end)
+		return end;
+
+	i = BIT_ENTRY(b);
+	word = (bitmap_t)((exfat_bitmap_word(bm, i) ^ flip) &
+			  ((bitmap_t)~0 << (b % BITS_PER)));
+	while (!word) {
+		if (++i > BIT_ENTRY(end - 1))
+			return end;
+
+		k = i / CHUNK_WORDS;
+		if (!bm->chunks[k] && !!BITMAP_GET(bm->ones, k) != bit) {
+			i = (k + 1) * CHUNK_WORDS - 1;
+			continue;
+		}
+		word = exfat_bitmap_word(bm, i) ^ flip;
+	}
+
+	b = i * BITS_PER + __builtin_ctz(word);
+	return MIN(b, end);
+}
+
+/* exfat_bits_scan() for a paged bitmap, run on one resident page at a time */
+static clus_t exfat_pages_scan(struct exfat_bitmap *bm, clus_t b, clus_t end,
+			       int bit)
+{
+	struct exfat_bitmap_page *p;
+	clus_t page_bits = bm->page_words * BITS_PER;
+	clus_t base, e, found;
+
+	while (b < end) {
+		p = page_get(bm, b / page_bits);
+		if (!p)
+			return end;
+
+		base = b / page_bits * page_bits;
+		e = MIN(end, base + page_bits);
+		found = exfat_bits_scan(p->buf, b - base, e - base, bit) + base;
+		if (found < e)
+			return found;
+		b = e;
+	}
+	return end;
+}
+
+/*
+ * return the first cluster in [@start_clu, @end_clu) whose bit is @bit,
+ * or @end_clu if there is none.
+ */
+clus_t exfat_bitmap_scan(struct exfat_bitmap *bm, clus_t start_clu,
+			 clus_t end_clu, int bit)
+{
+	clus_t b, end;
+
+	if (start_clu < EXFAT_FIRST_CLUSTER)
+		start_clu = EXFAT_FIRST_CLUSTER;
+	if (start_clu >= end_clu)
+		return end_clu;
+
+	b = start_clu - EXFAT_FIRST_CLUSTER;
+	end = MIN(end_clu - EXFAT_FIRST_CLUSTER, bm->clus_count);
+	if (bm->words)
+		b = exfat_bits_scan(bm->words, b, end, bit);
+	else if (bm->pages)
+		b = exfat_pages_scan(bm, b, end, bit);
+	else
+		b = exfat_chunks_scan(bm, b, end, bit);
+	return b < end ? b + EXFAT_FIRST_CLUSTER : end_clu;
+}
+
+static int exfat_bitmap_find_bit(struct exfat *exfat, struct exfat_bitmap *bm,
+				 clus_t start_clu, clus_t *next,
+				 int bit)
+{
+	clus_t last_clu;
+
+	last_clu = le32_to_cpu(exfat->bs->bsx.clu_count) +
+		EXFAT_FIRST_CLUSTER;
+	start_clu = exfat_bitmap_scan(bm, start_clu, last_clu, bit);
+	if (start_clu >= last_clu)
+		return 1;
+	*next = start_clu;
+	return 0;
+}
+
+int exfat_bitmap_find_zero(struct exfat *exfat, struct exfat_bitmap *bm,
+			   clus_t start_clu, clus_t *next)
+{
+	return exfat_bitmap_find_bit(exfat, bm,
+				     start_clu, next, 0);
+}
+
+int exfat_bitmap_find_one(struct exfat *exfat, struct exfat_bitmap *bm,
+			  clus_t start_clu, clus_t *next)
+{
+	return exfat_bitmap_find_bit(exfat, bm,
+				     start_clu, next, 1);
+}
+
+void exfat_bitmap_iter_init(struct exfat *exfat, struct exfat_bitmap_iter *iter,
+			    struct exfat_bitmap *bm, clus_t start_clu)
+{
+	iter->bmap = bm;
+	iter->next = start_clu;
+	iter->end = le32_to_cpu(exfat->bs->bsx.clu_count) +
+		EXFAT_FIRST_CLUSTER;
+}
+
+/*
+ * find the next run of clusters whose bits are @bit. return false
+ * if there are no more runs.
+ */
+bool exfat_bitmap_iter_next(struct exfat_bitmap_iter *iter, int bit,
+			    clus_t *start_clu, clus_t *count)
+{
+	clus_t s, e;
+
+	s = exfat_bitmap_scan(iter->bmap, iter->next, iter->end, bit);
+	if (s >= iter->end) {
+		iter->next = iter->end;
+		return false;
+	}
+
+	e = exfat_bitmap_scan(iter->bmap, s + 1, iter->end, !bit);
+	iter->next = e;
+	*start_clu = s;
+	*count = e - s;
+	return true;
+}
+
+/* index of the first run of @list which ends after @clus */
+static unsigned int clus_list_search(struct exfat_clus_list *list, clus_t clus)
+{
+	unsigned int lo = 0, hi = list->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (list->runs[mid].start + list->runs[mid].count <= clus)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * add clusters [@start, @start + @count) to @list. runs which overlap
+ * or touch them are merged, so the runs stay sorted and disjoint.
+ */
+int exfat_clus_list_add(struct exfat_clus_list *list, clus_t start,
+			clus_t count)
+{
+	struct exfat_clus_run *runs;
+	clus_t end = start + count;
+	unsigned int i, j, alloc;
+
+	i = clus_list_search(list, start);
+	if (i > 0 && list->runs[i - 1].start + list->runs[i - 1].count == start)
+		i--;
+	for (j = i; j < list->count && list->runs[j].start <= end; j++)
+		;
+
+	if (j > i) {
+		start = MIN(start, list->runs[i].start);
+		end = MAX(end, list->runs[j - 1].start + list->runs[j - 1].count);
+		list->runs[i].start = start;
+		list->runs[i].count = end - start;
+		memmove(&list->runs[i + 1], &list->runs[j],
+			(list->count - j) * sizeof(*list->runs));
+		list->count -= j - i - 1;
+		return 0;
+	}
+
+	if (list->count == list->alloc) {
+		alloc = list->alloc ? list->alloc * 2 : 16;
+		runs = list->max && alloc > list->max ? NULL :
+			w_malloc(alloc * sizeof(*runs));
+		if (!runs) {
+			list->err = -ENOMEM;
+			return list->err;
+		}
+		if (list->runs) {
+			memcpy(runs, list->runs, list->count * sizeof(*runs));
+			w_free(list->runs);
+		}
+		list->runs = runs;
+		list->alloc = alloc;
+	}
+
+	memmove(&list->runs[i + 1], &list->runs[i],
+		(list->count - i) * sizeof(*list->runs));
+	list->runs[i].start = start;
+	list->runs[i].count = count;
+	list->count++;
+	return 0;
+}
+
+/* find the first cluster of @list which is not below @clus */
+bool exfat_clus_list_next(struct exfat_clus_list *list, clus_t clus,
+			  clus_t *next)
+{
+	unsigned int i = clus_list_search(list, clus);
+
+	if (i == list->count)
+		return false;
+	*next = MAX(list->runs[i].start, clus);
+	return true;
+}
+
+void exfat_clus_list_free(struct exfat_clus_list *list)
+{
+	if (list->runs)
+		w_free(list->runs);
+	memset(list, 0, sizeof(*list));
+}
+
+/* the most heap a list of at most @max runs takes while it grows */
+size_t exfat_clus_list_heap_size(unsigned int max)
+{
+	return W_MEM_SIZE(max * sizeof(struct exfat_clus_run)) +
+		W_MEM_SIZE(max / 2 * sizeof(struct exfat_clus_run));
+}
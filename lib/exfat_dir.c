@@ -17,8 +17,6 @@
 #include "exfat_dir.h"
 #include "mem_wrapper.h"
 
-static struct path_resolve_ctx path_resolve_ctx;
-
 #define fsck_err(parent, inode, fmt, ...)		\
 ({							\
 		exfat_resolve_path_parent(&path_resolve_ctx,	\
@@ -26,147 +24,307 @@ static struct path_resolve_ctx path_resolve_ctx;
 		exfat_err("ERROR: %s: " fmt,		\
 			path_resolve_ctx.local_path,	\
 			##__VA_ARGS__);			\
+		exfat_release_path(&path_resolve_ctx);	\
 })
 
 static inline struct buffer_desc *exfat_de_iter_get_buffer(
 		struct exfat_de_iter *iter, unsigned int block)
 {
-	return &iter->buffer_desc[block % iter->exfat->buffer_count];
+	return &iter->buffer_desc[block % iter->buffer_count];
 }
 
-static ssize_t write_block(struct exfat_de_iter *iter, unsigned int block)
+/* write back the dirty sectors of @desc, adjacent ones at once */
+static int write_block(struct exfat *exfat, struct buffer_desc *desc)
 {
+	unsigned int sect_size = exfat->sect_size;
+	unsigned int sects = exfat->read_size / sect_size;
+	unsigned int i, end;
 	off64_t device_offset;
-	struct exfat *exfat = iter->exfat;
-	struct buffer_desc *desc;
+	size_t len;
+
+	for (i = 0; i < sects; i = end) {
+		end = i + 1;
+		if (!BITMAP_GET(desc->dirty, i))
+			continue;
+
+		while (end < sects && BITMAP_GET(desc->dirty, end))
+			end++;
+		device_offset = exfat_c2o(exfat, desc->p_clus) + desc->offset +
+			(off64_t)i * sect_size;
+		len = (size_t)(end - i) * sect_size;
+		if (exfat_write(exfat->blk_dev->dev_fd,
+				desc->buffer + i * sect_size, len,
+				device_offset) != (ssize_t)len)
+			return -EIO;
+		for (; i < end; i++)
+			BITMAP_CLEAR(desc->dirty, i);
+	}
+	return 0;
+}
+
+/* the prefetch of the open device, for exfat_prefetch_invalidate() */
+static struct exfat_prefetch *dev_prefetch;
+
+/* heap which exfat_prefetch_init() takes for slots of @slot_size */
+size_t exfat_prefetch_heap_size(unsigned int slot_count,
+				unsigned int slot_size)
+{
+	if (!slot_count)
+		return 0;
+	return W_MEM_SIZE(sizeof(struct exfat_prefetch)) +
+		W_MEM_SIZE(slot_count * sizeof(struct exfat_ra_slot)) +
+		W_MEM_SIZE((size_t)slot_count * slot_size);
+}
+
+int exfat_prefetch_init(struct exfat *exfat, unsigned int slot_count)
+{
+	struct exfat_prefetch *pf;
 	unsigned int i;
 
-	desc = exfat_de_iter_get_buffer(iter, block);
+	exfat_prefetch_free(exfat);
+	if (!slot_count)
+		return 0;
 
-	for (i = 0; i < iter->read_size / iter->write_size; i++) {
-		if (BITMAP_GET(desc->dirty, i)) {
-			device_offset = exfat_c2o(exfat, desc->p_clus) +
-				desc->offset;
-			if (exfat_write(exfat->blk_dev->dev_fd,
-					desc->buffer + i * iter->write_size,
-					iter->write_size,
-					device_offset + i * iter->write_size)
-					!= (ssize_t)iter->write_size)
-				return -EIO;
-			BITMAP_CLEAR(desc->dirty, i);
-		}
+	pf = w_calloc(1, sizeof(*pf));
+	if (!pf)
+		return -ENOMEM;
+
+	pf->slot_size = exfat_get_read_size(exfat);
+	pf->slots = w_calloc(slot_count, sizeof(*pf->slots));
+	pf->data = w_malloc((size_t)slot_count * pf->slot_size);
+	if (!pf->slots || !pf->data) {
+		if (pf->slots)
+			w_free(pf->slots);
+		if (pf->data)
+			w_free(pf->data);
+		w_free(pf);
+		return -ENOMEM;
 	}
+
+	pf->fd = exfat->blk_dev->dev_fd;
+	pf->slot_count = slot_count;
+	for (i = 0; i < slot_count; i++)
+		pf->slots[i].offset = -1;
+	exfat->prefetch = pf;
+	dev_prefetch = pf;
 	return 0;
 }
 
-static int read_ahead_first_blocks(struct exfat_de_iter *iter)
+/* no buffer_desc may still borrow a slot */
+void exfat_prefetch_free(struct exfat *exfat)
 {
-#ifdef POSIX_FADV_WILLNEED
-	struct exfat *exfat = iter->exfat;
-	clus_t clus_count;
-	unsigned int size;
+	struct exfat_prefetch *pf = exfat->prefetch;
 
-	clus_count = iter->parent->size / exfat->clus_size;
+	if (!pf)
+		return;
 
-	if (clus_count > 1) {
-		iter->ra_begin_offset = 0;
-		iter->ra_next_clus = 1;
-		size = exfat->clus_size;
-	} else {
-		iter->ra_begin_offset = 0;
-		iter->ra_next_clus = 0;
-		size = iter->ra_partial_size;
+	if (dev_prefetch == pf)
+		dev_prefetch = NULL;
+	w_free(pf->data);
+	w_free(pf->slots);
+	w_free(pf);
+	exfat->prefetch = NULL;
+}
+
+/* the directory which is likely read after the current one */
+void exfat_prefetch_hint(struct exfat *exfat, clus_t first_clus, uint64_t size)
+{
+	if (!exfat->prefetch)
+		return;
+
+	exfat->prefetch->next_dir_clus = size ? first_clus : 0;
+	exfat->prefetch->next_dir_size = size;
+}
+
+/* drop the slots which are not borrowed and overlap a write */
+void exfat_prefetch_invalidate(int fd, off64_t offset, size64_t size)
+{
+	struct exfat_prefetch *pf = dev_prefetch;
+	struct exfat_ra_slot *slot;
+	unsigned int i;
+
+	if (!pf || pf->fd != fd)
+		return;
+
+	for (i = 0; i < pf->slot_count; i++) {
+		slot = &pf->slots[i];
+		if (slot->offset < 0 || slot->borrowed ||
+		    slot->offset + pf->slot_size <= offset ||
+		    slot->offset >= offset + (off64_t)size)
+			continue;
+		slot->offset = -1;
+		pf->wasted++;
 	}
-	return posix_fadvise(exfat->blk_dev->dev_fd,
-			exfat_c2o(exfat, iter->parent->first_clus), size,
-			POSIX_FADV_WILLNEED);
-#else
-	return -ENOTSUP;
-#endif
 }
 
-/**
- * read the next fragment in advance, and assume the fragment
- * which covers @clus is already read.
+/* give back the slot borrowed by @desc, if any */
+void exfat_prefetch_put(struct exfat_prefetch *pf, struct buffer_desc *desc)
+{
+	struct exfat_ra_slot *slot;
+
+	if (desc->buffer == desc->own_buffer)
+		return;
+
+	slot = &pf->slots[(desc->buffer - pf->data) / pf->slot_size];
+	slot->borrowed = false;
+	slot->offset = -1;
+	desc->buffer = desc->own_buffer;
+}
+
+static struct exfat_ra_slot *prefetch_lookup(struct exfat_prefetch *pf,
+					     off64_t offset)
+{
+	unsigned int i;
+
+	for (i = 0; i < pf->slot_count; i++) {
+		if (pf->slots[i].offset == offset && !pf->slots[i].borrowed)
+			return &pf->slots[i];
+	}
+	return NULL;
+}
+
+/*
+ * count the blocks which follow block @block of the directory, at
+ * @offset in cluster @p_clus, and lie right after it on the device, up
+ * to @max.
  */
-static int read_ahead_next_blocks(struct exfat_de_iter *iter,
-		clus_t clus, unsigned int offset, clus_t p_clus)
+static unsigned int prefetch_predict(struct exfat_de_iter *iter,
+				     unsigned int block, clus_t p_clus,
+				     unsigned int offset, unsigned int max)
 {
-#ifdef POSIX_FADV_WILLNEED
 	struct exfat *exfat = iter->exfat;
-	off64_t device_offset;
-	clus_t clus_count, ra_clus, ra_p_clus;
-	unsigned int size;
-	int ret = 0;
-
-	clus_count = iter->parent->size / exfat->clus_size;
-	if (clus + 1 < clus_count) {
-		ra_clus = clus + 1;
-		if (ra_clus == iter->ra_next_clus &&
-				offset >= iter->ra_begin_offset) {
-			ret = exfat_get_inode_next_clus(exfat, iter->parent,
-							p_clus, &ra_p_clus);
-			if (ret)
-				return ret;
+	struct exfat_prefetch *pf = exfat->prefetch;
+	unsigned int blocks_per_clus = exfat->clus_size / iter->read_size;
+	unsigned int dir_blocks = iter->parent->size / iter->read_size;
+	unsigned int count = 0, next_blocks;
+	clus_t next_clus;
+
+	while (count < max && block + 1 < dir_blocks) {
+		offset += iter->read_size;
+		if (offset == exfat->clus_size) {
+			if (exfat_get_inode_next_clus(exfat, iter->parent,
+						      p_clus, &next_clus) ||
+			    next_clus != p_clus + 1)
+				return count;
+			p_clus = next_clus;
+			offset = 0;
+		}
+		block++;
+		count++;
+	}
+	if (count == max)
+		return count;
+
+	/*
+	 * the directory ends here, go on with the next one if it follows,
+	 * unless it may be read in blocks larger than a slot
+	 */
+	if (exfat->read_size > pf->slot_size ||
+	    !pf->next_dir_clus || pf->next_dir_clus != p_clus + 1 ||
+	    offset + iter->read_size != exfat->clus_size)
+		return count;
+
+	next_blocks = MIN(pf->next_dir_size / iter->read_size,
+			  blocks_per_clus);
+	return MIN(count + next_blocks, max);
+}
 
-			if (ra_p_clus == EXFAT_EOF_CLUSTER)
-				return -EIO;
-
-			device_offset = exfat_c2o(exfat, ra_p_clus);
-			size = ra_clus + 1 < clus_count ?
-				exfat->clus_size : iter->ra_partial_size;
-			ret = posix_fadvise(exfat->blk_dev->dev_fd,
-					device_offset, size,
-					POSIX_FADV_WILLNEED);
-			iter->ra_next_clus = ra_clus + 1;
-			iter->ra_begin_offset = 0;
+/*
+ * read @count blocks from @device_offset into adjacent slots which are
+ * not borrowed, fewer if there are not so many, and return the slot of
+ * the first one.
+ */
+static struct exfat_ra_slot *prefetch_read(struct exfat_prefetch *pf,
+					   off64_t device_offset,
+					   unsigned int count)
+{
+	unsigned int i, n, start, best = 0, best_len = 0;
+	size_t size;
+
+	for (i = 0; i < pf->slot_count && best_len < count; i++) {
+		start = (pf->next + i) % pf->slot_count;
+		for (n = 0; n < count && start + n < pf->slot_count &&
+		     !pf->slots[start + n].borrowed; n++)
+			;
+		if (n > best_len) {
+			best = start;
+			best_len = n;
 		}
+	}
+	if (!best_len)
+		return NULL;
+
+	size = (size_t)best_len * pf->slot_size;
+	if (exfat_read(pf->fd, pf->data + (size_t)best * pf->slot_size,
+		       size, device_offset) != (ssize64_t)size)
+		return NULL;
+
+	for (i = best; i < best + best_len; i++) {
+		if (pf->slots[i].offset >= 0)
+			pf->wasted++;
+		pf->slots[i].offset = device_offset +
+			(off64_t)(i - best) * pf->slot_size;
+	}
+	pf->next = (best + best_len) % pf->slot_count;
+	pf->reads++;
+	pf->blocks += best_len;
+	return &pf->slots[best];
+}
+
+/*
+ * fill @desc with the block at @device_offset from the read-ahead slots,
+ * reading it with the blocks predicted to follow it if it is not there.
+ * return false to read it into the buffer of @desc instead.
+ */
+static bool prefetch_get(struct exfat_de_iter *iter, struct buffer_desc *desc,
+			 unsigned int block, off64_t device_offset)
+{
+	struct exfat_prefetch *pf = iter->exfat->prefetch;
+	struct exfat_ra_slot *slot;
+	unsigned int ahead;
+
+	slot = prefetch_lookup(pf, device_offset);
+	if (slot) {
+		/* the block was predicted, so it is not counted as wasted */
+		pf->hits++;
 	} else {
-		if (offset >= iter->ra_begin_offset &&
-				offset + iter->ra_partial_size <=
-				exfat->clus_size) {
-			device_offset = exfat_c2o(exfat, p_clus) +
-				offset + iter->ra_partial_size;
-			ret = posix_fadvise(exfat->blk_dev->dev_fd,
-					device_offset, iter->ra_partial_size,
-					POSIX_FADV_WILLNEED);
-			iter->ra_begin_offset =
-				offset + iter->ra_partial_size;
-		}
+		ahead = prefetch_predict(iter, block, desc->p_clus,
+					 desc->offset, pf->slot_count - 1);
+		if (!ahead)
+			return false;
+
+		slot = prefetch_read(pf, device_offset, ahead + 1);
+		if (!slot)
+			return false;
 	}
 
-	return ret;
-#else
-	return -ENOTSUP;
-#endif
+	slot->borrowed = true;
+	desc->buffer = pf->data + (slot - pf->slots) * pf->slot_size;
+	return true;
 }
 
-static int read_ahead_next_dir_blocks(struct exfat_de_iter *iter)
+/*
+ * place block @block of a contiguous directory which is read in blocks
+ * of several clusters, and return the bytes of it within the directory
+ */
+static ssize_t locate_block(struct exfat_de_iter *iter,
+			    struct buffer_desc *desc, unsigned int block)
 {
-#ifdef POSIX_FADV_WILLNEED
 	struct exfat *exfat = iter->exfat;
-	struct list_head *current;
-	struct exfat_inode *next_inode;
-	off64_t offset;
+	uint64_t offset = (uint64_t)block * iter->read_size;
+	size_t len;
 
-	if (list_empty(&exfat->dir_list))
-		return -EINVAL;
-
-	current = exfat->dir_list.next;
-	if (iter->parent == list_entry(current, struct exfat_inode, list) &&
-			current->next != &exfat->dir_list) {
-		next_inode = list_entry(current->next, struct exfat_inode,
-				list);
-		offset = exfat_c2o(exfat, next_inode->first_clus);
-		return posix_fadvise(exfat->blk_dev->dev_fd, offset,
-				iter->ra_partial_size,
-				POSIX_FADV_WILLNEED);
-	}
+	if (offset >= iter->parent->size)
+		return EOF;
 
-	return 0;
-#else
-	return -ENOTSUP;
-#endif
+	len = round_up(MIN(iter->read_size, iter->parent->size - offset),
+		       exfat->sect_size);
+	desc->p_clus = iter->parent->first_clus + offset / exfat->clus_size;
+	desc->offset = 0;
+	if (!exfat_heap_clus(exfat, desc->p_clus +
+			     (len - 1) / exfat->clus_size))
+		return -EINVAL;
+	return len;
 }
 
 static ssize_t read_block(struct exfat_de_iter *iter, unsigned int block)
@@ -174,19 +332,30 @@ static ssize_t read_block(struct exfat_de_iter *iter, unsigned int block)
 	struct exfat *exfat = iter->exfat;
 	struct buffer_desc *desc, *prev_desc;
 	off64_t device_offset;
+	size_t len = iter->read_size;
 	ssize_t ret;
 
 	desc = exfat_de_iter_get_buffer(iter, block);
-	if (block == 0) {
-		desc->p_clus = iter->parent->first_clus;
-		desc->offset = 0;
-	}
+
+	/* a copied dentry set may come from the block which is replaced */
+	if (iter->pin_stitched && exfat_de_iter_unpin(iter))
+		return -EIO;
 
 	/* if the buffer already contains dirty dentries, write it */
-	if (write_block(iter, block))
+	if (write_block(exfat, desc))
 		return -EIO;
+	if (exfat->prefetch)
+		exfat_prefetch_put(exfat->prefetch, desc);
 
-	if (block > 0) {
+	if (iter->read_size > exfat->clus_size) {
+		ret = locate_block(iter, desc, block);
+		if (ret < 0)
+			return ret;
+		len = ret;
+	} else if (block == 0) {
+		desc->p_clus = iter->parent->first_clus;
+		desc->offset = 0;
+	} else {
 		if (block > iter->parent->size / iter->read_size)
 			return EOF;
 
@@ -207,37 +376,29 @@ static ssize_t read_block(struct exfat_de_iter *iter, unsigned int block)
 	}
 
 	device_offset = exfat_c2o(exfat, desc->p_clus) + desc->offset;
-	ret = exfat_read(exfat->blk_dev->dev_fd, desc->buffer,
-			iter->read_size, device_offset);
-	if (ret <= 0)
-		return ret;
+	if (exfat->prefetch && iter->read_size == exfat->prefetch->slot_size &&
+	    prefetch_get(iter, desc, block, device_offset))
+		return iter->read_size;
 
-	/*
-	 * if a buffer is filled with dentries, read blocks ahead of time,
-	 * otherwise read blocks of the next directory in advance.
-	 */
-	if (desc->buffer[iter->read_size - 32] != EXFAT_LAST)
-		read_ahead_next_blocks(iter,
-				(block * iter->read_size) / exfat->clus_size,
-				(block * iter->read_size) % exfat->clus_size,
-				desc->p_clus);
-	else
-		read_ahead_next_dir_blocks(iter);
-	return ret;
+	ret = exfat_read(exfat->blk_dev->dev_fd, desc->buffer, len,
+			 device_offset);
+	if (ret != (ssize_t)len)
+		return ret;
+	return iter->read_size;
 }
 
 int exfat_de_iter_init(struct exfat_de_iter *iter, struct exfat *exfat,
 		       struct exfat_inode *dir, struct buffer_desc *bd)
 {
+	unsigned int i;
+
 	iter->exfat = exfat;
 	iter->parent = dir;
 	iter->write_size = exfat->sect_size;
-	iter->read_size = exfat_get_read_size(exfat);
-	if (exfat->clus_size <= 32 * KB)
-		iter->ra_partial_size = MAX(4 * KB, exfat->clus_size / 2);
-	else
-		iter->ra_partial_size = exfat->clus_size / 4;
-	iter->ra_partial_size = MIN(iter->ra_partial_size, 8 * KB);
+	/* the blocks of a contiguous directory may span clusters */
+	iter->read_size = dir->is_contiguous ? exfat->read_size :
+		exfat_get_read_size(exfat);
+	iter->buffer_count = exfat_buffer_count(iter->read_size);
 
 	iter->buffer_desc = bd;
 
@@ -245,11 +406,25 @@ int exfat_de_iter_init(struct exfat_de_iter *iter, struct exfat *exfat,
 	iter->next_read_offset = iter->read_size;
 	iter->max_skip_dentries = 0;
 	iter->invalid_name_num = 0;
+	iter->pin_count = 0;
+	iter->pin_stitched = false;
+	iter->pin_changed = false;
+
+	/*
+	 * write what is left of the last directory and give back its
+	 * read-ahead slots, then carve the blocks for this one
+	 */
+	for (i = 0; i < exfat->buffer_count; i++) {
+		if (write_block(exfat, &bd[i]))
+			return -EIO;
+		if (exfat->prefetch)
+			exfat_prefetch_put(exfat->prefetch, &bd[i]);
+	}
+	exfat_buffer_set_block(exfat, bd, iter->read_size);
 
 	if (iter->parent->size == 0)
 		return EOF;
 
-	read_ahead_first_blocks(iter);
 	if (read_block(iter, 0) != (ssize_t)iter->read_size) {
 		exfat_err("failed to read directory entries.\n");
 		return -EIO;
@@ -266,6 +441,13 @@ int exfat_de_iter_get(struct exfat_de_iter *iter,
 	unsigned int block;
 	struct buffer_desc *bd;
 
+	if (ith < iter->pin_count) {
+		if (ith + 1 > iter->max_skip_dentries)
+			iter->max_skip_dentries = ith + 1;
+		*dentry = &iter->pin_de[ith];
+		return 0;
+	}
+
 	next_de_file_offset = iter->de_file_offset +
 			ith * sizeof(struct exfat_dentry);
 	block = (unsigned int)(next_de_file_offset / iter->read_size);
@@ -291,34 +473,144 @@ int exfat_de_iter_get(struct exfat_de_iter *iter,
 	return 0;
 }
 
-int exfat_de_iter_get_dirty(struct exfat_de_iter *iter,
-			int ith, struct exfat_dentry **dentry)
+/* mark the @ith dentry, which has been got, to be written back */
+void exfat_de_iter_set_dirty(struct exfat_de_iter *iter, int ith)
 {
 	off64_t next_file_offset;
 	unsigned int block;
-	int ret, sect_idx;
+	int sect_idx;
 	struct buffer_desc *bd;
 
-	ret = exfat_de_iter_get(iter, ith, dentry);
-	if (!ret) {
-		next_file_offset = iter->de_file_offset +
-				ith * sizeof(struct exfat_dentry);
-		block = (unsigned int)(next_file_offset / iter->read_size);
-		sect_idx = (int)((next_file_offset % iter->read_size) /
-				iter->write_size);
-		bd = exfat_de_iter_get_buffer(iter, block);
-		BITMAP_SET(bd->dirty, sect_idx);
+	if (ith < iter->pin_count)
+		iter->pin_changed = true;
+
+	/* a copy is written to the blocks when it is unpinned */
+	if (ith < iter->pin_count && iter->pin_stitched) {
+		BITMAP_SET(iter->pin_dirty, ith);
+		return;
 	}
 
+	next_file_offset = iter->de_file_offset +
+			ith * sizeof(struct exfat_dentry);
+	block = (unsigned int)(next_file_offset / iter->read_size);
+	sect_idx = (int)((next_file_offset % iter->read_size) /
+			iter->write_size);
+	bd = exfat_de_iter_get_buffer(iter, block);
+	BITMAP_SET(bd->dirty, sect_idx);
+}
+
+int exfat_de_iter_get_dirty(struct exfat_de_iter *iter,
+			int ith, struct exfat_dentry **dentry)
+{
+	int ret;
+
+	ret = exfat_de_iter_get(iter, ith, dentry);
+	if (!ret)
+		exfat_de_iter_set_dirty(iter, ith);
+
 	return ret;
 }
 
+/*
+ * pin up to @count dentries from the current one, fewer if the directory
+ * ends, and return how many in one array at @dset, or EOF or an error.
+ * the array points into the block which holds them, or is a copy if they
+ * straddle blocks. exfat_de_iter_get() returns pinned dentries from it,
+ * and dentries changed through it are marked with exfat_de_iter_set_dirty().
+ * it is valid until the iterator advances or reads another block.
+ */
+int exfat_de_iter_pin(struct exfat_de_iter *iter, int count,
+		      struct exfat_dentry **dset)
+{
+	struct exfat_dentry *dentry, *stitch;
+	off64_t offset = iter->de_file_offset;
+	uint64_t avail;
+	int i, n, ret;
+
+	if (offset >= (off64_t)iter->parent->size)
+		return EOF;
+	avail = (iter->parent->size - offset) / sizeof(struct exfat_dentry);
+	count = (int)MIN((uint64_t)count, avail);
+	if (count <= 0)
+		return EOF;
+
+	if (count <= iter->pin_count) {
+		*dset = iter->pin_de;
+		return count;
+	}
+	ret = exfat_de_iter_unpin(iter);
+	if (ret)
+		return ret;
+
+	ret = exfat_de_iter_get(iter, 0, &dentry);
+	if (ret)
+		return ret;
+
+	if (offset / iter->read_size ==
+	    (offset + count * (off64_t)sizeof(struct exfat_dentry) - 1) /
+	    iter->read_size) {
+		iter->pin_de = dentry;
+	} else {
+		stitch = exfat_buffer_stitch(iter->buffer_desc, count);
+		if (!stitch)
+			return -ENOMEM;
+
+		/* copy the part in each block, reading them in order */
+		for (i = 0; i < count; i += n) {
+			ret = exfat_de_iter_get(iter, i, &dentry);
+			if (ret)
+				return ret;
+			n = (iter->read_size - (offset + i *
+				sizeof(struct exfat_dentry)) % iter->read_size) /
+				sizeof(struct exfat_dentry);
+			n = MIN(n, count - i);
+			memcpy(&stitch[i], dentry,
+			       n * sizeof(struct exfat_dentry));
+		}
+		memset(iter->pin_dirty, 0, sizeof(iter->pin_dirty));
+		iter->pin_de = stitch;
+		iter->pin_stitched = true;
+	}
+
+	if (count > iter->max_skip_dentries)
+		iter->max_skip_dentries = count;
+	iter->pin_count = count;
+	iter->pin_changed = false;
+	*dset = iter->pin_de;
+	return count;
+}
+
+/* drop the pinned dentries, writing the changed ones of a copy back */
+int exfat_de_iter_unpin(struct exfat_de_iter *iter)
+{
+	struct exfat_dentry *dentry;
+	int i, count = iter->pin_count;
+	bool stitched = iter->pin_stitched;
+
+	iter->pin_count = 0;
+	iter->pin_stitched = false;
+	if (!stitched)
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		if (!BITMAP_GET(iter->pin_dirty, i))
+			continue;
+		if (exfat_de_iter_get_dirty(iter, i, &dentry))
+			return -EIO;
+		memcpy(dentry, &iter->pin_de[i], sizeof(*dentry));
+	}
+	return 0;
+}
+
 int exfat_de_iter_flush(struct exfat_de_iter *iter)
 {
 	unsigned int i;
 
+	if (exfat_de_iter_unpin(iter))
+		return -EIO;
+
 	for (i = 0; i < iter->exfat->buffer_count; i++)
-		if (write_block(iter, i))
+		if (write_block(iter->exfat, &iter->buffer_desc[i]))
 			return -EIO;
 	return 0;
 }
@@ -328,6 +620,9 @@ int exfat_de_iter_advance(struct exfat_de_iter *iter, int skip_dentries)
 	if (skip_dentries > iter->max_skip_dentries)
 		return -EINVAL;
 
+	if (exfat_de_iter_unpin(iter))
+		return -EIO;
+
 	iter->max_skip_dentries = 0;
 	iter->de_file_offset = iter->de_file_offset +
 				skip_dentries * sizeof(struct exfat_dentry);
@@ -367,6 +662,7 @@ int exfat_lookup_dentry_set(struct exfat *exfat, struct exfat_inode *parent,
 	off64_t free_file_offset = 0, free_dev_offset = 0;
 	struct exfat_de_iter de_iter;
 	int dentry_count, empty_dentry_count = 0;
+	unsigned int i;
 	int retval;
 
 	if (!exfat->lookup_buffer) {
@@ -407,17 +703,17 @@ int exfat_lookup_dentry_set(struct exfat *exfat, struct exfat_inode *parent,
 
 			if (retval == 0) {
 				struct exfat_dentry *d;
-				int i;
+				int k;
 
-				filter->out.dentry_set = w_calloc(dentry_count,
-								sizeof(struct exfat_dentry));
+				filter->out.dentry_set =
+					exfat_alloc_dentry_set(dentry_count);
 				if (!filter->out.dentry_set) {
 					retval = -ENOMEM;
 					goto out;
 				}
-				for (i = 0; i < dentry_count; i++) {
-					exfat_de_iter_get(&de_iter, i, &d);
-					memcpy(filter->out.dentry_set + i, d,
+				for (k = 0; k < dentry_count; k++) {
+					exfat_de_iter_get(&de_iter, k, &d);
+					memcpy(filter->out.dentry_set + k, d,
 					       sizeof(struct exfat_dentry));
 				}
 				filter->out.dentry_count = dentry_count;
@@ -454,6 +750,12 @@ out:
 		filter->out.file_offset = exfat_de_iter_file_offset(&de_iter);
 		filter->out.dev_offset = EOF;
 	}
+
+	/* the dentry set is a copy, so the read-ahead slots can go back */
+	if (exfat->prefetch) {
+		for (i = 0; i < exfat->buffer_count; i++)
+			exfat_prefetch_put(exfat->prefetch, &bd[i]);
+	}
 	return retval;
 }
 
@@ -536,22 +838,18 @@ int exfat_lookup_file(struct exfat *exfat, struct exfat_inode *parent,
 void exfat_calc_dentry_checksum(struct exfat_dentry *dentry,
 				uint16_t *checksum, bool primary)
 {
+	const uint8_t *bytes = (const uint8_t *)dentry;
+	uint16_t sum = *checksum;
 	unsigned int i;
-	uint8_t *bytes;
-
-	bytes = (uint8_t *)dentry;
 
-	/* use += to avoid promotion to int; UBSan complaints about signed overflow */
-	*checksum = (*checksum << 15) | (*checksum >> 1);
-	*checksum += bytes[0];
-	*checksum = (*checksum << 15) | (*checksum >> 1);
-	*checksum += bytes[1];
-
-	i = primary ? 4 : 2;
-	for (; i < sizeof(*dentry); i++) {
-		*checksum = (*checksum << 15) | (*checksum >> 1);
-		*checksum += bytes[i];
+	/* the set checksum in bytes 2 and 3 of the primary dentry is skipped */
+	sum = exfat_sum16_add(sum, bytes[0]);
+	sum = exfat_sum16_add(sum, bytes[1]);
+	for (i = primary ? 4 : 2; i < sizeof(*dentry); i += 2) {
+		sum = exfat_sum16_add(sum, bytes[i]);
+		sum = exfat_sum16_add(sum, bytes[i + 1]);
 	}
+	*checksum = sum;
 }
 
 static uint16_t calc_dentry_set_checksum(struct exfat_dentry *dset, int dcount)
@@ -569,22 +867,73 @@ static uint16_t calc_dentry_set_checksum(struct exfat_dentry *dset, int dcount)
 	return checksum;
 }
 
+/*
+ * check the @count dentries of a file dentry set in one pass: sum all of
+ * them, and copy the name in up to @name_dentries name dentries after
+ * the stream dentry to @name while its length, characters, hash and
+ * leading dots are found.
+ */
+void exfat_check_dentry_set(struct exfat *exfat, struct exfat_dentry *dset,
+			    int count, int name_dentries, __le16 *name,
+			    struct exfat_dset_check *chk)
+{
+	uint16_t checksum = 0, hash = 0;
+	bool name_end = false, name_nul = false;
+	int i, k, len = 0, bad_char = -1, dots = 0;
+	__u16 c;
+	__le16 ch;
+
+	chk->name_dentries = 0;
+	for (i = 0; i < count; i++) {
+		exfat_calc_dentry_checksum(&dset[i], &checksum, i == 0);
+		if (i < 2 || name_end)
+			continue;
+		if (i - 2 >= name_dentries || dset[i].type != EXFAT_NAME) {
+			name_end = true;
+			continue;
+		}
+
+		memcpy(name + (i - 2) * ENTRY_NAME_MAX,
+		       dset[i].name_unicode,
+		       sizeof(dset[i].name_unicode));
+		chk->name_dentries++;
+
+		for (k = 0; k < ENTRY_NAME_MAX && !name_nul; k++) {
+			c = le16_to_cpu(dset[i].name_unicode[k]);
+			if (!c) {
+				name_nul = true;
+				break;
+			}
+			if (bad_char < 0 && exfat_bad_name_char(c))
+				bad_char = len;
+			if (dots == len && c == '.')
+				dots++;
+
+			ch = cpu_to_le16(exfat_upcase(exfat, c));
+			hash = exfat_sum16_add(hash, ch & 0xFF);
+			hash = exfat_sum16_add(hash, ch >> 8);
+			len++;
+		}
+	}
+
+	chk->checksum = checksum;
+	chk->name_hash = hash;
+	chk->name_len = len;
+	chk->bad_char = bad_char < 0 ? len : bad_char;
+	chk->dots = dots;
+}
+
 uint16_t exfat_calc_name_hash(struct exfat *exfat,
 			      __le16 *name, int len)
 {
-	int i;
-	__le16 ch;
 	uint16_t chksum = 0;
+	__le16 ch;
+	int i;
 
 	for (i = 0; i < len; i++) {
-		ch = exfat->upcase_table[le16_to_cpu(name[i])];
-		ch = cpu_to_le16(ch);
-
-		/* use += to avoid promotion to int; UBSan complaints about signed overflow */
-		chksum = (chksum << 15) | (chksum >> 1);
-		chksum += ch & 0xFF;
-		chksum = (chksum << 15) | (chksum >> 1);
-		chksum += ch >> 8;
+		ch = cpu_to_le16(exfat_upcase(exfat, le16_to_cpu(name[i])));
+		chksum = exfat_sum16_add(chksum, ch & 0xFF);
+		chksum = exfat_sum16_add(chksum, ch >> 8);
 	}
 	return chksum;
 }
@@ -624,7 +973,7 @@ int exfat_build_file_dentry_set(struct exfat *exfat, const char *name,
 
 	name_len = retval / 2;
 	dcount = 2 + DIV_ROUND_UP(name_len, ENTRY_NAME_MAX);
-	dset = w_calloc(dcount, DENTRY_SIZE);
+	dset = exfat_alloc_dentry_set(dcount);
 	if (!dset)
 		return -ENOMEM;
 
@@ -657,7 +1006,7 @@ int exfat_build_file_dentry_set(struct exfat *exfat, const char *name,
 
 	for (i = 2; i < dcount; i++) {
 		dset[i].type = EXFAT_NAME;
-		memcpy(dset[i].dentry.name.unicode_0_14,
+		memcpy(dset[i].name_unicode,
 		       utf16_name + (i - 2) * ENTRY_NAME_MAX,
 		       ENTRY_NAME_MAX * 2);
 	}
@@ -697,7 +1046,7 @@ int exfat_update_file_dentry_set(struct exfat *exfat,
 
 		for (i = 2; i < dcount; i++) {
 			dset[i].type = EXFAT_NAME;
-			memcpy(dset[i].dentry.name.unicode_0_14,
+			memcpy(dset[i].name_unicode,
 			       utf16_name + (i - 2) * ENTRY_NAME_MAX,
 			       ENTRY_NAME_MAX * 2);
 		}
@@ -716,30 +1065,35 @@ int exfat_update_file_dentry_set(struct exfat *exfat,
 static int find_free_cluster(struct exfat *exfat,
 			     clus_t start, clus_t *new_clu)
 {
-	clus_t end = le32_to_cpu(exfat->bs->bsx.clu_count) +
-		EXFAT_FIRST_CLUSTER;
+	struct exfat_bitmap_iter iter;
+	clus_t s_clu, count;
+	int pass;
 
 	if (!exfat_heap_clus(exfat, start))
 		return -EINVAL;
 
-	while (start < end) {
-		if (exfat_bitmap_find_zero(exfat, exfat->alloc_bitmap,
-					   start, new_clu))
-			break;
-		if (!exfat_bitmap_get(exfat->disk_bitmap, *new_clu))
+	if (exfat->free_summary) {
+		if (!exfat_free_summary_find(exfat, start,
+					     exfat->clus_count + EXFAT_FIRST_CLUSTER,
+					     new_clu) ||
+		    !exfat_free_summary_find(exfat, EXFAT_FIRST_CLUSTER, start,
+					     new_clu))
 			return 0;
-		start = *new_clu + 1;
+		goto out_nospc;
 	}
 
-	end = start;
-	start = EXFAT_FIRST_CLUSTER;
-	while (start < end) {
-		if (exfat_bitmap_find_zero(exfat, exfat->alloc_bitmap,
-					   start, new_clu))
-			goto out_nospc;
-		if (!exfat_bitmap_get(exfat->disk_bitmap, *new_clu))
-			return 0;
-		start = *new_clu + 1;
+	/* search from @start to the end, and then wrap around */
+	exfat_bitmap_iter_init(exfat, &iter, exfat->alloc_bitmap, start);
+	for (pass = 0; pass < 2; pass++) {
+		while (exfat_bitmap_iter_next(&iter, 0, &s_clu, &count)) {
+			*new_clu = exfat_bitmap_scan(exfat->disk_bitmap, s_clu,
+						     s_clu + count, 0);
+			if (*new_clu < s_clu + count)
+				return 0;
+		}
+
+		iter.next = EXFAT_FIRST_CLUSTER;
+		iter.end = start;
 	}
 
 out_nospc:
@@ -747,41 +1101,150 @@ out_nospc:
 	return -ENOSPC;
 }
 
+/*
+ * append cluster @clus as the file cluster @fclus to the extents of
+ * @inode. past exfat->bitmap_opts.max_extents the chain is walked instead.
+ */
+static int exfat_extent_append(struct exfat *exfat, struct exfat_inode *inode,
+			       clus_t fclus, clus_t clus)
+{
+	struct exfat_extent *ext;
+	unsigned int alloc;
+
+	if (inode->extent_count) {
+		ext = &inode->extents[inode->extent_count - 1];
+		if (ext->fclus + ext->len == fclus &&
+		    ext->clus + ext->len == clus) {
+			ext->len++;
+			return 0;
+		}
+	}
+
+	if (inode->extent_count == inode->extent_alloc) {
+		alloc = inode->extent_alloc ? inode->extent_alloc * 2 : 4;
+		if (exfat->bitmap_opts.max_extents &&
+		    alloc > exfat->bitmap_opts.max_extents)
+			return -ENOMEM;
+		ext = w_malloc(sizeof(*ext) * alloc);
+		if (!ext)
+			return -ENOMEM;
+		if (inode->extents) {
+			memcpy(ext, inode->extents,
+			       sizeof(*ext) * inode->extent_count);
+			w_free(inode->extents);
+		}
+		inode->extents = ext;
+		inode->extent_alloc = alloc;
+	}
+
+	ext = &inode->extents[inode->extent_count++];
+	ext->fclus = fclus;
+	ext->clus = clus;
+	ext->len = 1;
+	return 0;
+}
+
+static clus_t exfat_extent_end(struct exfat_inode *inode)
+{
+	struct exfat_extent *ext;
+
+	if (!inode->extent_count)
+		return 0;
+	ext = &inode->extents[inode->extent_count - 1];
+	return ext->fclus + ext->len;
+}
+
+/*
+ * walk the cluster chain of @inode once and record it as extents.
+ * the walk stops at the first broken link, so the extents may cover
+ * only the head of the chain.
+ */
+static int exfat_build_extents(struct exfat *exfat, struct exfat_inode *inode)
+{
+	clus_t clu, next, fclus, last_count;
+	int err;
+
+	last_count = DIV_ROUND_UP(inode->size, exfat->clus_size);
+	clu = inode->first_clus;
+	for (fclus = 0; fclus < last_count; fclus++) {
+		if (!exfat_heap_clus(exfat, clu))
+			break;
+
+		err = exfat_extent_append(exfat, inode, fclus, clu);
+		if (err) {
+			exfat_inode_drop_extents(inode);
+			return err;
+		}
+
+		if (exfat_get_inode_next_clus(exfat, inode, clu, &next))
+			break;
+		clu = next;
+	}
+	return 0;
+}
+
+/* fallback for when there is no memory for the extents */
+static int exfat_walk_cluster(struct exfat *exfat, struct exfat_inode *inode,
+			      clus_t fclus, clus_t *mapped_clu)
+{
+	clus_t clu = inode->first_clus, next;
+
+	while (fclus--) {
+		if (exfat_get_inode_next_clus(exfat, inode, clu, &next))
+			return -EINVAL;
+		clu = next;
+		if (!exfat_heap_clus(exfat, clu))
+			return -EINVAL;
+	}
+	*mapped_clu = clu;
+	return 0;
+}
+
 static int exfat_map_cluster(struct exfat *exfat, struct exfat_inode *inode,
 			     off64_t file_off, clus_t *mapped_clu)
 {
-	clus_t clu, next, count, last_count;
+	struct exfat_extent *ext;
+	clus_t fclus, count;
+	unsigned int lo, hi, mid;
 
 	if (!exfat_heap_clus(exfat, inode->first_clus))
 		return -EINVAL;
 
-	clu = inode->first_clus;
-	next = EXFAT_EOF_CLUSTER;
-	count = 1;
 	if (file_off == EOF)
-		last_count = DIV_ROUND_UP(inode->size, exfat->clus_size);
+		count = DIV_ROUND_UP(inode->size, exfat->clus_size);
 	else
-		last_count = file_off / exfat->clus_size + 1;
-
-	while (true) {
-		if (count * exfat->clus_size > inode->size)
-			return -EINVAL;
+		count = file_off / exfat->clus_size + 1;
 
-		if (count == last_count) {
-			*mapped_clu = clu;
-			return 0;
-		}
+	if (count == 0 || (uint64_t)count * exfat->clus_size > inode->size)
+		return -EINVAL;
+	fclus = count - 1;
 
-		if (exfat_get_inode_next_clus(exfat, inode, clu, &next))
+	if (inode->is_contiguous) {
+		if (!exfat_heap_clus(exfat, inode->first_clus + fclus))
 			return -EINVAL;
+		*mapped_clu = inode->first_clus + fclus;
+		return 0;
+	}
 
-		if (!exfat_heap_clus(exfat, clu))
-			return -EINVAL;
+	if (!inode->extents && exfat_build_extents(exfat, inode))
+		return exfat_walk_cluster(exfat, inode, fclus, mapped_clu);
 
-		clu = next;
-		count++;
+	if (fclus >= exfat_extent_end(inode))
+		return -EINVAL;
+
+	lo = 0;
+	hi = inode->extent_count;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (inode->extents[mid].fclus <= fclus)
+			lo = mid;
+		else
+			hi = mid;
 	}
-	return -EINVAL;
+
+	ext = &inode->extents[lo];
+	*mapped_clu = ext->clus + (fclus - ext->fclus);
+	return 0;
 }
 
 static int exfat_write_dentry_set(struct exfat *exfat,
@@ -830,6 +1293,39 @@ static int exfat_write_dentry_set(struct exfat *exfat,
 	return 0;
 }
 
+/*
+ * read @dcount dentries at @dev_off of the directory @dir, going on in
+ * the next clusters of @dir if the set crosses a cluster boundary.
+ */
+int exfat_read_dentry_set(struct exfat *exfat, struct exfat_inode *dir,
+			  struct exfat_dentry *dset, int dcount,
+			  off64_t dev_off)
+{
+	char *buf = (char *)dset;
+	unsigned int clus_off, len, left = dcount * DENTRY_SIZE;
+	clus_t clus;
+
+	if (exfat_o2c(exfat, dev_off, &clus, &clus_off))
+		return -ERANGE;
+
+	while (left) {
+		len = MIN(left, exfat->clus_size - clus_off);
+		if (exfat_read(exfat->blk_dev->dev_fd, buf, len,
+			       exfat_c2o(exfat, clus) + clus_off) !=
+		    (ssize_t)len)
+			return -EIO;
+		buf += len;
+		left -= len;
+		clus_off = 0;
+
+		if (left &&
+		    (exfat_get_inode_next_clus(exfat, dir, clus, &clus) ||
+		     !exfat_heap_clus(exfat, clus)))
+			return -EINVAL;
+	}
+	return 0;
+}
+
 static int exfat_alloc_cluster(struct exfat *exfat, struct exfat_inode *inode,
 			       clus_t *new_clu)
 {
@@ -894,9 +1390,18 @@ static int exfat_alloc_cluster(struct exfat *exfat, struct exfat_inode *inode,
 						inode->dev_offset, NULL))
 		return -EIO;
 
-	exfat_bitmap_set(exfat->alloc_bitmap, *new_clu);
+	exfat_alloc_bitmap_set(exfat, *new_clu);
 	if (inode->size == 0)
 		inode->first_clus = *new_clu;
+
+	/* extend the extents, or rebuild them on next lookup */
+	if (inode->extents) {
+		clus_t fclus = inode->size / exfat->clus_size;
+
+		if (exfat_extent_end(inode) != fclus ||
+		    exfat_extent_append(exfat, inode, fclus, *new_clu))
+			exfat_inode_drop_extents(inode);
+	}
 	inode->size += exfat->clus_size;
 	return 0;
 }
@@ -960,6 +1465,6 @@ int exfat_create_file(struct exfat *exfat, struct exfat_inode *parent,
 	loc.dev_offset = filter.out.dev_offset;
 	err = exfat_add_dentry_set(exfat, &loc, dset, dcount, false);
 out:
-	w_free(dset);
+	exfat_free_dentry_set(dset);
 	return err;
 }
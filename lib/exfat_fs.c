@@ -18,18 +18,73 @@
 #include "mem_wrapper.h"
 
 
-struct exfat_inode *exfat_alloc_inode(__u16 attr)
+/*
+ * inodes and dentry sets are allocated and freed for every directory
+ * entry, they are kept in object caches instead of going to the heap.
+ * inodes are cached by the number of name dentries their name takes.
+ */
+static struct exfat_slab inode_slabs[MAX_NAME_DENTRIES + 1];
+
+/* one cache per dentry count, up to a file with the longest name */
+#define DSET_SLAB_MAX	(2 + DIV_ROUND_UP(EXFAT_NAME_MAX, ENTRY_NAME_MAX))
+
+static struct exfat_slab dset_slabs[DSET_SLAB_MAX + 1];
+
+/* under a memory budget, freed objects go back to the heap at once */
+static bool caches_off;
+
+/* in front of a dentry set, keeps the dentries 8-byte aligned */
+union dset_head {
+	int	count;
+	uint64_t align;
+};
+
+/* bytes of an inode whose name has room for @slots name dentries */
+static size_t inode_size(unsigned int slots)
 {
-	struct exfat_inode *node;
-	int size;
+	return offsetof(struct exfat_inode, name) +
+		(slots * ENTRY_NAME_MAX + 1) * sizeof(__le16);
+}
+
+/*
+ * let inodes and dentry sets go straight to the heap and back, so that
+ * the ones freed take no memory. call it before any is allocated.
+ */
+void exfat_disable_caches(void)
+{
+	caches_off = true;
+}
+
+/* heap which an inode named @name_len characters takes without caches */
+size_t exfat_inode_heap_size(unsigned int name_len)
+{
+	return W_MEM_SIZE(inode_size(DIV_ROUND_UP(MIN(name_len, EXFAT_NAME_MAX),
+						  ENTRY_NAME_MAX)));
+}
 
-	size = offsetof(struct exfat_inode, name) + NAME_BUFFER_SIZE;
-	//size = sizeof(struct exfat_inode);
-	node = w_calloc(1, size);
+/*
+ * return an inode with room for a name of @name_len characters, rounded
+ * up to whole name dentries, and its null terminator.
+ */
+struct exfat_inode *exfat_alloc_inode_name(__u16 attr, unsigned int name_len)
+{
+	struct exfat_inode *node;
+	unsigned int slots;
+	size_t size;
+
+	slots = DIV_ROUND_UP(MIN(name_len, EXFAT_NAME_MAX), ENTRY_NAME_MAX);
+	size = inode_size(slots);
+	if (caches_off) {
+		node = w_malloc(size);
+	} else {
+		inode_slabs[slots].obj_size = size;
+		node = exfat_slab_alloc(&inode_slabs[slots]);
+	}
 	if (!node) {
 		exfat_err("failed to allocate exfat_node\n");
 		return NULL;
 	}
+	memset(node, 0, size);
 
 	node->parent = NULL;
 	INIT_LIST_HEAD(&node->children);
@@ -37,18 +92,111 @@ struct exfat_inode *exfat_alloc_inode(__u16 attr)
 	INIT_LIST_HEAD(&node->list);
 
 	node->attr = attr;
+	node->name_slots = slots;
+	return node;
+}
+
+/* return an inode with an empty name */
+struct exfat_inode *exfat_alloc_inode(__u16 attr)
+{
+	return exfat_alloc_inode_name(attr, 0);
+}
+
+size_t exfat_inode_mem_size(const struct exfat_inode *node)
+{
+	return inode_size(node->name_slots);
+}
+
+/* initialize an inode in @buf, it is not freed with exfat_free_inode() */
+struct exfat_inode *exfat_inode_init(union exfat_inode_buf *buf, __u16 attr)
+{
+	struct exfat_inode *node = &buf->inode;
+
+	memset(buf, 0, sizeof(*buf));
+	INIT_LIST_HEAD(&node->children);
+	INIT_LIST_HEAD(&node->sibling);
+	INIT_LIST_HEAD(&node->list);
+
+	node->attr = attr;
+	node->name_slots = MAX_NAME_DENTRIES;
 	return node;
 }
 
+/* forget the cluster map of @node, it is rebuilt from FAT on demand */
+void exfat_inode_drop_extents(struct exfat_inode *node)
+{
+	if (node->extents)
+		w_free(node->extents);
+	node->extents = NULL;
+	node->extent_count = 0;
+	node->extent_alloc = 0;
+}
+
 void exfat_free_inode(struct exfat_inode *node)
 {
 	if (node) {
-		if (node->dentry_set)
-			w_free(node->dentry_set);
-		w_free(node);
+		exfat_inode_drop_extents(node);
+		exfat_free_dentry_set(node->dentry_set);
+		if (caches_off)
+			w_free(node);
+		else
+			exfat_slab_free(&inode_slabs[node->name_slots], node);
 	}
 }
 
+/* return a zeroed dentry set of @count dentries */
+struct exfat_dentry *exfat_alloc_dentry_set(int count)
+{
+	union dset_head *head;
+	size_t size;
+
+	size = sizeof(*head) + count * sizeof(struct exfat_dentry);
+	if (count > 0 && count <= DSET_SLAB_MAX && !caches_off) {
+		dset_slabs[count].obj_size = size;
+		head = exfat_slab_alloc(&dset_slabs[count]);
+	} else {
+		head = w_malloc(size);
+	}
+	if (!head)
+		return NULL;
+
+	memset(head, 0, size);
+	head->count = count;
+	return (struct exfat_dentry *)(head + 1);
+}
+
+/* heap which a dentry set of @count dentries takes without caches */
+size_t exfat_dentry_set_heap_size(int count)
+{
+	return W_MEM_SIZE(sizeof(union dset_head) +
+			  count * sizeof(struct exfat_dentry));
+}
+
+void exfat_free_dentry_set(struct exfat_dentry *dset)
+{
+	union dset_head *head;
+
+	if (!dset)
+		return;
+
+	head = (union dset_head *)dset - 1;
+	if (head->count > 0 && head->count <= DSET_SLAB_MAX && !caches_off)
+		exfat_slab_free(&dset_slabs[head->count], head);
+	else
+		w_free(head);
+}
+
+/* give the memory of unused cached objects back to the heap */
+void exfat_shrink_caches(void)
+{
+	int i;
+
+	for (i = 0; i <= MAX_NAME_DENTRIES; i++)
+		exfat_slab_shrink(&inode_slabs[i]);
+	for (i = 1; i <= DSET_SLAB_MAX; i++)
+		exfat_slab_shrink(&dset_slabs[i]);
+}
+
 void exfat_free_children(struct exfat_inode *dir, bool file_only)
 {
 	struct exfat_inode *node, *i;
@@ -108,25 +256,32 @@ void exfat_free_dir_list(struct exfat *exfat)
 void exfat_free_exfat(struct exfat *exfat)
 {
 	if (exfat) {
+		exfat_fat_cache_free(exfat);
+		if (exfat->lookup_buffer)
+			exfat_free_buffer(exfat, exfat->lookup_buffer);
+		exfat_prefetch_free(exfat);
+		exfat_fat_map_free(exfat);
+		exfat_free_summary_free(exfat);
 		if (exfat->bs)
 			w_free(exfat->bs);
-		if (exfat->alloc_bitmap)
-			w_free(exfat->alloc_bitmap);
-		if (exfat->disk_bitmap)
-			w_free(exfat->disk_bitmap);
-		if (exfat->ohead_bitmap)
-			w_free(exfat->ohead_bitmap);
-		if (exfat->upcase_table)
-			w_free(exfat->upcase_table);
+		exfat_bitmap_free(exfat->alloc_bitmap);
+		exfat_bitmap_free(exfat->disk_bitmap);
+		exfat_bitmap_free(exfat->ohead_bitmap);
+		if (exfat->disk_mismatch) {
+			exfat_clus_list_free(exfat->disk_mismatch);
+			w_free(exfat->disk_mismatch);
+		}
+		if (exfat->upcase_data)
+			w_free(exfat->upcase_data);
 		if (exfat->root)
 			exfat_free_inode(exfat->root);
-		if (exfat->lookup_buffer)
-			w_free(exfat->lookup_buffer);
 		w_free(exfat);
+		exfat_shrink_caches();
 	}
 }
 
-struct exfat *exfat_alloc_exfat(struct exfat_blk_dev *blk_dev, struct pbr *bs)
+struct exfat *exfat_alloc_exfat(struct exfat_blk_dev *blk_dev, struct pbr *bs,
+				const struct exfat_bitmap_opts *bitmap_opts)
 {
 	struct exfat *exfat;
 
@@ -143,27 +298,44 @@ struct exfat *exfat_alloc_exfat(struct exfat_blk_dev *blk_dev, struct pbr *bs)
 	exfat->clus_size = EXFAT_CLUSTER_SIZE(bs);
 	exfat->sect_size = EXFAT_SECTOR_SIZE(bs);
 
-	/* TODO: bitmap could be very large. */
-	exfat->alloc_bitmap = w_calloc(1, EXFAT_BITMAP_SIZE(exfat->clus_count));
+	if (bitmap_opts)
+		exfat->bitmap_opts = *bitmap_opts;
+
+	exfat->alloc_bitmap = exfat_bitmap_alloc(&exfat->bitmap_opts,
+						 exfat->clus_count);
 	if (!exfat->alloc_bitmap) {
 		exfat_err("failed to allocate bitmap\n");
 		goto err;
 	}
 
-	exfat->ohead_bitmap = w_calloc(1, EXFAT_BITMAP_SIZE(exfat->clus_count));
+	exfat->ohead_bitmap = exfat_bitmap_alloc(&exfat->bitmap_opts,
+						 exfat->clus_count);
 	if (!exfat->ohead_bitmap) {
 		exfat_err("failed to allocate bitmap\n");
 		goto err;
 	}
 
-	exfat->disk_bitmap = w_calloc(1, EXFAT_BITMAP_SIZE(exfat->clus_count));
-	if (!exfat->disk_bitmap) {
-		exfat_err("failed to allocate bitmap\n");
-		goto err;
+	/* a streamed disk bitmap is set up when its location is known */
+	if (!exfat->bitmap_opts.stream_disk) {
+		exfat->disk_bitmap = exfat_bitmap_alloc(&exfat->bitmap_opts,
+							exfat->clus_count);
+		if (!exfat->disk_bitmap) {
+			exfat_err("failed to allocate bitmap\n");
+			goto err;
+		}
 	}
 
-	exfat->buffer_count = ((MAX_EXT_DENTRIES + 1) * DENTRY_SIZE) /
-		exfat_get_read_size(exfat) + 1;
+	exfat->read_size = exfat_dir_read_size(exfat->bitmap_opts.dir_read_size,
+					       exfat->sect_size);
+	exfat->buffer_count = exfat_buffer_count(exfat_get_read_size(exfat));
+
+	if (exfat_fat_cache_init(exfat, exfat->bitmap_opts.fat_cache_lines ?
+				 exfat->bitmap_opts.fat_cache_lines :
+				 EXFAT_FAT_CACHE_LINES,
+				 EXFAT_FAT_CACHE_LINE_SIZE)) {
+		exfat_err("failed to allocate FAT cache\n");
+		goto err;
+	}
 
 	exfat->start_clu = EXFAT_FIRST_CLUSTER;
 	return exfat;
@@ -172,117 +344,253 @@ err:
 	return NULL;
 }
 
+/* round @size down to a power of two from a sector to EXFAT_DIR_READ_MAX */
+unsigned int exfat_dir_read_size(unsigned int size, unsigned int sect_size)
+{
+	unsigned int read_size = sect_size;
+
+	if (!size)
+		size = EXFAT_DIR_READ_SIZE;
+	while (read_size * 2 <= size && read_size * 2 <= EXFAT_DIR_READ_MAX)
+		read_size *= 2;
+	return read_size;
+}
+
+/*
+ * a set of dentry buffers is one allocation: the descriptors, the blocks
+ * and a dirty bitmap for each descriptor. the blocks are carved for the
+ * directory which is read, there are fewer of them if they are larger.
+ */
+#define EXFAT_STITCH_ALIGN	32	/* dentries */
+
+struct buffer_set {
+	struct exfat_dentry	*stitch;	/* see exfat_buffer_stitch() */
+	unsigned int		stitch_count;
+	struct buffer_desc	bd[];
+};
+
+static struct buffer_set *buffer_set_of(struct buffer_desc *bd)
+{
+	return (struct buffer_set *)((char *)bd -
+				     offsetof(struct buffer_set, bd));
+}
+
+static size_t buffer_desc_size(unsigned int read_size, unsigned int clus_size)
+{
+	return round_up(sizeof(struct buffer_set) +
+			exfat_buffer_count(MIN(read_size, clus_size)) *
+			sizeof(struct buffer_desc), 8);
+}
+
+static size_t buffer_data_size(unsigned int read_size, unsigned int clus_size)
+{
+	unsigned int unit = MIN(read_size, clus_size);
+
+	return MAX((size_t)exfat_buffer_count(unit) * unit,
+		   (size_t)exfat_buffer_count(read_size) * read_size);
+}
+
+size_t exfat_buffer_mem_size(unsigned int read_size, unsigned int clus_size,
+			     unsigned int sect_size)
+{
+	return buffer_desc_size(read_size, clus_size) +
+		buffer_data_size(read_size, clus_size) +
+		exfat_buffer_count(MIN(read_size, clus_size)) *
+		EXFAT_BITMAP_SIZE(read_size / sect_size);
+}
+
+/*
+ * heap which a set of dentry buffers takes from exfat_alloc_buffer(),
+ * with room to stitch the largest dentry set.
+ */
+size_t exfat_buffer_heap_size(unsigned int read_size, unsigned int clus_size,
+			      unsigned int sect_size)
+{
+	return W_MEM_SIZE(exfat_buffer_mem_size(read_size, clus_size,
+						sect_size)) +
+		W_MEM_SIZE(round_up(MAX_EXT_DENTRIES + 1, EXFAT_STITCH_ALIGN) *
+			   sizeof(struct exfat_dentry));
+}
+
 struct buffer_desc *exfat_alloc_buffer(struct exfat *exfat)
 {
+	struct buffer_set *set;
 	struct buffer_desc *bd;
+	char *dirty;
+	size_t dirty_size = EXFAT_BITMAP_SIZE(exfat->read_size /
+					      exfat->sect_size);
 	unsigned int i;
-	unsigned int read_size = exfat_get_read_size(exfat);
 
-	bd = w_calloc(exfat->buffer_count, sizeof(*bd));
-	if (!bd)
+	set = w_calloc(1, exfat_buffer_mem_size(exfat->read_size,
+						exfat->clus_size,
+						exfat->sect_size));
+	if (!set)
 		return NULL;
 
+	bd = set->bd;
+	dirty = (char *)set + buffer_desc_size(exfat->read_size,
+					       exfat->clus_size) +
+		buffer_data_size(exfat->read_size, exfat->clus_size);
+	for (i = 0; i < exfat->buffer_count; i++)
+		bd[i].dirty = dirty + i * dirty_size;
+	exfat_buffer_set_block(exfat, bd, exfat_get_read_size(exfat));
+	return bd;
+}
+
+/*
+ * carve the blocks of @bd for a directory read @block_size bytes at a
+ * time. the blocks must be clean and not borrow read-ahead slots.
+ */
+void exfat_buffer_set_block(const struct exfat *exfat, struct buffer_desc *bd,
+			    unsigned int block_size)
+{
+	char *data = (char *)buffer_set_of(bd) +
+		buffer_desc_size(exfat->read_size, exfat->clus_size);
+	unsigned int i, count = exfat_buffer_count(block_size);
+
 	for (i = 0; i < exfat->buffer_count; i++) {
-		bd[i].buffer = w_malloc(read_size);
-		if (!bd[i].buffer)
-			goto err;
+		bd[i].own_buffer = i < count ? data + i * block_size : NULL;
+		bd[i].buffer = bd[i].own_buffer;
+	}
+}
 
-		memset(&bd[i].dirty, 0, sizeof(bd[i].dirty));
+/*
+ * return room for @count dentries which are copied out of the blocks of
+ * @bd, or NULL. it is kept with @bd and grows as needed.
+ */
+struct exfat_dentry *exfat_buffer_stitch(struct buffer_desc *bd,
+					 unsigned int count)
+{
+	struct buffer_set *set = buffer_set_of(bd);
+
+	if (count > set->stitch_count) {
+		count = round_up(count, EXFAT_STITCH_ALIGN);
+		if (set->stitch)
+			w_free(set->stitch);
+		set->stitch = w_malloc(count * sizeof(struct exfat_dentry));
+		set->stitch_count = set->stitch ? count : 0;
 	}
-	return bd;
-err:
-	exfat_free_buffer(exfat, bd);
-	return NULL;
+	return set->stitch;
 }
 
 void exfat_free_buffer(const struct exfat *exfat, struct buffer_desc *bd)
 {
+	struct buffer_set *set = buffer_set_of(bd);
 	unsigned int i;
 
-	for (i = 0; i < exfat->buffer_count; i++) {
-		if (bd[i].buffer)
-			w_free(bd[i].buffer);
+	if (exfat->prefetch) {
+		for (i = 0; i < exfat->buffer_count; i++)
+			exfat_prefetch_put(exfat->prefetch, &bd[i]);
 	}
-	w_free(bd);
+	if (set->stitch)
+		w_free(set->stitch);
+	w_free(set);
 }
 
+struct path_resolve_ctx path_resolve_ctx;
+
+/* the path of an inode which could not be resolved */
+static char path_unresolved[1];
+
 /*
- * get references of ancestors that include @child until the count of
- * ancesters is not larger than @count and the count of characters of
- * their names is not larger than @max_char_len.
- * return true if root is reached.
+ * count the ancestors that include @child until there are @count of
+ * them or their names take more than @max_char_len characters. return
+ * the count, and the characters of their names and a slash after each
+ * in @char_len.
  */
-static bool get_ancestors(struct exfat_inode *child,
-			  struct exfat_inode **ancestors, int count,
-			  int max_char_len,
-			  int *ancestor_count)
+static int get_ancestors(struct exfat_inode *child, int count,
+			 int max_char_len, int *char_len)
 {
 	struct exfat_inode *dir;
-	int name_len, char_len;
-	int root_depth, depth, i;
+	int name_len, depth;
 
-	root_depth = 0;
-	char_len = 0;
+	depth = 0;
+	*char_len = 0;
 	max_char_len += 1;
 
-	dir = child;
-	while (dir) {
+	for (dir = child; dir && depth < count; dir = dir->parent) {
 		name_len = exfat_utf16_len(dir->name, NAME_BUFFER_SIZE);
-		if (char_len + name_len > max_char_len)
+		if (*char_len + name_len > max_char_len)
 			break;
 
 		/* include '/' */
-		char_len += name_len + 1;
-		root_depth++;
-
-		dir = dir->parent;
+		*char_len += name_len + 1;
+		depth++;
 	}
+	return depth;
+}
 
-	depth = MIN(root_depth, count);
-
-	for (dir = child, i = depth - 1; i >= 0; dir = dir->parent, i--)
-		ancestors[i] = dir;
-
-	*ancestor_count = depth;
-	return !dir;
+void exfat_release_path(struct path_resolve_ctx *ctx)
+{
+	if (ctx->size)
+		w_free(ctx->local_path);
+	ctx->local_path = path_unresolved;
+	ctx->size = 0;
 }
 
+/*
+ * resolve the path of @child into @ctx->local_path, from root or from
+ * the outermost ancestor which fits in @ctx->max_len characters. the names
+ * are copied from the end of the path backwards, so only the ancestors
+ * which are printed are visited.
+ */
 int exfat_resolve_path(struct path_resolve_ctx *ctx, struct exfat_inode *child)
 {
-	int depth, i;
-	int name_len;
-	__le16 *utf16_path;
-	static const __le16 utf16_slash = cpu_to_le16(0x002F);
-	static const __le16 utf16_null = cpu_to_le16(0x0000);
+	struct exfat_inode *dir;
+	int depth, char_len, name_len, i;
+	__le16 *utf16_path, *p;
 	size64_t in_size;
+	int ret;
+
+	exfat_release_path(ctx);
+
+	depth = get_ancestors(child, ctx->max_depth ? ctx->max_depth :
+			      PATH_RESOLVE_MAX_DEPTH,
+			      ctx->max_len ? ctx->max_len : PATH_MAX, &char_len);
 
-	ctx->local_path[0] = '\0';
-
-	get_ancestors(child,
-		      ctx->ancestors,
-		      sizeof(ctx->ancestors) / sizeof(ctx->ancestors[0]),
-		      PATH_MAX,
-		      &depth);
-
-	utf16_path = ctx->utf16_path;
-	for (i = 0; i < depth; i++) {
-		name_len = exfat_utf16_len(ctx->ancestors[i]->name,
-					   NAME_BUFFER_SIZE);
-		memcpy((char *)utf16_path, (char *)ctx->ancestors[i]->name,
-		       name_len * 2);
-		utf16_path += name_len;
-		memcpy((char *)utf16_path, &utf16_slash, sizeof(utf16_slash));
-		utf16_path++;
+	utf16_path = w_malloc((char_len + 1) * sizeof(__le16));
+	if (!utf16_path)
+		return -ENOMEM;
+
+	p = utf16_path + char_len;
+	for (dir = child, i = 0; i < depth; dir = dir->parent, i++) {
+		name_len = exfat_utf16_len(dir->name, NAME_BUFFER_SIZE);
+		*--p = cpu_to_le16(0x002F);
+		p -= name_len;
+		memcpy(p, dir->name, name_len * sizeof(__le16));
 	}
 
+	/* drop the last slash, but not the one of root alone */
 	if (depth > 1)
-		utf16_path--;
-	memcpy((char *)utf16_path, &utf16_null, sizeof(utf16_null));
-	utf16_path++;
+		char_len--;
+	utf16_path[char_len] = cpu_to_le16(0x0000);
+	in_size = (char_len + 1) * sizeof(__le16);
+
+	ctx->size = (char_len + 1) * MB_CUR_MAX + 1;
+	ctx->local_path = w_malloc(ctx->size);
+	if (!ctx->local_path) {
+		ctx->size = 0;
+		ctx->local_path = path_unresolved;
+		w_free(utf16_path);
+		return -ENOMEM;
+	}
+
+	ret = exfat_utf16_dec(utf16_path, in_size, ctx->local_path,
+			      ctx->size);
+	w_free(utf16_path);
+	if (ret < 0)
+		ctx->local_path[0] = '\0';
+	return ret;
+}
+
+/* the most heap exfat_resolve_path() takes at once with @ctx->max_len */
+size_t exfat_resolve_path_heap_size(const struct path_resolve_ctx *ctx)
+{
+	size_t len = (ctx->max_len ? ctx->max_len : PATH_MAX) + 3;
 
-	in_size = (utf16_path - ctx->utf16_path) * sizeof(__le16);
-	return exfat_utf16_dec(ctx->utf16_path, in_size,
-				ctx->local_path, sizeof(ctx->local_path));
+	return W_MEM_SIZE(len * sizeof(__le16)) +
+		W_MEM_SIZE(len * MB_CUR_MAX + 1) +
+		W_MEM_SIZE((len + 1) * sizeof(wchar_t));
 }
 
 int exfat_resolve_path_parent(struct path_resolve_ctx *ctx,
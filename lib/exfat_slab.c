@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Object caches for fixed-size objects and arenas for short-lived
+ *   ones, so frequent small allocations do not go to the heap one by one.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "exfat_ondisk.h"
+#include "libexfat.h"
+#include "exfat_fs.h"
+#include "mem_wrapper.h"
+
+/* keeps the objects after a chunk or block header 8-byte aligned */
+#define SLAB_ALIGN	8
+
+union exfat_slab_chunk {
+	union exfat_slab_chunk	*next;
+	uint64_t		align;
+};
+
+struct exfat_arena_block {
+	struct exfat_arena_block *next;
+	size_t			size;
+	size_t			used;
+	uint64_t		data[];
+};
+
+static size_t slab_obj_size(struct exfat_slab *slab)
+{
+	return round_up(MAX(slab->obj_size, sizeof(void *)), SLAB_ALIGN);
+}
+
+/* carve a new chunk into objects and put them on the free list */
+static int slab_grow(struct exfat_slab *slab)
+{
+	size_t size = slab_obj_size(slab);
+	unsigned int i, count;
+	union exfat_slab_chunk *chunk;
+	char *obj;
+
+	count = MAX(EXFAT_SLAB_CHUNK_SIZE / size, 1);
+	chunk = w_malloc(sizeof(*chunk) + count * size);
+	if (!chunk)
+		return -ENOMEM;
+
+	chunk->next = slab->chunks;
+	slab->chunks = chunk;
+	slab->chunk_count++;
+
+	obj = (char *)(chunk + 1);
+	for (i = 0; i < count; i++, obj += size) {
+		*(void **)obj = slab->free_list;
+		slab->free_list = obj;
+	}
+	return 0;
+}
+
+/* return an uninitialized object of @slab->obj_size bytes */
+void *exfat_slab_alloc(struct exfat_slab *slab)
+{
+	void *obj;
+
+	if (!slab->free_list && slab_grow(slab))
+		return NULL;
+
+	obj = slab->free_list;
+	slab->free_list = *(void **)obj;
+	slab->in_use++;
+	return obj;
+}
+
+void exfat_slab_free(struct exfat_slab *slab, void *obj)
+{
+	*(void **)obj = slab->free_list;
+	slab->free_list = obj;
+	slab->in_use--;
+}
+
+/* give the chunks of @slab back to the heap once no object is in use */
+void exfat_slab_shrink(struct exfat_slab *slab)
+{
+	union exfat_slab_chunk *chunk;
+
+	if (slab->in_use)
+		return;
+
+	while (slab->chunks) {
+		chunk = slab->chunks;
+		slab->chunks = chunk->next;
+		w_free(chunk);
+	}
+	slab->free_list = NULL;
+	slab->chunk_count = 0;
+}
+
+/*
+ * return @size bytes which live until the next exfat_arena_reset().
+ * blocks are @arena->block_size bytes, or EXFAT_ARENA_BLOCK_SIZE if it
+ * is 0, unless @size does not fit.
+ */
+void *exfat_arena_alloc(struct exfat_arena *arena, size_t size)
+{
+	struct exfat_arena_block *block = arena->blocks;
+	size_t block_size;
+	void *p;
+
+	size = round_up(MAX(size, 1), SLAB_ALIGN);
+	if (!block || block->size - block->used < size) {
+		block_size = arena->block_size ? arena->block_size :
+			EXFAT_ARENA_BLOCK_SIZE;
+		block_size = MAX(block_size, size);
+		block = w_malloc(sizeof(*block) + block_size);
+		if (!block)
+			return NULL;
+		block->size = block_size;
+		block->used = 0;
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+
+	p = (char *)block->data + block->used;
+	block->used += size;
+	return p;
+}
+
+/* free everything allocated from @arena, keeping its first block */
+void exfat_arena_reset(struct exfat_arena *arena)
+{
+	struct exfat_arena_block *block;
+
+	while (arena->blocks && arena->blocks->next) {
+		block = arena->blocks;
+		arena->blocks = block->next;
+		w_free(block);
+	}
+	if (arena->blocks)
+		arena->blocks->used = 0;
+}
+
+/* heap of the block which exfat_arena_reset() keeps */
+size_t exfat_arena_heap_size(const struct exfat_arena *arena)
+{
+	return W_MEM_SIZE(sizeof(struct exfat_arena_block) +
+			  (arena->block_size ? arena->block_size :
+			   EXFAT_ARENA_BLOCK_SIZE));
+}
+
+void exfat_arena_free(struct exfat_arena *arena)
+{
+	exfat_arena_reset(arena);
+	if (arena->blocks)
+		w_free(arena->blocks);
+	arena->blocks = NULL;
+}
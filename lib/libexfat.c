@@ -30,52 +30,224 @@
 
 unsigned int print_level  = EXFAT_DEBUG;
 
-void exfat_bitmap_set_range(struct exfat *exfat, char *bitmap,
-			    clus_t start_clus, clus_t count)
+/* free clusters of the @w-th bitmap word in alloc_bitmap | disk_bitmap */
+static bitmap_t exfat_free_word(struct exfat *exfat, unsigned int w)
 {
-	clus_t clus;
+	bitmap_t word;
+	clus_t tail;
+
+	word = ~(exfat_bitmap_word(exfat->alloc_bitmap, w) |
+		 exfat_bitmap_word(exfat->disk_bitmap, w));
+	tail = exfat->clus_count - w * BITS_PER;
+	if (tail < BITS_PER)
+		word &= (bitmap_t)~0 >> (BITS_PER - tail);
+	return word;
+}
 
-	if (!exfat_heap_clus(exfat, start_clus) ||
-	    !exfat_heap_clus(exfat, start_clus + count - 1))
-		return;
+static void exfat_free_summary_update_word(struct exfat *exfat,
+					   unsigned int w)
+{
+	struct exfat_free_summary *fs = exfat->free_summary;
+	unsigned int v = BIT_ENTRY(w);
 
-	clus = start_clus;
-	while (clus < start_clus + count) {
-		exfat_bitmap_set(bitmap, clus);
-		clus++;
+	if (exfat_free_word(exfat, w)) {
+		BITMAP_SET(fs->l1, w);
+		BITMAP_SET(fs->l2, v);
+	} else {
+		BITMAP_CLEAR(fs->l1, w);
+		if (!fs->l1[v])
+			BITMAP_CLEAR(fs->l2, v);
 	}
 }
 
-static int exfat_bitmap_find_bit(struct exfat *exfat, char *bmap,
-				 clus_t start_clu, clus_t *next,
-				 int bit)
+/* refresh the summary of the bitmap words holding the given clusters */
+static void exfat_free_summary_update(struct exfat *exfat, clus_t start_clus,
+				      clus_t count)
 {
-	clus_t last_clu;
+	unsigned int w, end;
 
-	last_clu = le32_to_cpu(exfat->bs->bsx.clu_count) +
-		EXFAT_FIRST_CLUSTER;
-	while (start_clu < last_clu) {
-		if (!!exfat_bitmap_get(bmap, start_clu) == bit) {
-			*next = start_clu;
-			return 0;
+	if (!exfat->free_summary || !count)
+		return;
+
+	w = BIT_ENTRY(start_clus - EXFAT_FIRST_CLUSTER);
+	end = BIT_ENTRY(start_clus - EXFAT_FIRST_CLUSTER + count - 1);
+	for (; w <= end; w++)
+		exfat_free_summary_update_word(exfat, w);
+}
+
+void exfat_free_summary_free(struct exfat *exfat)
+{
+	struct exfat_free_summary *fs = exfat->free_summary;
+
+	if (!fs)
+		return;
+
+	if (fs->l1)
+		w_free(fs->l1);
+	if (fs->l2)
+		w_free(fs->l2);
+	w_free(fs);
+	exfat->free_summary = NULL;
+}
+
+/*
+ * build the free summary from alloc_bitmap and disk_bitmap. after this
+ * alloc_bitmap must only be changed by exfat_alloc_bitmap_set*().
+ */
+int exfat_free_summary_init(struct exfat *exfat)
+{
+	struct exfat_free_summary *fs;
+	unsigned int w;
+
+	exfat_free_summary_free(exfat);
+
+	fs = w_calloc(1, sizeof(*fs));
+	if (!fs)
+		return -ENOMEM;
+	exfat->free_summary = fs;
+
+	fs->words = DIV_ROUND_UP(exfat->clus_count, BITS_PER);
+	fs->l1 = w_calloc(1, EXFAT_BITMAP_SIZE(fs->words));
+	fs->l2 = w_calloc(1, EXFAT_BITMAP_SIZE(DIV_ROUND_UP(fs->words,
+							      BITS_PER)));
+	if (!fs->l1 || !fs->l2) {
+		exfat_free_summary_free(exfat);
+		return -ENOMEM;
+	}
+
+	for (w = 0; w < fs->words; w++) {
+		if (exfat_free_word(exfat, w)) {
+			BITMAP_SET(fs->l1, w);
+			BITMAP_SET(fs->l2, BIT_ENTRY(w));
 		}
-		start_clu++;
 	}
-	return 1;
+	return 0;
+}
+
+/* the first bitmap word from @w which has a free cluster */
+static unsigned int exfat_free_summary_next(struct exfat_free_summary *fs,
+					    unsigned int w)
+{
+	unsigned int v, end;
+
+	if (w >= fs->words)
+		return fs->words;
+
+	v = BIT_ENTRY(w);
+	end = MIN((v + 1) * BITS_PER, fs->words);
+	w = exfat_bits_scan(fs->l1, w, end, 1);
+	if (w < end)
+		return w;
+
+	end = DIV_ROUND_UP(fs->words, BITS_PER);
+	v = exfat_bits_scan(fs->l2, v + 1, end, 1);
+	if (v >= end)
+		return fs->words;
+	return v * BITS_PER + __builtin_ctz(fs->l1[v]);
 }
 
-int exfat_bitmap_find_zero(struct exfat *exfat, char *bmap,
-			   clus_t start_clu, clus_t *next)
+/*
+ * find a cluster in [@start_clu, @end_clu) which is free in both
+ * alloc_bitmap and disk_bitmap, using the free summary.
+ */
+int exfat_free_summary_find(struct exfat *exfat, clus_t start_clu,
+			    clus_t end_clu, clus_t *free_clu)
 {
-	return exfat_bitmap_find_bit(exfat, bmap,
-				     start_clu, next, 0);
+	struct exfat_free_summary *fs = exfat->free_summary;
+	bitmap_t word;
+	clus_t b, end;
+	unsigned int w;
+
+	if (!fs)
+		return -EINVAL;
+	if (start_clu >= end_clu)
+		return -ENOSPC;
+
+	b = start_clu - EXFAT_FIRST_CLUSTER;
+	end = end_clu - EXFAT_FIRST_CLUSTER;
+	w = BIT_ENTRY(b);
+	word = exfat_free_word(exfat, w) &
+		(bitmap_t)((bitmap_t)~0 << (b % BITS_PER));
+	while (!word) {
+		w = exfat_free_summary_next(fs, w + 1);
+		if (w >= fs->words || w * BITS_PER >= end)
+			return -ENOSPC;
+		word = exfat_free_word(exfat, w);
+	}
+
+	b = w * BITS_PER + __builtin_ctz(word);
+	if (b >= end)
+		return -ENOSPC;
+	*free_clu = b + EXFAT_FIRST_CLUSTER;
+	return 0;
 }
 
-int exfat_bitmap_find_one(struct exfat *exfat, char *bmap,
-			  clus_t start_clu, clus_t *next)
+/* record the clusters of [@start_clus, +@count) which are free on disk */
+static void exfat_disk_mismatch_add(struct exfat *exfat, clus_t start_clus,
+				    clus_t count)
 {
-	return exfat_bitmap_find_bit(exfat, bmap,
-				     start_clu, next, 1);
+	clus_t end = start_clus + count, s, e;
+
+	for (s = start_clus; s < end; s = e) {
+		s = exfat_bitmap_scan(exfat->disk_bitmap, s, end, 0);
+		if (s >= end)
+			break;
+		e = exfat_bitmap_scan(exfat->disk_bitmap, s + 1, end, 1);
+		exfat_clus_list_add(exfat->disk_mismatch, s, e - s);
+	}
+}
+
+/*
+ * read the on-disk bitmap of @size bytes at @offset through a window of
+ * @resident pages instead of loading it. clusters which get allocated
+ * but are free on disk are kept in exfat->disk_mismatch from now on.
+ */
+int exfat_disk_bitmap_stream(struct exfat *exfat, off64_t offset,
+			     size_t size, unsigned int page_size,
+			     unsigned int resident)
+{
+	struct exfat_bitmap_iter iter;
+	clus_t start, count;
+
+	exfat_bitmap_free(exfat->disk_bitmap);
+	exfat->disk_bitmap = exfat_bitmap_map(exfat->blk_dev->dev_fd, offset,
+					      size, exfat->clus_count,
+					      page_size, resident);
+	if (!exfat->disk_bitmap)
+		return -ENOMEM;
+	exfat->disk_mismatch = w_calloc(1, sizeof(*exfat->disk_mismatch));
+	if (!exfat->disk_mismatch)
+		return -ENOMEM;
+	exfat->disk_mismatch->max = exfat->bitmap_opts.mismatch_runs;
+
+	/* clusters allocated so far */
+	exfat_bitmap_iter_init(exfat, &iter, exfat->alloc_bitmap,
+			       EXFAT_FIRST_CLUSTER);
+	while (exfat_bitmap_iter_next(&iter, 1, &start, &count))
+		exfat_disk_mismatch_add(exfat, start, count);
+	return exfat->disk_bitmap->err;
+}
+
+void exfat_alloc_bitmap_set(struct exfat *exfat, clus_t clus)
+{
+	exfat_bitmap_set(exfat->alloc_bitmap, clus);
+	exfat_free_summary_update(exfat, clus, 1);
+	if (exfat->disk_mismatch && exfat_heap_clus(exfat, clus) &&
+	    !exfat_bitmap_get(exfat->disk_bitmap, clus))
+		exfat_clus_list_add(exfat->disk_mismatch, clus, 1);
+}
+
+void exfat_alloc_bitmap_set_range(struct exfat *exfat, clus_t start_clus,
+				  clus_t count)
+{
+	exfat_bitmap_set_range(exfat, exfat->alloc_bitmap, start_clus, count);
+	if (!exfat_heap_clus(exfat, start_clus) ||
+	    !exfat_heap_clus(exfat, start_clus + count - 1))
+		return;
+
+	exfat_free_summary_update(exfat, start_clus, count);
+	if (exfat->disk_mismatch)
+		exfat_disk_mismatch_add(exfat, start_clus, count);
 }
 
 wchar_t exfat_bad_char(wchar_t w)
@@ -86,24 +258,40 @@ wchar_t exfat_bad_char(wchar_t w)
 		|| (w == '\\');
 }
 
-void boot_calc_checksum(unsigned char *sector, unsigned short size,
+/* sum bytes @start up to @end of @p, nothing if @start is not below @end */
+static uint32_t boot_sum_bytes(uint32_t sum, const unsigned char *p,
+			       unsigned int start, unsigned int end)
+{
+	unsigned int i;
+
+	for (i = start; i + 4 <= end; i += 4) {
+		sum = exfat_sum32_add(sum, p[i]);
+		sum = exfat_sum32_add(sum, p[i + 1]);
+		sum = exfat_sum32_add(sum, p[i + 2]);
+		sum = exfat_sum32_add(sum, p[i + 3]);
+	}
+	for (; i < end; i++)
+		sum = exfat_sum32_add(sum, p[i]);
+	return sum;
+}
+
+/*
+ * the sum is kept in a register, and the volume flags and percent in
+ * use of the boot sector are skipped by splitting the range around them.
+ */
+void boot_calc_checksum(unsigned char *sector, unsigned int size,
 		bool is_boot_sec, __le32 *checksum)
 {
-	unsigned int index;
+	uint32_t sum = *checksum;
 
 	if (is_boot_sec) {
-		for (index = 0; index < size; index++) {
-			if ((index == 106) || (index == 107) || (index == 112))
-				continue;
-			*checksum = ((*checksum & 1) ? 0x80000000 : 0) +
-				(*checksum >> 1) + sector[index];
-		}
+		sum = boot_sum_bytes(sum, sector, 0, MIN(size, 106));
+		sum = boot_sum_bytes(sum, sector, 108, MIN(size, 112));
+		sum = boot_sum_bytes(sum, sector, 113, size);
 	} else {
-		for (index = 0; index < size; index++) {
-			*checksum = ((*checksum & 1) ? 0x80000000 : 0) +
-				(*checksum >> 1) + sector[index];
-		}
+		sum = boot_sum_bytes(sum, sector, 0, size);
 	}
+	*checksum = sum;
 }
 
 void show_version(void)
@@ -228,6 +416,7 @@ ssize64_t exfat_read(int fd, void *buf, size64_t size, off64_t offset)
 
 ssize64_t exfat_write(int fd, void *buf, size64_t size, off64_t offset)
 {
+	exfat_prefetch_invalidate(fd, offset, size);
 	return w_pwrite(fd, buf, size, offset);
 }
 
@@ -235,6 +424,7 @@ ssize64_t exfat_write_zero(int fd, size64_t size, off64_t offset)
 {
 	const char zero_buf[4 * KB] = {0};
 
+	exfat_prefetch_invalidate(fd, offset, size);
 	w_lseek(fd, offset, SEEK_SET);
 
 	while (size > 0) {
@@ -249,6 +439,18 @@ ssize64_t exfat_write_zero(int fd, size64_t size, off64_t offset)
 	return 0;
 }
 
+/* hand out @size bytes of @scratch, starting at *@offset of its fd */
+int exfat_scratch_reserve(struct exfat_scratch *scratch, size_t size,
+			  off64_t *offset)
+{
+	if (scratch->size && scratch->size - scratch->used < (off64_t)size)
+		return -ENOSPC;
+
+	*offset = scratch->offset + scratch->used;
+	scratch->used += size;
+	return 0;
+}
+
 size64_t exfat_utf16_len(const __le16 *str, size64_t max_size)
 {
 	size64_t i = 0;
@@ -472,7 +674,7 @@ int exfat_read_volume_label(struct exfat *exfat)
 
 	exfat_info("label: %s\n", exfat->volume_label);
 out:
-	w_free(filter.out.dentry_set);
+	exfat_free_dentry_set(filter.out.dentry_set);
 	return err;
 }
 
@@ -495,7 +697,7 @@ int exfat_set_volume_label(struct exfat *exfat, char *label_input)
 		dcount = filter.out.dentry_count;
 		memset(pvol->vol_label, 0, sizeof(pvol->vol_label));
 	} else {
-		pvol = w_calloc(1, sizeof(struct exfat_dentry));
+		pvol = exfat_alloc_dentry_set(1);
 		if (!pvol)
 			return -ENOMEM;
 
@@ -529,7 +731,7 @@ int exfat_set_volume_label(struct exfat *exfat, char *label_input)
 	exfat_info("new label: %s\n", label_input);
 
 out:
-	w_free(pvol);
+	exfat_free_dentry_set(pvol);
 
 	return err;
 }
@@ -613,7 +815,7 @@ int exfat_read_volume_guid(struct exfat *exfat)
 	else
 		exfat_info("GUID is corrupted, please delete it or set a new one\n");
 
-	w_free(dentry);
+	exfat_free_dentry_set(dentry);
 
 	return err;
 }
@@ -663,7 +865,7 @@ int exfat_set_volume_guid(struct exfat *exfat, const char *guid)
 		if (guid == NULL)
 			return 0;
 
-		dentry = w_calloc(1, sizeof(*dentry));
+		dentry = exfat_alloc_dentry_set(1);
 		if (!dentry)
 			return -ENOMEM;
 	}
@@ -690,7 +892,7 @@ int exfat_set_volume_guid(struct exfat *exfat, const char *guid)
 	}
 
 out:
-	w_free(dentry);
+	exfat_free_dentry_set(dentry);
 
 	return err;
 }
@@ -896,18 +1098,433 @@ unsigned int exfat_clus_to_blk_dev_off(struct exfat_blk_dev *bd,
 		(clu - EXFAT_RESERVED_CLUSTERS) * bd->cluster_size;
 }
 
+static off64_t exfat_fat_offset(struct exfat *exfat)
+{
+	return (off64_t)le32_to_cpu(exfat->bs->bsx.fat_offset) <<
+		exfat->bs->bsx.sect_size_bits;
+}
+
+static int fat_cache_write_line(struct exfat *exfat,
+				struct fat_cache_line *line)
+{
+	if (exfat_write(exfat->blk_dev->dev_fd, line->buffer, line->size,
+			line->offset) != (ssize64_t)line->size)
+		return -EIO;
+
+	line->dirty = false;
+	exfat->fat_cache->writebacks++;
+	return 0;
+}
+
+/*
+ * find the cache line which covers the FAT entry at device @offset,
+ * or read it in place of the least recently used line.
+ * return -ERANGE if @offset is out of the FAT region.
+ */
+static int fat_cache_get_line(struct exfat *exfat, off64_t offset,
+			      struct fat_cache_line **line)
+{
+	struct exfat_fat_cache *cache = exfat->fat_cache;
+	struct fat_cache_line *l, *victim;
+	off64_t fat_start, fat_end, base;
+	unsigned int i;
+
+	l = &cache->lines[cache->last_line];
+	if (l->offset >= 0 && offset >= l->offset &&
+	    offset < l->offset + l->size)
+		goto hit;
+
+	victim = NULL;
+	for (i = 0; i < cache->line_count; i++) {
+		l = &cache->lines[i];
+		if (l->offset >= 0 && offset >= l->offset &&
+		    offset < l->offset + l->size) {
+			cache->last_line = i;
+			goto hit;
+		}
+		if (!victim || l->lru < victim->lru)
+			victim = l;
+	}
+
+	fat_start = exfat_fat_offset(exfat);
+	fat_end = fat_start + ((off64_t)le32_to_cpu(exfat->bs->bsx.fat_length) <<
+			       exfat->bs->bsx.sect_size_bits);
+	if (offset < fat_start || offset >= fat_end)
+		return -ERANGE;
+
+	if (victim->dirty && fat_cache_write_line(exfat, victim))
+		return -EIO;
+
+	base = fat_start + (offset - fat_start) / cache->line_size *
+		cache->line_size;
+	victim->offset = -1;
+	victim->size = (unsigned int)MIN((off64_t)cache->line_size,
+					 fat_end - base);
+	if (exfat_read(exfat->blk_dev->dev_fd, victim->buffer, victim->size,
+		       base) != (ssize64_t)victim->size)
+		return -EIO;
+
+	victim->offset = base;
+	cache->last_line = victim - cache->lines;
+	cache->misses++;
+	victim->lru = ++cache->lru_clock;
+	*line = victim;
+	return 0;
+hit:
+	cache->hits++;
+	l->lru = ++cache->lru_clock;
+	*line = l;
+	return 0;
+}
+
+int exfat_fat_cache_flush(struct exfat *exfat)
+{
+	struct exfat_fat_cache *cache = exfat->fat_cache;
+	unsigned int i;
+	int ret = 0;
+
+	if (!cache)
+		return 0;
+
+	for (i = 0; i < cache->line_count; i++) {
+		if (cache->lines[i].dirty &&
+		    fat_cache_write_line(exfat, &cache->lines[i]))
+			ret = -EIO;
+	}
+	return ret;
+}
+
+void exfat_fat_cache_free(struct exfat *exfat)
+{
+	struct exfat_fat_cache *cache = exfat->fat_cache;
+	unsigned int i;
+
+	if (!cache)
+		return;
+
+	if (exfat_fat_cache_flush(exfat))
+		exfat_err("failed to write back FAT cache\n");
+
+	for (i = 0; i < cache->line_count; i++) {
+		if (cache->lines[i].buffer)
+			w_free(cache->lines[i].buffer);
+	}
+	w_free(cache->lines);
+	w_free(cache);
+	exfat->fat_cache = NULL;
+}
+
+/*
+ * (re)create the FAT cache with @line_count lines of @line_size bytes.
+ * @line_size is rounded up to the sector size. the cache is disabled
+ * if @line_count is 0.
+ */
+int exfat_fat_cache_init(struct exfat *exfat, unsigned int line_count,
+			 unsigned int line_size)
+{
+	struct exfat_fat_cache *cache;
+	unsigned int i;
+
+	if (exfat->fat_cache) {
+		if (exfat_fat_cache_flush(exfat))
+			return -EIO;
+		exfat_fat_cache_free(exfat);
+	}
+
+	if (!line_count)
+		return 0;
+
+	cache = w_calloc(1, sizeof(*cache));
+	if (!cache)
+		return -ENOMEM;
+
+	cache->lines = w_calloc(line_count, sizeof(*cache->lines));
+	if (!cache->lines) {
+		w_free(cache);
+		return -ENOMEM;
+	}
+
+	exfat->fat_cache = cache;
+	cache->line_count = line_count;
+	cache->line_size = round_up(MAX(line_size, exfat->sect_size),
+				    exfat->sect_size);
+	for (i = 0; i < line_count; i++) {
+		cache->lines[i].offset = -1;
+		cache->lines[i].buffer = w_malloc(cache->line_size);
+		if (!cache->lines[i].buffer) {
+			exfat_fat_cache_free(exfat);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/* heap which exfat_fat_cache_init() takes */
+size_t exfat_fat_cache_heap_size(unsigned int line_count,
+				 unsigned int line_size, unsigned int sect_size)
+{
+	if (!line_count)
+		return 0;
+	line_size = round_up(MAX(line_size, sect_size), sect_size);
+	return W_MEM_SIZE(sizeof(struct exfat_fat_cache)) +
+		W_MEM_SIZE(line_count * sizeof(struct fat_cache_line)) +
+		line_count * W_MEM_SIZE(line_size);
+}
+
+/* return the index of the first jump whose cluster is not less than @clus */
+static unsigned int fat_map_find_jump(struct exfat_fat_map *map, clus_t clus)
+{
+	unsigned int lo = 0, hi = map->jump_count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (map->jumps[mid].clus < clus)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * look up the FAT entry of @clus in the FAT map.
+ * return 0 if found, or 1 if the entry must be read from the FAT.
+ */
+static int fat_map_lookup(struct exfat_fat_map *map, clus_t clus,
+			  clus_t *next)
+{
+	unsigned int i;
+
+	if (exfat_bitmap_get(map->seq_bitmap, clus)) {
+		*next = clus + 1;
+		return 0;
+	}
+	if (exfat_bitmap_get(map->eof_bitmap, clus)) {
+		*next = EXFAT_EOF_CLUSTER;
+		return 0;
+	}
+
+	i = fat_map_find_jump(map, clus);
+	if (i < map->jump_count && map->jumps[i].clus == clus) {
+		*next = map->jumps[i].next;
+		return 0;
+	}
+
+	if (map->complete) {
+		*next = EXFAT_FREE_CLUSTER;
+		return 0;
+	}
+	return 1;
+}
+
+static void fat_map_update(struct exfat *exfat, clus_t clus, clus_t next)
+{
+	struct exfat_fat_map *map = exfat->fat_map;
+	unsigned int i;
+
+	exfat_bitmap_clear(map->seq_bitmap, clus);
+	exfat_bitmap_clear(map->eof_bitmap, clus);
+
+	i = fat_map_find_jump(map, clus);
+	if (i < map->jump_count && map->jumps[i].clus == clus) {
+		map->jumps[i].next = next;
+		goto out;
+	}
+
+	if (next == clus + 1 && exfat_heap_clus(exfat, next)) {
+		exfat_bitmap_set(map->seq_bitmap, clus);
+	} else if (next == EXFAT_EOF_CLUSTER) {
+		exfat_bitmap_set(map->eof_bitmap, clus);
+	} else if (next != EXFAT_FREE_CLUSTER) {
+		if (map->jump_count == map->jump_max) {
+			/* the FAT cache is authoritative from now on */
+			map->complete = false;
+			goto out;
+		}
+		memmove(&map->jumps[i + 1], &map->jumps[i],
+			(map->jump_count - i) * sizeof(*map->jumps));
+		map->jumps[i].clus = clus;
+		map->jumps[i].next = next;
+		map->jump_count++;
+	}
+
+out:
+	/* a compressed bitmap ran out of memory, stop trusting the map */
+	if (map->seq_bitmap->err || map->eof_bitmap->err)
+		exfat_fat_map_free(exfat);
+}
+
+void exfat_fat_map_free(struct exfat *exfat)
+{
+	struct exfat_fat_map *map = exfat->fat_map;
+
+	if (!map)
+		return;
+
+	exfat_bitmap_free(map->seq_bitmap);
+	exfat_bitmap_free(map->eof_bitmap);
+	if (map->jumps)
+		w_free(map->jumps);
+	w_free(map);
+	exfat->fat_map = NULL;
+}
+
+/*
+ * read the whole FAT once in @chunk_size pieces and build the FAT map,
+ * which answers exfat_get_next_clus() without I/O afterwards. While
+ * sweeping, count in-degrees of clusters to classify chain heads,
+ * cross-linked clusters and dangling links into @stat.
+ */
+int exfat_fat_sweep(struct exfat *exfat, unsigned int chunk_size,
+		    unsigned int jump_max, struct exfat_fat_sweep_stat *stat)
+{
+	struct exfat_fat_map *map;
+	struct exfat_bitmap *ref_bitmap = NULL;
+	__le32 *chunk = NULL;
+	clus_t clus, end, next, referenced;
+	unsigned int i, count;
+	off64_t fat_start;
+	int ret = -ENOMEM;
+
+	memset(stat, 0, sizeof(*stat));
+	exfat_fat_map_free(exfat);
+
+	/* the sweep reads the FAT without the cache */
+	if (exfat_fat_cache_flush(exfat))
+		return -EIO;
+
+	chunk_size = round_down(MAX(chunk_size, exfat->sect_size),
+				exfat->sect_size);
+
+	map = w_calloc(1, sizeof(*map));
+	if (!map)
+		return -ENOMEM;
+	exfat->fat_map = map;
+
+	map->seq_bitmap = exfat_bitmap_alloc(&exfat->bitmap_opts,
+				     exfat->clus_count);
+	map->eof_bitmap = exfat_bitmap_alloc(&exfat->bitmap_opts,
+				     exfat->clus_count);
+	map->jumps = w_malloc(MAX(jump_max, 1) * sizeof(*map->jumps));
+	ref_bitmap = exfat_bitmap_alloc(&exfat->bitmap_opts, exfat->clus_count);
+	chunk = w_malloc(chunk_size);
+	if (!map->seq_bitmap || !map->eof_bitmap || !map->jumps ||
+	    !ref_bitmap || !chunk)
+		goto err;
+
+	map->jump_max = jump_max;
+	map->complete = true;
+
+	fat_start = exfat_fat_offset(exfat);
+	end = exfat->clus_count + EXFAT_FIRST_CLUSTER;
+	for (clus = 0; clus < end; clus += count) {
+		count = MIN(chunk_size / sizeof(__le32), end - clus);
+		if (exfat_read(exfat->blk_dev->dev_fd, chunk,
+			       count * sizeof(__le32),
+			       fat_start + (off64_t)clus * sizeof(__le32)) !=
+		    (ssize64_t)(count * sizeof(__le32))) {
+			ret = -EIO;
+			goto err;
+		}
+
+		for (i = 0; i < count; i++) {
+			clus_t c = clus + i;
+
+			next = le32_to_cpu(chunk[i]);
+			if (c < EXFAT_FIRST_CLUSTER || next == EXFAT_FREE_CLUSTER)
+				continue;
+
+			stat->used++;
+			if (next == EXFAT_EOF_CLUSTER) {
+				exfat_bitmap_set(map->eof_bitmap, c);
+				continue;
+			}
+
+			if (next == EXFAT_BAD_CLUSTER) {
+				stat->bad++;
+			} else if (!exfat_heap_clus(exfat, next)) {
+				stat->dangling++;
+			} else if (exfat_bitmap_get(ref_bitmap, next)) {
+				stat->cross_links++;
+			} else {
+				exfat_bitmap_set(ref_bitmap, next);
+			}
+
+			if (next == c + 1 && exfat_heap_clus(exfat, next)) {
+				exfat_bitmap_set(map->seq_bitmap, c);
+				continue;
+			}
+
+			stat->jumps++;
+			if (map->jump_count < map->jump_max) {
+				map->jumps[map->jump_count].clus = c;
+				map->jumps[map->jump_count].next = next;
+				map->jump_count++;
+			} else {
+				map->complete = false;
+			}
+		}
+	}
+
+	if (map->seq_bitmap->err || map->eof_bitmap->err || ref_bitmap->err)
+		goto err;
+
+	/*
+	 * a referenced cluster whose entry is free ends a dangling link,
+	 * and used entries which are not referenced start chains.
+	 */
+	if (map->complete) {
+		referenced = 0;
+		for (clus = EXFAT_FIRST_CLUSTER; clus < end; clus++) {
+			if (!exfat_bitmap_get(ref_bitmap, clus))
+				continue;
+			fat_map_lookup(map, clus, &next);
+			if (next == EXFAT_FREE_CLUSTER)
+				stat->dangling++;
+			else
+				referenced++;
+		}
+		stat->heads = stat->used - referenced;
+	}
+
+	w_free(chunk);
+	exfat_bitmap_free(ref_bitmap);
+	return 0;
+err:
+	if (chunk)
+		w_free(chunk);
+	exfat_bitmap_free(ref_bitmap);
+	exfat_fat_map_free(exfat);
+	return ret;
+}
+
 int exfat_get_next_clus(struct exfat *exfat, clus_t clus, clus_t *next)
 {
+	struct fat_cache_line *line;
 	off64_t offset;
+	int ret;
 
 	*next = EXFAT_EOF_CLUSTER;
 
 	if (!exfat_heap_clus(exfat, clus))
 		return -EINVAL;
 
-	offset = (off64_t)le32_to_cpu(exfat->bs->bsx.fat_offset) <<
-				exfat->bs->bsx.sect_size_bits;
-	offset += sizeof(clus_t) * clus;
+	if (exfat->fat_map && !fat_map_lookup(exfat->fat_map, clus, next))
+		return 0;
+
+	offset = exfat_fat_offset(exfat) + sizeof(clus_t) * clus;
+
+	if (exfat->fat_cache) {
+		ret = fat_cache_get_line(exfat, offset, &line);
+		if (!ret) {
+			memcpy(next, line->buffer + (offset - line->offset),
+			       sizeof(*next));
+			*next = le32_to_cpu(*next);
+			return 0;
+		} else if (ret != -ERANGE) {
+			return ret;
+		}
+	}
 
 	if (exfat_read(exfat->blk_dev->dev_fd, next, sizeof(*next), offset)
 			!= sizeof(*next))
@@ -933,11 +1550,27 @@ int exfat_get_inode_next_clus(struct exfat *exfat, struct exfat_inode *node,
 
 int exfat_set_fat(struct exfat *exfat, clus_t clus, clus_t next_clus)
 {
+	struct fat_cache_line *line;
 	off64_t offset;
+	int ret;
 
-	offset = le32_to_cpu(exfat->bs->bsx.fat_offset) <<
-		exfat->bs->bsx.sect_size_bits;
-	offset += sizeof(clus_t) * clus;
+	if (exfat->fat_map && exfat_heap_clus(exfat, clus))
+		fat_map_update(exfat, clus, next_clus);
+
+	offset = exfat_fat_offset(exfat) + sizeof(clus_t) * clus;
+	next_clus = cpu_to_le32(next_clus);
+
+	if (exfat->fat_cache) {
+		ret = fat_cache_get_line(exfat, offset, &line);
+		if (!ret) {
+			memcpy(line->buffer + (offset - line->offset),
+			       &next_clus, sizeof(next_clus));
+			line->dirty = true;
+			return 0;
+		} else if (ret != -ERANGE) {
+			return ret;
+		}
+	}
 
 	if (exfat_write(exfat->blk_dev->dev_fd, &next_clus, sizeof(next_clus),
 			offset) != sizeof(next_clus))
@@ -996,7 +1629,7 @@ int exfat_root_clus_count(struct exfat *exfat)
 		if (exfat_bitmap_get(exfat->alloc_bitmap, clus))
 			return -EINVAL;
 
-		exfat_bitmap_set(exfat->alloc_bitmap, clus);
+		exfat_alloc_bitmap_set(exfat, clus);
 
 		if (exfat_get_inode_next_clus(exfat, node, clus, &next)) {
 			exfat_err("ERROR: failed to read the fat entry of root");
@@ -1079,19 +1712,12 @@ int exfat_parse_ulong(const char *s, unsigned long *out)
 	return 0;
 }
 
-static inline int check_bad_utf16_char(unsigned short w)
-{
-	return (w < 0x0020) || (w == '*') || (w == '?') || (w == '<') ||
-		(w == '>') || (w == '|') || (w == '"') || (w == ':') ||
-		(w == '/') || (w == '\\');
-}
-
 int exfat_check_name(__le16 *utf16_name, int len)
 {
 	int i;
 
 	for (i = 0; i < len; i++) {
-		if (check_bad_utf16_char(le16_to_cpu(utf16_name[i])))
+		if (exfat_bad_name_char(le16_to_cpu(utf16_name[i])))
 			break;
 	}
 
@@ -0,0 +1,166 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Time the checksum and name hash kernels against the byte at a time
+ *   reference ones: a boot sector, a whole upcase table, a three dentry
+ *   file set and the longest name. the speed is in bytes per cycle, the
+ *   cycles are counted by the TSC on x86, or from a clock in MHz given as
+ *   the second argument.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "exfat_ondisk.h"
+#include "libexfat.h"
+#include "exfat_fs.h"
+#include "exfat_dir.h"
+#include "checksum_ref.h"
+
+#define BENCH_UPCASE_SIZE	(EXFAT_UPCASE_TABLE_CHARS * sizeof(__le16))
+#define BENCH_DSET_COUNT	3
+
+static unsigned char *buf;
+static struct exfat_dentry dset[BENCH_DSET_COUNT];
+static __le16 name[EXFAT_NAME_MAX];
+static struct exfat exfat;
+
+/* keeps the sums from being optimized away */
+static volatile __u32 sink;
+/* 0 if there is no way to count cycles, bytes per ns are shown then */
+static double cycles_per_ns;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void boot_sector(bool ref)
+{
+	__le32 sum = 0;
+
+	if (ref)
+		boot_calc_checksum_ref(buf, 512, true, &sum);
+	else
+		boot_calc_checksum(buf, 512, true, &sum);
+	sink += sum;
+}
+
+static void upcase_table(bool ref)
+{
+	__le32 sum = 0;
+
+	if (ref)
+		boot_calc_checksum_ref(buf, BENCH_UPCASE_SIZE, false, &sum);
+	else
+		boot_calc_checksum(buf, BENCH_UPCASE_SIZE, false, &sum);
+	sink += sum;
+}
+
+static void dentry_set(bool ref)
+{
+	uint16_t sum = 0;
+	int i;
+
+	for (i = 0; i < BENCH_DSET_COUNT; i++) {
+		if (ref)
+			exfat_calc_dentry_checksum_ref(&dset[i], &sum, i == 0);
+		else
+			exfat_calc_dentry_checksum(&dset[i], &sum, i == 0);
+	}
+	sink += sum;
+}
+
+static void name_hash(bool ref)
+{
+	if (ref)
+		sink += exfat_calc_name_hash_ref(&exfat, name, EXFAT_NAME_MAX);
+	else
+		sink += exfat_calc_name_hash(&exfat, name, EXFAT_NAME_MAX);
+}
+
+/* the TSC rate against the monotonic clock, over 50ms */
+static void calibrate_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	double start = now_ns(), end;
+	unsigned long long tsc = __rdtsc();
+
+	do {
+		end = now_ns();
+	} while (end - start < 50e6);
+	cycles_per_ns = (__rdtsc() - tsc) / (end - start);
+#endif
+}
+
+/* bytes per cycle, or per ns if cycles can not be counted */
+static double speed(size_t bytes, double ns)
+{
+	return cycles_per_ns ? bytes / (ns * cycles_per_ns) : bytes / ns;
+}
+
+static void bench(const char *what, void (*fn)(bool ref), size_t bytes,
+		  unsigned long loops)
+{
+	double start, ref_ns, new_ns;
+	unsigned long i;
+
+	start = now_ns();
+	for (i = 0; i < loops; i++)
+		fn(true);
+	ref_ns = (now_ns() - start) / loops;
+
+	start = now_ns();
+	for (i = 0; i < loops; i++)
+		fn(false);
+	new_ns = (now_ns() - start) / loops;
+
+	printf("%-14s %10.3f %10.3f %5.2fx\n", what, speed(bytes, ref_ns),
+	       speed(bytes, new_ns), ref_ns / new_ns);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long loops = 20000;
+	size_t i;
+
+	if (argc > 1)
+		loops = strtoul(argv[1], NULL, 0) ?: loops;
+	if (argc > 2)
+		cycles_per_ns = strtod(argv[2], NULL) / 1000;
+	else
+		calibrate_cycles();
+
+	buf = malloc(BENCH_UPCASE_SIZE);
+	/* an identity table: every page shares one page of zero deltas */
+	exfat.upcase_data = calloc(EXFAT_UPCASE_PAGE_CHARS, sizeof(__u16));
+	if (!buf || !exfat.upcase_data) {
+		fprintf(stderr, "failed to allocate buffers\n");
+		return 1;
+	}
+	srand(1);
+	for (i = 0; i < BENCH_UPCASE_SIZE; i++)
+		buf[i] = (unsigned char)rand();
+	for (i = 0; i < EXFAT_UPCASE_PAGES; i++)
+		exfat.upcase_pages[i] = exfat.upcase_data;
+	memcpy(dset, buf, sizeof(dset));
+	memcpy(name, buf, sizeof(name));
+
+	printf("%-14s %10s %10s %6s  (%s)\n", "kernel", "reference",
+	       "current", "gain", cycles_per_ns ? "bytes/cycle" : "bytes/ns");
+	bench("boot sector", boot_sector, 512, loops);
+	bench("upcase table", upcase_table, BENCH_UPCASE_SIZE, loops / 100 ?: 1);
+	bench("dentry set", dentry_set, sizeof(dset), loops * 10);
+	bench("name hash", name_hash, sizeof(name), loops);
+
+	free(exfat.upcase_data);
+	free(buf);
+	return 0;
+}
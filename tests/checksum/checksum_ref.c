@@ -0,0 +1,69 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   The byte at a time checksum and name hash loops, which the kernels
+ *   of libexfat are checked and timed against. They are built for the
+ *   tests only.
+ */
+
+#include "checksum_ref.h"
+
+void boot_calc_checksum_ref(unsigned char *sector, unsigned int size,
+		bool is_boot_sec, __le32 *checksum)
+{
+	unsigned int index;
+
+	if (is_boot_sec) {
+		for (index = 0; index < size; index++) {
+			if ((index == 106) || (index == 107) || (index == 112))
+				continue;
+			*checksum = ((*checksum & 1) ? 0x80000000 : 0) +
+				(*checksum >> 1) + sector[index];
+		}
+	} else {
+		for (index = 0; index < size; index++) {
+			*checksum = ((*checksum & 1) ? 0x80000000 : 0) +
+				(*checksum >> 1) + sector[index];
+		}
+	}
+}
+
+void exfat_calc_dentry_checksum_ref(struct exfat_dentry *dentry,
+				    uint16_t *checksum, bool primary)
+{
+	unsigned int i;
+	uint8_t *bytes;
+
+	bytes = (uint8_t *)dentry;
+
+	/* use += to avoid promotion to int; UBSan complaints about signed overflow */
+	*checksum = (*checksum << 15) | (*checksum >> 1);
+	*checksum += bytes[0];
+	*checksum = (*checksum << 15) | (*checksum >> 1);
+	*checksum += bytes[1];
+
+	i = primary ? 4 : 2;
+	for (; i < sizeof(*dentry); i++) {
+		*checksum = (*checksum << 15) | (*checksum >> 1);
+		*checksum += bytes[i];
+	}
+}
+
+uint16_t exfat_calc_name_hash_ref(struct exfat *exfat,
+				  __le16 *name, int len)
+{
+	int i;
+	__le16 ch;
+	uint16_t chksum = 0;
+
+	for (i = 0; i < len; i++) {
+		ch = exfat_upcase(exfat, le16_to_cpu(name[i]));
+		ch = cpu_to_le16(ch);
+
+		/* use += to avoid promotion to int; UBSan complaints about signed overflow */
+		chksum = (chksum << 15) | (chksum >> 1);
+		chksum += ch & 0xFF;
+		chksum = (chksum << 15) | (chksum >> 1);
+		chksum += ch >> 8;
+	}
+	return chksum;
+}
@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef _CHECKSUM_REF_H
+#define _CHECKSUM_REF_H
+
+#include "exfat_ondisk.h"
+#include "libexfat.h"
+#include "exfat_fs.h"
+
+void boot_calc_checksum_ref(unsigned char *sector, unsigned int size,
+		bool is_boot_sec, __le32 *checksum);
+void exfat_calc_dentry_checksum_ref(struct exfat_dentry *dentry,
+				    uint16_t *checksum, bool primary);
+uint16_t exfat_calc_name_hash_ref(struct exfat *exfat,
+				  __le16 *name, int len);
+
+#endif
@@ -0,0 +1,182 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Randomized check that the checksum and name hash kernels give the
+ *   same sums as the byte at a time reference ones.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "exfat_ondisk.h"
+#include "libexfat.h"
+#include "exfat_fs.h"
+#include "exfat_dir.h"
+#include "checksum_ref.h"
+
+#define TEST_ROUNDS		20000
+#define TEST_MAX_SIZE		4096
+#define TEST_UPCASE_SIZE	(EXFAT_UPCASE_TABLE_CHARS * sizeof(__le16))
+
+static __u32 rng_state = 0x2545f491;
+
+/* xorshift, so a failing seed can be run again */
+static __u32 rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static void fill_random(void *buf, size_t size)
+{
+	unsigned char *p = buf;
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		p[i] = (unsigned char)rng();
+}
+
+static int check_boot(unsigned char *buf, unsigned int size, bool is_boot_sec)
+{
+	__le32 sum, ref;
+
+	sum = ref = rng();
+	boot_calc_checksum(buf, size, is_boot_sec, &sum);
+	boot_calc_checksum_ref(buf, size, is_boot_sec, &ref);
+	if (sum != ref) {
+		fprintf(stderr, "boot sum of %u bytes%s: %#x, expected %#x\n",
+			size, is_boot_sec ? " of a boot sector" : "",
+			sum, ref);
+		return 1;
+	}
+	return 0;
+}
+
+static int check_dentry(struct exfat_dentry *dentry, bool primary)
+{
+	uint16_t sum, ref;
+
+	sum = ref = (uint16_t)rng();
+	exfat_calc_dentry_checksum(dentry, &sum, primary);
+	exfat_calc_dentry_checksum_ref(dentry, &ref, primary);
+	if (sum != ref) {
+		fprintf(stderr, "dentry sum%s: %#x, expected %#x\n",
+			primary ? " of a primary dentry" : "", sum, ref);
+		return 1;
+	}
+	return 0;
+}
+
+static int check_name_hash(struct exfat *exfat, __le16 *name, int len)
+{
+	uint16_t hash, ref;
+
+	hash = exfat_calc_name_hash(exfat, name, len);
+	ref = exfat_calc_name_hash_ref(exfat, name, len);
+	if (hash != ref) {
+		fprintf(stderr, "name hash of %d characters: %#x, expected %#x\n",
+			len, hash, ref);
+		return 1;
+	}
+	return 0;
+}
+
+/* the sums of the fused dentry set check against the reference ones */
+static int check_dentry_set(struct exfat *exfat)
+{
+	struct exfat_dentry dset[MAX_NAME_DENTRIES + 2];
+	__le16 name[MAX_NAME_DENTRIES * ENTRY_NAME_MAX + 1];
+	struct exfat_dset_check chk;
+	int i, k, count, name_dentries;
+	uint16_t sum = 0, hash;
+
+	name_dentries = 1 + rng() % MAX_NAME_DENTRIES;
+	count = 2 + name_dentries;
+	fill_random(dset, count * sizeof(struct exfat_dentry));
+	dset[0].type = EXFAT_FILE;
+	dset[1].type = EXFAT_STREAM;
+	for (i = 2; i < count; i++) {
+		dset[i].type = EXFAT_NAME;
+		/* some names end early */
+		if (rng() % 8 == 0) {
+			k = rng() % ENTRY_NAME_MAX;
+			dset[i].name_unicode[k] = 0;
+		}
+	}
+
+	memset(name, 0, sizeof(name));
+	exfat_check_dentry_set(exfat, dset, count, name_dentries, name, &chk);
+
+	for (i = 0; i < count; i++)
+		exfat_calc_dentry_checksum_ref(&dset[i], &sum, i == 0);
+	hash = exfat_calc_name_hash_ref(exfat, name, chk.name_len);
+	if (chk.checksum != sum || chk.name_hash != hash) {
+		fprintf(stderr, "dentry set of %d: sum %#x hash %#x, expected %#x %#x\n",
+			count, chk.checksum, chk.name_hash, sum, hash);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct exfat exfat;
+	struct exfat_dentry dentry;
+	unsigned char *buf;
+	__le16 name[EXFAT_NAME_MAX];
+	unsigned int i, size;
+	int len, err = 0;
+
+	if (argc > 1)
+		rng_state = (__u32)strtoul(argv[1], NULL, 0) ?: rng_state;
+	printf("checksum_test: seed %#x\n", rng_state);
+
+	memset(&exfat, 0, sizeof(exfat));
+	exfat.upcase_data = malloc(TEST_UPCASE_SIZE);
+	buf = malloc(TEST_UPCASE_SIZE);
+	if (!exfat.upcase_data || !buf) {
+		fprintf(stderr, "failed to allocate buffers\n");
+		return 1;
+	}
+	fill_random(exfat.upcase_data, TEST_UPCASE_SIZE);
+	for (i = 0; i < EXFAT_UPCASE_PAGES; i++)
+		exfat.upcase_pages[i] = exfat.upcase_data +
+			i * EXFAT_UPCASE_PAGE_CHARS;
+
+	/* every short size, around the skipped bytes of a boot sector */
+	fill_random(buf, TEST_MAX_SIZE);
+	for (size = 0; size <= 520; size++) {
+		err |= check_boot(buf, size, true);
+		err |= check_boot(buf, size, false);
+	}
+
+	/* a whole upcase table */
+	fill_random(buf, TEST_UPCASE_SIZE);
+	err |= check_boot(buf, TEST_UPCASE_SIZE, false);
+
+	for (i = 0; i < TEST_ROUNDS && !err; i++) {
+		size = rng() % (TEST_MAX_SIZE + 1);
+		fill_random(buf, size);
+		err |= check_boot(buf, size, rng() & 1);
+
+		fill_random(&dentry, sizeof(dentry));
+		err |= check_dentry(&dentry, rng() & 1);
+
+		len = rng() % (EXFAT_NAME_MAX + 1);
+		fill_random(name, len * sizeof(__le16));
+		err |= check_name_hash(&exfat, name, len);
+
+		err |= check_dentry_set(&exfat);
+	}
+
+	free(exfat.upcase_data);
+	free(buf);
+	if (err) {
+		printf("checksum_test: FAILED\n");
+		return 1;
+	}
+	printf("checksum_test: %d rounds passed\n", TEST_ROUNDS);
+	return 0;
+}
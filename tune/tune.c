@@ -137,7 +137,7 @@ int main(int argc, char *argv[])
 	if (ret)
 		goto close_fd_out;
 
-	exfat = exfat_alloc_exfat(&bd, bs);
+	exfat = exfat_alloc_exfat(&bd, bs, NULL);
 	if (!exfat) {
 		ret = -ENOMEM;
 		goto close_fd_out;
@@ -5,6 +5,7 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include "FreeRTOS.h"
 #include "mem_wrapper.h"
 #include <string.h>
@@ -12,6 +13,114 @@
 #include <errno.h>
 #include "log.h"
 
+static struct w_mem_stats mem_stats;
+
+static void *w_mem_account(union w_mem_header *hdr, size_t size)
+{
+    if (!hdr)
+    {
+        mem_stats.failures++;
+        return NULL;
+    }
+
+    hdr->size = size;
+    mem_stats.used += size;
+    if (mem_stats.used > mem_stats.peak)
+        mem_stats.peak = mem_stats.used;
+    return hdr + 1;
+}
+
+/* return false if @size more bytes would go past the limit */
+static int w_mem_fits(size_t size)
+{
+    if (mem_stats.limit && (size > mem_stats.limit ||
+                            mem_stats.used > mem_stats.limit - size))
+    {
+        mem_stats.failures++;
+        return 0;
+    }
+    return 1;
+}
+
+/***
+ * @brief Allocate memory and account for it
+ *
+ * @param size Number of bytes
+ * @return NULL if the heap is exhausted or the limit would be exceeded
+ */
+void *w_mem_malloc(size_t size)
+{
+    size_t total = sizeof(union w_mem_header) + size;
+
+    if (total < size || !w_mem_fits(total))
+        return NULL;
+    return w_mem_account(pvPortMalloc(total), total);
+}
+
+/***
+ * @brief Allocate zeroed memory for an array and account for it
+ *
+ * @param num Number of elements
+ * @param size Size of an element
+ * @return NULL if the heap is exhausted or the limit would be exceeded
+ */
+void *w_mem_calloc(size_t num, size_t size)
+{
+    size_t total;
+
+    if (size && num > (SIZE_MAX - sizeof(union w_mem_header)) / size)
+    {
+        mem_stats.failures++;
+        return NULL;
+    }
+
+    total = sizeof(union w_mem_header) + num * size;
+    if (!w_mem_fits(total))
+        return NULL;
+    return w_mem_account(pvPortCalloc(1, total), total);
+}
+
+/***
+ * @brief Free memory from w_mem_malloc() or w_mem_calloc()
+ *
+ * @param ptr Pointer to the memory, may be NULL
+ */
+void w_mem_free(void *ptr)
+{
+    union w_mem_header *hdr;
+
+    if (!ptr)
+        return;
+
+    hdr = (union w_mem_header *)ptr - 1;
+    mem_stats.used -= hdr->size;
+    vPortFree(hdr);
+}
+
+/***
+ * @brief Refuse allocations which would put more than @limit bytes in use
+ *
+ * @param limit Number of bytes, 0 for no limit
+ */
+void w_mem_set_limit(size_t limit)
+{
+    mem_stats.limit = limit;
+}
+
+/***
+ * @brief Start a new peak from the bytes in use now
+ */
+void w_mem_reset_peak(void)
+{
+    mem_stats.peak = mem_stats.used;
+    mem_stats.failures = 0;
+}
+
+void w_mem_get_stats(struct w_mem_stats *stats)
+{
+    *stats = mem_stats;
+}
+
 /***
  * @brief Convert a multibyte string to a wide character string
  *
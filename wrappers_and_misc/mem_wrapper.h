@@ -8,6 +8,7 @@
 #define MEM_WRAPPER_H
 
 #include <stdlib.h>
+#include <stdint.h>
 #include "FreeRTOS.h"
 #include <string.h>
 #include <wchar.h>
@@ -18,10 +19,40 @@
 // void w_free(void *ptr);
 
 
+/***
+ * Heap accounting of w_malloc(), w_calloc() and w_free(). Each block
+ * carries its size in a header, so the bytes in use and their peak are
+ * known and a limit can be enforced before the heap itself runs out.
+ */
+struct w_mem_stats
+{
+    size_t used;            // bytes in use, headers included
+    size_t peak;            // most bytes in use since the last reset
+    size_t limit;           // 0 for no limit
+    unsigned long failures; // allocations refused or failed
+};
+
+/* keeps the blocks after the size header 8-byte aligned */
+union w_mem_header
+{
+    size_t size;
+    uint64_t align;
+};
+
+/* heap taken by a block of @size bytes, as the limit counts it */
+#define W_MEM_SIZE(size) (sizeof(union w_mem_header) + (size))
+
+void *w_mem_malloc(size_t size);
+void *w_mem_calloc(size_t num, size_t size);
+void w_mem_free(void *ptr);
+void w_mem_set_limit(size_t limit);
+void w_mem_reset_peak(void);
+void w_mem_get_stats(struct w_mem_stats *stats);
+
 // Макрос для замены w_malloc
 #define w_malloc(size) \
     ({ \
-        void *ptr = pvPortMalloc(size); \
+        void *ptr = w_mem_malloc(size); \
         logD("line: %d, malloc %d bytes, ptr = %p",  __LINE__, (int)size, ptr); \
         ptr; \
     })
@@ -29,7 +60,7 @@
 // Макрос для замены w_calloc
 #define w_calloc(num, size) \
     ({ \
-        void *ptr = pvPortCalloc(num, size); \
+        void *ptr = w_mem_calloc(num, size); \
         logD("line: %d, calloc %d bytes, ptr = %p",  __LINE__, (int)(num * size), ptr); \
         ptr; \
     })
@@ -38,7 +69,7 @@
 #define w_free(ptr) \
     do { \
         logD("line: %d, free ptr = %p",  __LINE__, ptr); \
-        vPortFree(ptr); \
+        w_mem_free(ptr); \
     } while (0)
 
 